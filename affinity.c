@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define MAX_NODES 1024
+
+int affinity_parse(char *list, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*list) {
+		lo = strtol(list, &end, 10);
+		if (end == list || lo < 0) {
+			return -1;
+		}
+		hi = lo;
+		if (*end == '-') {
+			list = end + 1;
+			hi = strtol(list, &end, 10);
+			if (end == list || hi < lo) {
+				return -1;
+			}
+		}
+		if (hi >= CPU_SETSIZE) {
+			return -1;
+		}
+		for (; lo <= hi; lo++) {
+			CPU_SET(lo, set);
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end) {
+			return -1;
+		}
+		list = end;
+	}
+
+	return CPU_COUNT(set) ? CPU_COUNT(set) : -1;
+}
+
+int affinity_cpu(cpu_set_t *set, int index)
+{
+	int cpu;
+
+	index %= CPU_COUNT(set);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, set) && !index--) {
+			return cpu;
+		}
+	}
+
+	return -1;
+}
+
+int affinity_pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int affinity_node(int cpu)
+{
+	char path[64];
+	int node;
+
+	for (node = 0; node < MAX_NODES; node++) {
+		snprintf(path, sizeof(path),
+		    "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if (access(path, F_OK) == 0) {
+			return node;
+		}
+	}
+
+	return -1;
+}
+
+int affinity_bind(void *addr, size_t len, int node)
+{
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+
+	if (node < 0 || node >= MAX_NODES) {
+		return -1;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] |=
+	    1UL << (node % (8 * sizeof(unsigned long)));
+
+	return syscall(__NR_mbind, addr, len, MPOL_BIND, mask, MAX_NODES, 0);
+}
+
+steque_item affinity_pop(steque_t *q, int (*node_of)(steque_item), int node)
+{
+	steque_item item;
+	int i, n = steque_size(q);
+
+	if (node < 0) {
+		return steque_pop(q);
+	}
+	for (i = 0; i < n; i++) {
+		if (node_of(steque_front(q)) == node) {
+			break;
+		}
+		steque_cycle(q);
+	}
+	if (i == n) {
+		/* Nothing for this node, and a full cycle restored the order */
+		return steque_pop(q);
+	}
+	item = steque_pop(q);
+	/* Put the items that were ahead of the match back in front */
+	for (n -= i + 1; n > 0; n--) {
+		steque_cycle(q);
+	}
+
+	return item;
+}
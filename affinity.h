@@ -0,0 +1,42 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+/* cpu_set_t needs _GNU_SOURCE to be defined before any system header. */
+#include <sched.h>
+#include <stddef.h>
+
+#include "steque.h"
+
+/*
+ * Parses a CPU list such as "0-3,8,10-11" into set.  Returns the number
+ * of CPUs in the list, or -1 if it is malformed.
+ */
+int affinity_parse(char *list, cpu_set_t *set);
+
+/*
+ * Returns the CPU the index-th worker should run on, going round-robin
+ * over the CPUs in set.
+ */
+int affinity_cpu(cpu_set_t *set, int index);
+
+/* Pins the calling thread to cpu.  Returns 0 on success. */
+int affinity_pin(int cpu);
+
+/* Returns the NUMA node cpu belongs to, or -1 if it is not known. */
+int affinity_node(int cpu);
+
+/*
+ * Binds the pages of the mapping at addr to node.  For a shared memory
+ * segment the policy sticks to the segment itself, so it also applies
+ * to the mappings made by the other process.
+ */
+int affinity_bind(void *addr, size_t len, int node);
+
+/*
+ * Pops the first item of q that node_of says lives on node, or the front
+ * item if there is none, leaving the order of the other items as it was.
+ * q must not be empty.
+ */
+steque_item affinity_pop(steque_t *q, int (*node_of)(steque_item), int node);
+
+#endif
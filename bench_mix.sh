@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Runs a mix of small and large objects through webproxy and simplecached
+# under each request scheduling policy of simplecached (-s) and reports
+# the latency percentiles per object size class, which is where the
+# policies differ: the small objects stuck behind large ones.
+#
+# usage: sh bench_mix.sh [requests]
+#
+# Run from the source tree after make.  The corpus is NSMALL (default
+# 256) files of 4 KB, NMEDIUM (default 32) of 128 KB and NLARGE
+# (default 4) of 4 MB, asked for in proportion to their number.  THREADS
+# (default 8) is the worker count of either process and the number of
+# clients; the cache has THREADS / 2 workers, so requests queue up.
+
+REQUESTS=${1:-4000}
+NSMALL=${NSMALL:-256}
+NMEDIUM=${NMEDIUM:-32}
+NLARGE=${NLARGE:-4}
+THREADS=${THREADS:-8}
+PORT=${PORT:-18892}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+trap 'kill -9 $CACHE $PROXY 2>/dev/null; rm -rf $DIR' EXIT
+
+# corpus name count kb
+corpus() {
+	i=0
+	while [ $i -lt $2 ]; do
+		head -c $(($3 * 1024)) /dev/urandom > $DIR/$1$i
+		echo "/mix/$1$i $DIR/$1$i" >> $DIR/locals.txt
+		echo "/mix/$1$i" >> $DIR/paths.txt
+		i=$((i + 1))
+	done
+}
+corpus small $NSMALL 4
+corpus medium $NMEDIUM 128
+corpus large $NLARGE 4096
+# gfbench goes through the paths in turn, so interleave the sizes
+shuf --random-source=$DIR/small0 $DIR/paths.txt > $DIR/workload.txt
+
+for policy in fifo sof lanes; do
+	echo "== -s $policy"
+	./simplecached -c $DIR/locals.txt -t $((THREADS / 2)) -s $policy \
+	    > $DIR/cached.log 2>&1 &
+	CACHE=$!
+	./webproxy -p $PORT -t $THREADS -n $THREADS -z 65536 \
+	    > $DIR/proxy.log 2>&1 &
+	PROXY=$!
+	sleep 1
+	./gfbench -p $PORT -t $THREADS -w $DIR/workload.txt -r $REQUESTS \
+	    -L 16k,256k
+	kill -9 $CACHE $PROXY
+	wait $CACHE $PROXY 2>/dev/null
+done
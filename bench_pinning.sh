@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Compares throughput with the worker threads of webproxy and
+# simplecached pinned to CPUs (-a, with segments bound to the NUMA node
+# of the worker that uses them) against leaving them to the scheduler.
+# The files stay in the page cache, so the runs measure the CPUs and the
+# memory the transfers go through, not the disk.
+#
+# usage: sh bench_pinning.sh [cpu_list] [nfiles] [file_kb] [requests]
+#
+# Run from the source tree after make.  cpu_list defaults to every CPU.
+# The two setups take turns, ROUNDS (default 3) times each, so drift on
+# the machine hits both alike.  THREADS (default 8) is the worker count
+# of either process and the number of clients.
+
+CPUS=${1:-0-$(($(nproc) - 1))}
+NFILES=${2:-64}
+FILE_KB=${3:-256}
+REQUESTS=${4:-4000}
+THREADS=${THREADS:-8}
+ROUNDS=${ROUNDS:-3}
+PORT=${PORT:-18891}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+trap 'kill -9 $CACHE $PROXY 2>/dev/null; rm -rf $DIR' EXIT
+
+i=0
+while [ $i -lt $NFILES ]; do
+	head -c $((FILE_KB * 1024)) /dev/urandom > $DIR/$i
+	echo "/bench/$i $DIR/$i" >> $DIR/locals.txt
+	echo "/bench/$i" >> $DIR/workload.txt
+	i=$((i + 1))
+done
+
+# run [-a cpu_list]
+run() {
+	./simplecached -c $DIR/locals.txt -t $THREADS "$@" \
+	    > $DIR/cached.log 2>&1 &
+	CACHE=$!
+	./webproxy -p $PORT -t $THREADS -n $THREADS -z 65536 "$@" \
+	    > $DIR/proxy.log 2>&1 &
+	PROXY=$!
+	sleep 1
+	./gfbench -p $PORT -t $THREADS -w $DIR/workload.txt -r $REQUESTS \
+	    -C $CACHE -C $PROXY
+	kill -9 $CACHE $PROXY
+	wait $CACHE $PROXY 2>/dev/null
+}
+
+round=1
+while [ $round -le $ROUNDS ]; do
+	echo "== round $round: unpinned"
+	run
+	echo "== round $round: pinned to $CPUS"
+	run -a $CPUS
+	round=$((round + 1))
+done
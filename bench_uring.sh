@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Compares simplecached's io_uring workers (-u) with its blocking
+# thread-per-request workers on a cold page cache: before every run the
+# page cache is dropped, so each request reads its file from disk.
+# Dropping the page cache needs root, without it the runs are warm and
+# the script says so.
+#
+# usage: sh bench_uring.sh [nfiles] [file_kb] [requests]
+#
+# By default every file is asked for once, so every request misses the
+# page cache.
+#
+# Run from the source tree after make.  THREADS (default 16) is the
+# number of blocking workers, and the requests the io_uring workers keep
+# in flight between them.
+
+NFILES=${1:-512}
+FILE_KB=${2:-1024}
+REQUESTS=${3:-$NFILES}
+THREADS=${THREADS:-16}
+PORT=${PORT:-18890}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+trap 'kill -9 $CACHE $PROXY 2>/dev/null; rm -rf $DIR' EXIT
+
+i=0
+while [ $i -lt $NFILES ]; do
+	head -c $((FILE_KB * 1024)) /dev/urandom > $DIR/$i
+	echo "/bench/$i $DIR/$i" >> $DIR/locals.txt
+	echo "/bench/$i" >> $DIR/workload.txt
+	i=$((i + 1))
+done
+
+run() {
+	sync
+	if ! echo 1 2>/dev/null > /proc/sys/vm/drop_caches; then
+		echo "(cannot drop the page cache, this run is warm)"
+	fi
+	./simplecached -c $DIR/locals.txt "$@" > $DIR/cached.log 2>&1 &
+	CACHE=$!
+	./webproxy -p $PORT -t $THREADS -n $THREADS -z 65536 \
+	    > $DIR/proxy.log 2>&1 &
+	PROXY=$!
+	sleep 1
+	./gfbench -p $PORT -t $THREADS -w $DIR/workload.txt -r $REQUESTS \
+	    -C $CACHE
+	kill -9 $CACHE $PROXY
+	wait $CACHE $PROXY 2>/dev/null
+}
+
+echo "== thread per request: -t $THREADS"
+run -t $THREADS
+echo "== io_uring: -t 2 -u $((THREADS / 2))"
+run -t 2 -u $((THREADS / 2))
@@ -0,0 +1,852 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  cachesim [options]\n"                                                      \
+"options:\n"                                                                  \
+"  -w [trace]          Requests to replay, one path per line (workload.txt\n" \
+"                      format) (Default: workload.txt)\n"                     \
+"  -c [locals]         Object sizes from the files of a simplecached index\n" \
+"                      (Default: locals.txt)\n"                               \
+"  -d [dir]            Object sizes from dir/path for paths not in locals\n"  \
+"  -p [policies]       Comma separated, of lru, lfu, arc, s3fifo and\n"       \
+"                      wtinylfu (Default: all)\n"                             \
+"  -b [budgets]        Cache sizes in bytes, as a list (64K,1M) or a range\n" \
+"                      doubling from its low end (64K:16M) (Default: from\n"  \
+"                      1/64 of the objects' total size up to all of it)\n"    \
+"  -n [repeat]         Replay the trace this many times (Default: 1)\n"       \
+"  -C                  Print the miss ratio curves as CSV\n"                  \
+"  -h                  Show this help message\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"trace",              required_argument,      NULL,           'w'},
+  {"locals",             required_argument,      NULL,           'c'},
+  {"dir",                required_argument,      NULL,           'd'},
+  {"policies",           required_argument,      NULL,           'p'},
+  {"budgets",            required_argument,      NULL,           'b'},
+  {"repeat",             required_argument,      NULL,           'n'},
+  {"csv",                no_argument,            NULL,           'C'},
+  {"help",               no_argument,            NULL,           'h'},
+  {NULL,                 0,                      NULL,             0}
+};
+
+#define MAX_LINE    4096
+#define MAX_BUDGETS 64
+#define NLISTS      4
+/* Sizes of objects we know nothing about */
+#define NO_SIZE     UINT64_MAX
+
+/* The trace, with every path replaced by a dense object id */
+static int *requests;
+static long nrequests;
+static uint64_t *sizes;
+static char **names;
+static int nobjects;
+
+/* Path to id, open addressing */
+static int *table;
+static size_t table_size;
+
+static uint64_t _hash(char *s)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*s) {
+		hash = (hash ^ (unsigned char)*s++) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static void _grow()
+{
+	size_t i, j, old_size = table_size;
+	int *old = table;
+
+	table_size = table_size ? table_size * 2 : 1024;
+	table = malloc(table_size * sizeof(*table));
+	memset(table, -1, table_size * sizeof(*table));
+	for (i = 0; i < old_size; i++) {
+		if (old[i] == -1) {
+			continue;
+		}
+		j = _hash(names[old[i]]) & (table_size - 1);
+		while (table[j] != -1) {
+			j = (j + 1) & (table_size - 1);
+		}
+		table[j] = old[i];
+	}
+	free(old);
+}
+
+/* Returns the id of path, giving it one if it has none yet. */
+static int _intern(char *path)
+{
+	size_t i;
+
+	if (2 * (size_t)nobjects >= table_size) {
+		_grow();
+	}
+	i = _hash(path) & (table_size - 1);
+	while (table[i] != -1) {
+		if (!strcmp(names[table[i]], path)) {
+			return table[i];
+		}
+		i = (i + 1) & (table_size - 1);
+	}
+	if ((nobjects & (nobjects - 1)) == 0) {
+		names = realloc(names, (nobjects ? 2 * nobjects : 1) *
+		    sizeof(*names));
+		sizes = realloc(sizes, (nobjects ? 2 * nobjects : 1) *
+		    sizeof(*sizes));
+	}
+	names[nobjects] = strdup(path);
+	sizes[nobjects] = NO_SIZE;
+	table[i] = nobjects;
+
+	return nobjects++;
+}
+
+static int _load_trace(char *path)
+{
+	char line[MAX_LINE];
+	long cap = 0;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0]) {
+			continue;
+		}
+		if (nrequests == cap) {
+			cap = cap ? cap * 2 : 1024;
+			requests = realloc(requests, cap * sizeof(*requests));
+		}
+		requests[nrequests++] = _intern(line);
+	}
+	fclose(f);
+
+	return 0;
+}
+
+/* Sizes the objects in the trace that the simplecached index lists. */
+static void _load_locals(char *path)
+{
+	char line[MAX_LINE], *key, *file, *ptr;
+	struct stat st;
+	FILE *f;
+	int id;
+
+	if (!(f = fopen(path, "r"))) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		ptr = line;
+		key = strsep(&ptr, " \t\r\n");
+		file = ptr ? strsep(&ptr, " \t\r\n") : NULL;
+		if (!key || !file || !*key) {
+			continue;
+		}
+		id = _intern(key);
+		if (stat(file, &st) == 0) {
+			sizes[id] = st.st_size;
+		}
+	}
+	fclose(f);
+}
+
+static void _stat_dir(char *dir)
+{
+	char path[MAX_LINE];
+	struct stat st;
+	int id;
+
+	for (id = 0; id < nobjects; id++) {
+		snprintf(path, sizeof(path), "%s%s", dir, names[id]);
+		if (sizes[id] == NO_SIZE && stat(path, &st) == 0) {
+			sizes[id] = st.st_size;
+		}
+	}
+}
+
+/*
+ * One simulated cache.  Objects sit on at most one of the policy's
+ * lists at a time, linked through prev and next, which are indexed by
+ * object id like everything else, so an access costs no allocation.
+ */
+typedef struct {
+	int head, tail;		/* newest and oldest */
+	uint64_t bytes;
+} list_t;
+
+typedef struct sim {
+	char *name;
+	uint64_t capacity;
+	int (*access)(struct sim *, int);
+	int *prev, *next;
+	unsigned char *where;	/* 1 + the list the object is on, or 0 */
+	list_t lists[NLISTS];
+	unsigned char *freq;
+	/* lfu */
+	int *heap, *pos;
+	uint64_t *stamp, tick, bytes;
+	int nheap;
+	/* arc */
+	double p;
+	/* wtinylfu */
+	unsigned char *sketch;
+	uint64_t sketch_mask, sketch_ops, sketch_sample;
+	/* results */
+	long hits;
+	uint64_t hit_bytes;
+} sim_t;
+
+static void _push(sim_t *s, int which, int id)
+{
+	list_t *l = &s->lists[which];
+
+	s->prev[id] = -1;
+	s->next[id] = l->head;
+	if (l->head != -1) {
+		s->prev[l->head] = id;
+	} else {
+		l->tail = id;
+	}
+	l->head = id;
+	l->bytes += sizes[id];
+	s->where[id] = which + 1;
+}
+
+static void _unlink(sim_t *s, int id)
+{
+	list_t *l = &s->lists[s->where[id] - 1];
+
+	if (s->prev[id] != -1) {
+		s->next[s->prev[id]] = s->next[id];
+	} else {
+		l->head = s->next[id];
+	}
+	if (s->next[id] != -1) {
+		s->prev[s->next[id]] = s->prev[id];
+	} else {
+		l->tail = s->prev[id];
+	}
+	l->bytes -= sizes[id];
+	s->where[id] = 0;
+}
+
+/* Moves id to the head of list which. */
+static void _move(sim_t *s, int which, int id)
+{
+	_unlink(s, id);
+	_push(s, which, id);
+}
+
+/* LRU ===================================================================== */
+
+static int _lru_access(sim_t *s, int id)
+{
+	list_t *l = &s->lists[0];
+
+	if (s->where[id]) {
+		_move(s, 0, id);
+		return 1;
+	}
+	if (sizes[id] > s->capacity) {
+		return 0;
+	}
+	while (l->bytes + sizes[id] > s->capacity) {
+		_unlink(s, l->tail);
+	}
+	_push(s, 0, id);
+
+	return 0;
+}
+
+/*
+ * LFU =====================================================================
+ * A heap of the cached objects by access count, the least recently used
+ * going first among equals.  Counts start over when an object returns.
+ */
+
+static int _lfu_before(sim_t *s, int a, int b)
+{
+	if (s->freq[a] != s->freq[b]) {
+		return s->freq[a] < s->freq[b];
+	}
+	return s->stamp[a] < s->stamp[b];
+}
+
+static void _heap_set(sim_t *s, int i, int id)
+{
+	s->heap[i] = id;
+	s->pos[id] = i;
+}
+
+static void _sift_up(sim_t *s, int i)
+{
+	int id = s->heap[i];
+
+	while (i > 0 && _lfu_before(s, id, s->heap[(i - 1) / 2])) {
+		_heap_set(s, i, s->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	_heap_set(s, i, id);
+}
+
+static void _sift_down(sim_t *s, int i)
+{
+	int id = s->heap[i], child;
+
+	while ((child = 2 * i + 1) < s->nheap) {
+		if (child + 1 < s->nheap &&
+		    _lfu_before(s, s->heap[child + 1], s->heap[child])) {
+			child++;
+		}
+		if (!_lfu_before(s, s->heap[child], id)) {
+			break;
+		}
+		_heap_set(s, i, s->heap[child]);
+		i = child;
+	}
+	_heap_set(s, i, id);
+}
+
+static int _lfu_access(sim_t *s, int id)
+{
+	int victim;
+
+	s->tick++;
+	if (s->pos[id] != -1) {
+		if (s->freq[id] < 255) {
+			s->freq[id]++;
+		}
+		s->stamp[id] = s->tick;
+		_sift_down(s, s->pos[id]);
+		return 1;
+	}
+	if (sizes[id] > s->capacity) {
+		return 0;
+	}
+	while (s->bytes + sizes[id] > s->capacity) {
+		victim = s->heap[0];
+		s->pos[victim] = -1;
+		s->bytes -= sizes[victim];
+		if (--s->nheap) {
+			_heap_set(s, 0, s->heap[s->nheap]);
+			_sift_down(s, 0);
+		}
+	}
+	s->freq[id] = 1;
+	s->stamp[id] = s->tick;
+	s->bytes += sizes[id];
+	_heap_set(s, s->nheap++, id);
+	_sift_up(s, s->nheap - 1);
+
+	return 0;
+}
+
+/*
+ * ARC =====================================================================
+ * Megiddo and Modha's adaptive replacement cache, with every list and
+ * the target p counted in bytes rather than pages.
+ */
+enum { T1, T2, B1, B2 };
+
+static void _arc_replace(sim_t *s, int from_b2, uint64_t need)
+{
+	list_t *t1 = &s->lists[T1], *t2 = &s->lists[T2];
+
+	while (t1->bytes + t2->bytes + need > s->capacity) {
+		if (t1->tail != -1 && (t2->tail == -1 || t1->bytes > s->p ||
+		    (from_b2 && t1->bytes >= s->p))) {
+			_move(s, B1, t1->tail);
+		} else {
+			_move(s, B2, t2->tail);
+		}
+	}
+}
+
+/* The ghosts remember no more than the cache could hold. */
+static void _arc_trim(sim_t *s)
+{
+	list_t *l = s->lists;
+
+	while (l[T1].bytes + l[B1].bytes > s->capacity && l[B1].tail != -1) {
+		_unlink(s, l[B1].tail);
+	}
+	while (l[T1].bytes + l[T2].bytes + l[B1].bytes + l[B2].bytes >
+	    2 * s->capacity && l[B2].tail != -1) {
+		_unlink(s, l[B2].tail);
+	}
+}
+
+static int _arc_access(sim_t *s, int id)
+{
+	list_t *l = s->lists;
+	double delta;
+
+	switch (s->where[id] - 1) {
+	case T1:
+	case T2:
+		_move(s, T2, id);
+		return 1;
+	case B1:
+		delta = sizes[id] * (l[B2].bytes > l[B1].bytes ?
+		    (double)l[B2].bytes / l[B1].bytes : 1);
+		s->p = s->p + delta < s->capacity ? s->p + delta : s->capacity;
+		_unlink(s, id);
+		_arc_replace(s, 0, sizes[id]);
+		_push(s, T2, id);
+		break;
+	case B2:
+		delta = sizes[id] * (l[B1].bytes > l[B2].bytes ?
+		    (double)l[B1].bytes / l[B2].bytes : 1);
+		s->p = s->p > delta ? s->p - delta : 0;
+		_unlink(s, id);
+		_arc_replace(s, 1, sizes[id]);
+		_push(s, T2, id);
+		break;
+	default:
+		if (sizes[id] > s->capacity) {
+			return 0;
+		}
+		_arc_replace(s, 0, sizes[id]);
+		_push(s, T1, id);
+		break;
+	}
+	_arc_trim(s);
+
+	return 0;
+}
+
+/*
+ * S3-FIFO =================================================================
+ * Yang et al.: new objects enter a small FIFO holding a tenth of the
+ * bytes.  Those hit while there move on to the main FIFO, the others
+ * leave a ghost behind, which sends them straight to the main FIFO if
+ * they come back soon.  The main FIFO gives objects that were hit
+ * another round.
+ */
+enum { S_SMALL, S_MAIN, S_GHOST };
+
+static void _s3_evict(sim_t *s)
+{
+	list_t *l = s->lists;
+	int t;
+
+	if (l[S_SMALL].bytes > s->capacity / 10 || l[S_MAIN].tail == -1) {
+		t = l[S_SMALL].tail;
+		if (s->freq[t]) {
+			s->freq[t] = 0;
+			_move(s, S_MAIN, t);
+			return;
+		}
+		_move(s, S_GHOST, t);
+		while (l[S_GHOST].bytes > s->capacity - s->capacity / 10) {
+			_unlink(s, l[S_GHOST].tail);
+		}
+		return;
+	}
+	t = l[S_MAIN].tail;
+	if (s->freq[t]) {
+		s->freq[t]--;
+		_move(s, S_MAIN, t);
+		return;
+	}
+	_unlink(s, t);
+}
+
+static int _s3fifo_access(sim_t *s, int id)
+{
+	list_t *l = s->lists;
+	int where = s->where[id] - 1;
+
+	if (where == S_SMALL || where == S_MAIN) {
+		if (s->freq[id] < 3) {
+			s->freq[id]++;
+		}
+		return 1;
+	}
+	if (sizes[id] > s->capacity) {
+		return 0;
+	}
+	if (where == S_GHOST) {
+		_unlink(s, id);
+	}
+	while (l[S_SMALL].bytes + l[S_MAIN].bytes + sizes[id] > s->capacity) {
+		_s3_evict(s);
+	}
+	s->freq[id] = 0;
+	_push(s, where == S_GHOST ? S_MAIN : S_SMALL, id);
+
+	return 0;
+}
+
+/*
+ * W-TinyLFU ===============================================================
+ * Einziger et al.: a window LRU of 1% of the bytes in front of a
+ * segmented LRU (20% probation, 80% protected).  An object leaving the
+ * window only gets into the main cache if a count-min sketch of recent
+ * accesses says it is more popular than what it would evict.
+ */
+enum { W_WINDOW, W_PROBATION, W_PROTECTED };
+
+static unsigned char *_counter(sim_t *s, int id, int row)
+{
+	uint64_t h = (id + 1) * 0x9e3779b97f4a7c15ULL;
+
+	h = (uint32_t)(h >> 32) + row * (uint32_t)h;
+	return &s->sketch[(row * (s->sketch_mask + 1)) + (h & s->sketch_mask)];
+}
+
+static unsigned _estimate(sim_t *s, int id)
+{
+	unsigned min = 255, c;
+	int row;
+
+	for (row = 0; row < 4; row++) {
+		c = *_counter(s, id, row);
+		min = c < min ? c : min;
+	}
+
+	return min;
+}
+
+static void _sketch_add(sim_t *s, int id)
+{
+	unsigned char *c;
+	uint64_t i;
+	int row;
+
+	for (row = 0; row < 4; row++) {
+		c = _counter(s, id, row);
+		if (*c < 15) {
+			(*c)++;
+		}
+	}
+	/* Halve everything once in a while so the sketch follows the trace */
+	if (++s->sketch_ops == s->sketch_sample) {
+		for (i = 0; i < 4 * (s->sketch_mask + 1); i++) {
+			s->sketch[i] >>= 1;
+		}
+		s->sketch_ops = 0;
+	}
+}
+
+static void _wtinylfu_admit(sim_t *s, int id)
+{
+	list_t *l = s->lists;
+	uint64_t main_cap = s->capacity - s->capacity / 100;
+	int victim;
+
+	while (l[W_PROBATION].bytes + l[W_PROTECTED].bytes + sizes[id] > main_cap) {
+		victim = l[W_PROBATION].tail != -1 ? l[W_PROBATION].tail :
+		    l[W_PROTECTED].tail;
+		if (victim == -1 || _estimate(s, id) <= _estimate(s, victim)) {
+			return;
+		}
+		_unlink(s, victim);
+	}
+	_push(s, W_PROBATION, id);
+}
+
+static int _wtinylfu_access(sim_t *s, int id)
+{
+	list_t *l = s->lists;
+	uint64_t protected_cap = (s->capacity - s->capacity / 100) * 8 / 10;
+
+	_sketch_add(s, id);
+	switch (s->where[id] - 1) {
+	case W_WINDOW:
+		_move(s, W_WINDOW, id);
+		return 1;
+	case W_PROBATION:
+		_move(s, W_PROTECTED, id);
+		while (l[W_PROTECTED].bytes > protected_cap) {
+			_move(s, W_PROBATION, l[W_PROTECTED].tail);
+		}
+		return 1;
+	case W_PROTECTED:
+		_move(s, W_PROTECTED, id);
+		return 1;
+	}
+	if (sizes[id] > s->capacity) {
+		return 0;
+	}
+	_push(s, W_WINDOW, id);
+	while (l[W_WINDOW].bytes > s->capacity / 100) {
+		id = l[W_WINDOW].tail;
+		_unlink(s, id);
+		_wtinylfu_admit(s, id);
+	}
+
+	return 0;
+}
+
+/* ========================================================================= */
+
+static struct {
+	char *name;
+	int (*access)(sim_t *, int);
+} policies[] = {
+	{ "lru", _lru_access },
+	{ "lfu", _lfu_access },
+	{ "arc", _arc_access },
+	{ "s3fifo", _s3fifo_access },
+	{ "wtinylfu", _wtinylfu_access },
+};
+#define NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+static sim_t *_sim_new(int policy, uint64_t capacity)
+{
+	sim_t *s = calloc(1, sizeof(*s));
+	uint64_t width = 16;
+	int i;
+
+	s->name = policies[policy].name;
+	s->access = policies[policy].access;
+	s->capacity = capacity;
+	s->prev = malloc(nobjects * sizeof(int));
+	s->next = malloc(nobjects * sizeof(int));
+	s->where = calloc(nobjects, 1);
+	s->freq = calloc(nobjects, 1);
+	for (i = 0; i < NLISTS; i++) {
+		s->lists[i].head = s->lists[i].tail = -1;
+	}
+	if (s->access == _lfu_access) {
+		s->heap = malloc(nobjects * sizeof(int));
+		s->pos = malloc(nobjects * sizeof(int));
+		s->stamp = malloc(nobjects * sizeof(uint64_t));
+		memset(s->pos, -1, nobjects * sizeof(int));
+	}
+	if (s->access == _wtinylfu_access) {
+		while (width < (uint64_t)nobjects && width < (1 << 22)) {
+			width <<= 1;
+		}
+		s->sketch_mask = width - 1;
+		s->sketch_sample = 10 * width;
+		s->sketch = calloc(4, width);
+	}
+
+	return s;
+}
+
+static void _sim_free(sim_t *s)
+{
+	free(s->prev);
+	free(s->next);
+	free(s->where);
+	free(s->freq);
+	free(s->heap);
+	free(s->pos);
+	free(s->stamp);
+	free(s->sketch);
+	free(s);
+}
+
+static uint64_t _parse_size(char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	switch (*end) {
+	case 'k': case 'K': v *= 1 << 10; break;
+	case 'm': case 'M': v *= 1 << 20; break;
+	case 'g': case 'G': v *= 1 << 30; break;
+	}
+
+	return v;
+}
+
+static int _parse_budgets(char *spec, uint64_t *budgets)
+{
+	char *colon = strchr(spec, ':'), *tok;
+	uint64_t lo, hi;
+	int n = 0;
+
+	if (colon) {
+		lo = _parse_size(spec);
+		hi = _parse_size(colon + 1);
+		for (; lo && lo <= hi && n < MAX_BUDGETS; lo *= 2) {
+			budgets[n++] = lo;
+		}
+		return n;
+	}
+	for (tok = strtok(spec, ","); tok && n < MAX_BUDGETS;
+	    tok = strtok(NULL, ",")) {
+		budgets[n++] = _parse_size(tok);
+	}
+
+	return n;
+}
+
+static char *_human(uint64_t bytes, char *buf)
+{
+	char *units = "BKMGT";
+
+	if (bytes < 1024) {
+		sprintf(buf, "%lluB", (unsigned long long)bytes);
+		return buf;
+	}
+	while (bytes >= 1024 * 1024 && units[1] != 'T') {
+		bytes >>= 10;
+		units++;
+	}
+	sprintf(buf, "%.1f%c", bytes / 1024.0, units[1]);
+
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	char *trace = "workload.txt", *locals = "locals.txt", *dir = NULL;
+	char *policy_list = NULL, *budget_spec = NULL, *tok, buf[32];
+	uint64_t budgets[MAX_BUDGETS], total_bytes = 0, request_bytes = 0;
+	int option_char, csv = 0, repeat = 1, nbudgets, b, r, id;
+	int selected[NPOLICIES], nselected = 0;
+	long i, known = 0, simulated = 0, nknown_objects = 0;
+	struct timespec start, end;
+	double elapsed;
+	unsigned p;
+	sim_t *s;
+
+	while ((option_char = getopt_long(argc, argv, "w:c:d:p:b:n:Ch",
+	    gLongOptions, NULL)) != -1) {
+		switch (option_char) {
+			case 'w': // trace
+				trace = optarg;
+				break;
+			case 'c': // locals
+				locals = optarg;
+				break;
+			case 'd': // directory
+				dir = optarg;
+				break;
+			case 'p': // policies
+				policy_list = optarg;
+				break;
+			case 'b': // budgets
+				budget_spec = optarg;
+				break;
+			case 'n': // repeat
+				repeat = atoi(optarg);
+				break;
+			case 'C': // csv
+				csv = 1;
+				break;
+			case 'h': // help
+				fprintf(stdout, "%s", USAGE);
+				exit(0);
+			default:
+				fprintf(stderr, "%s", USAGE);
+				exit(1);
+		}
+	}
+
+	for (tok = policy_list ? strtok(policy_list, ",") : NULL; tok;
+	    tok = strtok(NULL, ",")) {
+		for (p = 0; p < NPOLICIES && strcmp(tok, policies[p].name); p++)
+			;
+		if (p == NPOLICIES) {
+			fprintf(stderr, "unknown policy %s\n%s", tok, USAGE);
+			exit(1);
+		}
+		selected[nselected++] = p;
+	}
+	for (p = 0; !policy_list && p < NPOLICIES; p++) {
+		selected[nselected++] = p;
+	}
+
+	if (_load_trace(trace) == -1) {
+		exit(1);
+	}
+	_load_locals(locals);
+	if (dir) {
+		_stat_dir(dir);
+	}
+	/* Requests for objects of unknown size are left out */
+	for (i = 0; i < nrequests; i++) {
+		if (sizes[requests[i]] != NO_SIZE) {
+			request_bytes += sizes[requests[i]];
+			requests[known++] = requests[i];
+		}
+	}
+	for (id = 0; id < nobjects; id++) {
+		if (sizes[id] != NO_SIZE) {
+			total_bytes += sizes[id];
+			nknown_objects++;
+		}
+	}
+	if (!known) {
+		fprintf(stderr, "no request in %s is for an object of known "
+		    "size, see -c and -d\n", trace);
+		exit(1);
+	}
+
+	if (budget_spec) {
+		nbudgets = _parse_budgets(budget_spec, budgets);
+	} else {
+		nbudgets = 0;
+		for (b = 6; b >= 0; b--) {
+			budgets[nbudgets++] = total_bytes >> b;
+		}
+	}
+
+	if (csv) {
+		fprintf(stdout, "policy,budget,miss_ratio,byte_miss_ratio\n");
+	} else {
+		fprintf(stdout, "%ld requests, %ld for %ld objects of known size "
+		    "(%s in all)\n", nrequests, known, nknown_objects,
+		    _human(total_bytes, buf));
+		fprintf(stdout, "%10s  %-9s %8s %10s %9s\n", "budget", "policy",
+		    "hit %", "byte hit %", "Mreq/s");
+	}
+	for (b = 0; b < nbudgets; b++) {
+		for (p = 0; p < nselected; p++) {
+			s = _sim_new(selected[p], budgets[b]);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (r = 0; r < repeat; r++) {
+				for (i = 0; i < known; i++) {
+					id = requests[i];
+					if (s->access(s, id)) {
+						s->hits++;
+						s->hit_bytes += sizes[id];
+					}
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			elapsed = end.tv_sec - start.tv_sec +
+			    (end.tv_nsec - start.tv_nsec) / 1e9;
+			simulated = known * repeat;
+			if (csv) {
+				fprintf(stdout, "%s,%llu,%.6f,%.6f\n", s->name,
+				    (unsigned long long)budgets[b],
+				    1 - (double)s->hits / simulated,
+				    request_bytes ? 1 - (double)s->hit_bytes /
+				    (request_bytes * repeat) : 0);
+			} else {
+				fprintf(stdout, "%10s  %-9s %8.2f %10.2f %9.1f\n",
+				    _human(budgets[b], buf), s->name,
+				    100.0 * s->hits / simulated,
+				    request_bytes ? 100.0 * s->hit_bytes /
+				    (request_bytes * repeat) : 0,
+				    elapsed > 0 ? simulated / elapsed / 1e6 : 0);
+			}
+			_sim_free(s);
+		}
+	}
+
+	return 0;
+}
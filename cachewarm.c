@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cachewarm.h"
+#include "simplecache.h"
+
+#define MAX_KEYLEN	256
+#define WARM_CHUNK	(256 * 1024)
+/* How long a warmup waits for the pages it asked for to arrive */
+#define WARM_WAIT_S	30
+#define WARM_POLL_NS	10000000
+
+typedef struct {
+	char *key;
+	int count;
+} warm_item_t;
+
+static char *warm_trace;
+static long warm_rate;
+static sem_t warm_sem;
+static pthread_t warm_thread;
+
+static FILE *access_log;
+static pthread_mutex_t access_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int _strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static int _countcmp(const void *a, const void *b)
+{
+	return ((warm_item_t *)b)->count - ((warm_item_t *)a)->count;
+}
+
+/*
+ * Reads the trace and returns its distinct keys, most requested first.
+ */
+static warm_item_t *_rank(char *path, int *nitems)
+{
+	FILE *trace;
+	char line[MAX_KEYLEN];
+	char **keys;
+	warm_item_t *items;
+	int nkeys = 0, capacity = 64;
+	int i, n;
+
+	if (NULL == (trace = fopen(path, "r"))) {
+		fprintf(stderr, "Unable to open trace %s.\n", path);
+		return NULL;
+	}
+	keys = malloc(capacity * sizeof(*keys));
+	while (fgets(line, sizeof(line), trace)) {
+		line[strcspn(line, " \t\r\n")] = '\0';
+		if (!line[0]) {
+			continue;
+		}
+		if (nkeys == capacity) {
+			capacity *= 2;
+			keys = realloc(keys, capacity * sizeof(*keys));
+		}
+		keys[nkeys++] = strdup(line);
+	}
+	fclose(trace);
+
+	qsort(keys, nkeys, sizeof(*keys), _strcmp);
+	items = malloc((nkeys ? nkeys : 1) * sizeof(*items));
+	n = 0;
+	for (i = 0; i < nkeys; i++) {
+		if (n && !strcmp(items[n - 1].key, keys[i])) {
+			items[n - 1].count++;
+			free(keys[i]);
+			continue;
+		}
+		items[n].key = keys[i];
+		items[n].count = 1;
+		n++;
+	}
+	free(keys);
+	qsort(items, n, sizeof(*items), _countcmp);
+
+	*nitems = n;
+	return items;
+}
+
+/*
+ * Brings len bytes of fd at offset into the page cache.  Unless wait is
+ * set this only starts readahead, falling back to reading them when the
+ * file system does not support it.  With wait the bytes are read, so
+ * they are in when it returns.
+ */
+static void _fetch(int fd, off_t offset, size_t len, char *scratch,
+    int wait)
+{
+	ssize_t read_len;
+
+	if (!wait) {
+		if (readahead(fd, offset, len) == 0) {
+			return;
+		}
+		posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+	}
+	while (len) {
+		read_len = pread(fd, scratch, len, offset);
+		if (read_len <= 0) {
+			return;
+		}
+		offset += read_len;
+		len -= read_len;
+	}
+}
+
+/*
+ * Counts the pages of the files behind the first nitems keys that are
+ * in the page cache, and stores how many pages they have in *npages.
+ */
+static size_t _resident(warm_item_t *items, int nitems, size_t *npages)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t resident = 0, n, j;
+	unsigned char *vec;
+	struct stat st;
+	void *map;
+	int i, fd;
+
+	*npages = 0;
+	for (i = 0; i < nitems; i++) {
+		if ((fd = simplecache_get(items[i].key)) == -1) {
+			continue;
+		}
+		if (fstat(fd, &st) == -1 || !st.st_size) {
+			close(fd);
+			continue;
+		}
+		n = (st.st_size + page_size - 1) / page_size;
+		*npages += n;
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			continue;
+		}
+		if ((vec = malloc(n)) && mincore(map, st.st_size, vec) == 0) {
+			for (j = 0; j < n; j++) {
+				resident += vec[j] & 1;
+			}
+		}
+		free(vec);
+		munmap(map, st.st_size);
+	}
+
+	return resident;
+}
+
+static void _warm(char *scratch)
+{
+	warm_item_t *items;
+	int nitems, ncached = 0, nwarm = 0, i, fd;
+	struct stat st;
+	size_t total = 0, done = 0, len, resident, npages;
+	off_t offset;
+	double start, ahead, issued;
+	struct timespec pause;
+	struct timespec poll = { 0, WARM_POLL_NS };
+
+	pthread_mutex_lock(&access_log_mutex);
+	if (access_log) {
+		fflush(access_log);
+	}
+	pthread_mutex_unlock(&access_log_mutex);
+
+	if (!(items = _rank(warm_trace, &nitems))) {
+		return;
+	}
+	for (i = 0; i < nitems; i++) {
+		if ((fd = simplecache_get(items[i].key)) == -1) {
+			continue;
+		}
+		if (fstat(fd, &st) == 0) {
+			total += st.st_size;
+			ncached++;
+		}
+		close(fd);
+	}
+
+	fprintf(stdout, "warmup: %d objects, %zu bytes from %s\n", ncached,
+	    total, warm_trace);
+	fflush(stdout);
+	start = _now();
+	for (i = 0; i < nitems; i++) {
+		if ((fd = simplecache_get(items[i].key)) == -1) {
+			continue;
+		}
+		if (fstat(fd, &st) == -1) {
+			close(fd);
+			continue;
+		}
+		for (offset = 0; offset < st.st_size; offset += len) {
+			len = st.st_size - offset;
+			if (len > WARM_CHUNK) {
+				len = WARM_CHUNK;
+			}
+			/*
+			 * Paced by what was read, not by what was asked for,
+			 * which readahead returns long before it arrives
+			 */
+			_fetch(fd, offset, len, scratch, warm_rate != 0);
+			done += len;
+			if (!warm_rate) {
+				continue;
+			}
+			/* Stay under the configured bandwidth */
+			ahead = (double)done / warm_rate - (_now() - start);
+			if (ahead > 0) {
+				pause.tv_sec = (time_t)ahead;
+				pause.tv_nsec = (ahead - pause.tv_sec) * 1e9;
+				nanosleep(&pause, NULL);
+			}
+		}
+		close(fd);
+		fprintf(stdout, "warmup: %d/%d objects, %zu/%zu bytes (%s)\n",
+		    ++nwarm, ncached, done, total, items[i].key);
+		fflush(stdout);
+	}
+	/* readahead only starts the reads, the pages come later */
+	issued = _now() - start;
+	while ((resident = _resident(items, nitems, &npages)) < npages &&
+	    _now() - start < WARM_WAIT_S) {
+		nanosleep(&poll, NULL);
+	}
+	fprintf(stdout, "warmup: reads issued after %.3f secs, %zu/%zu pages "
+	    "resident after %.3f secs\n", issued, resident, npages,
+	    _now() - start);
+	fflush(stdout);
+
+	for (i = 0; i < nitems; i++) {
+		free(items[i].key);
+	}
+	free(items);
+}
+
+static void *_warm_worker(void *arg)
+{
+	char *scratch = malloc(WARM_CHUNK);
+
+	while (1) {
+		while (sem_wait(&warm_sem) == -1 && errno == EINTR)
+			;
+		_warm(scratch);
+	}
+
+	return NULL;
+}
+
+int cachewarm_init(char *trace_path, long bytes_per_sec, int warm_now)
+{
+	warm_trace = trace_path;
+	warm_rate = bytes_per_sec;
+	sem_init(&warm_sem, 0, warm_now ? 1 : 0);
+
+	if (pthread_create(&warm_thread, NULL, _warm_worker, NULL) != 0) {
+		fprintf(stderr, "Unable to start the warmup thread.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void cachewarm_trigger()
+{
+	sem_post(&warm_sem);
+}
+
+int cachewarm_log_open(char *path)
+{
+	if (NULL == (access_log = fopen(path, "a"))) {
+		fprintf(stderr, "Unable to open access log %s.\n", path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void cachewarm_log(char *key)
+{
+	pthread_mutex_lock(&access_log_mutex);
+	if (access_log) {
+		fprintf(access_log, "%s\n", key);
+	}
+	pthread_mutex_unlock(&access_log_mutex);
+}
+
+void cachewarm_log_close()
+{
+	pthread_mutex_lock(&access_log_mutex);
+	if (access_log) {
+		fclose(access_log);
+		access_log = NULL;
+	}
+	pthread_mutex_unlock(&access_log_mutex);
+}
@@ -0,0 +1,31 @@
+#ifndef _CACHEWARM_H_
+#define _CACHEWARM_H_
+
+/*
+ * Starts the background warmup thread.  Each warmup reads the access
+ * trace at trace_path (one key per line, as in workload.txt), ranks the
+ * keys by how often they appear and pulls the files behind the most
+ * popular keys into the page cache first, reading at most
+ * bytes_per_sec bytes per second.  A paced warmup reads every chunk
+ * before it counts it; an unbounded one (0) only starts readahead on
+ * them and moves on.  A warmup runs immediately if warm_now is set and
+ * again on every cachewarm_trigger.  It reports when it issued the last
+ * read and, from mincore, when the pages arrived.
+ */
+int cachewarm_init(char *trace_path, long bytes_per_sec, int warm_now);
+
+/*
+ * Asks the warmup thread to run another pass.  Safe to call from a
+ * signal handler.
+ */
+void cachewarm_trigger();
+
+/*
+ * Appends every key passed to cachewarm_log to the file at path, in a
+ * format that can be used as the trace for a later warmup.
+ */
+int cachewarm_log_open(char *path);
+void cachewarm_log(char *key);
+void cachewarm_log_close();
+
+#endif
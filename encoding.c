@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "encoding.h"
+
+static const char *names[NENCODINGS] = {
+	[ENCODING_IDENTITY] = "identity",
+	[ENCODING_GZIP] = "gzip",
+	[ENCODING_ZSTD] = "zstd",
+};
+
+const char *encoding_name(encoding_t enc)
+{
+	return names[enc];
+}
+
+int encoding_list(const char *list, encoding_t *encs)
+{
+	size_t len;
+	int n = 0, enc, i;
+
+	while (*list && !strchr(" \t\r\n", *list)) {
+		len = strcspn(list, ", \t\r\n");
+		for (enc = ENCODING_IDENTITY + 1; enc < NENCODINGS; enc++) {
+			if (strlen(names[enc]) != len ||
+			    strncmp(list, names[enc], len)) {
+				continue;
+			}
+			/* Naming one twice changes nothing */
+			for (i = 0; i < n && encs[i] != enc; i++)
+				;
+			if (i == n) {
+				encs[n++] = enc;
+			}
+		}
+		list += len;
+		list += *list == ',';
+	}
+
+	return n;
+}
+
+/*
+ * Both parsers end path with a '\0' of its own, after which the rest of
+ * the line follows (see keepalive.c).  Tokens with a '=' in them are
+ * other options of the request, such as a byte range (see range.h).
+ */
+int encoding_requested(char *path, encoding_t *encs)
+{
+	char *rest = path + strlen(path) + 1;
+	size_t len;
+
+	while (*(rest += strspn(rest, " \t")) && !strchr("\r\n", *rest)) {
+		len = strcspn(rest, " \t\r\n");
+		if (!memchr(rest, '=', len)) {
+			return encoding_list(rest, encs);
+		}
+		rest += len;
+	}
+
+	return -1;
+}
+
+int encoding_key(char *buf, size_t len, char *key, encoding_t enc)
+{
+	return snprintf(buf, len, "%s%c%s", key, ENCODING_SEP,
+	    names[enc]) < len ? 0 : -1;
+}
@@ -0,0 +1,56 @@
+#ifndef _ENCODING_H_
+#define _ENCODING_H_
+
+#include <stddef.h>
+
+/*
+ * Content encodings simplecached can keep precompressed variants of its
+ * objects in.  A variant is cached under the key of its object, a space
+ * and the name of the encoding, e.g. "/index.html gzip".  Neither keys
+ * nor GETFILE paths contain spaces, so the two never meet.
+ *
+ * A client asks for the encodings it accepts by listing them, most
+ * preferred first, after the path:
+ *
+ *     GETFILE GET /index.html zstd,gzip\r\n\r\n
+ *
+ * and the OK header of the response then names the one the file comes
+ * in after its length, "identity" if none:
+ *
+ *     Getfile OK 1032 gzip <data>
+ */
+typedef enum {
+	ENCODING_IDENTITY,
+	ENCODING_GZIP,
+	ENCODING_ZSTD,
+	NENCODINGS
+} encoding_t;
+
+#define ENCODING_SEP      ' '
+/* Longest encoding name */
+#define ENCODING_NAME_MAX 8
+
+const char *encoding_name(encoding_t enc);
+
+/*
+ * Parses the comma separated names at the start of list, up to the
+ * first blank, into encs, in order.  identity and unknown names are
+ * left out.  Returns how many encodings were stored.
+ */
+int encoding_list(const char *list, encoding_t *encs);
+
+/*
+ * Parses what a request lists after path, which gfserver or keepalive
+ * split off its request line, into encs.  Returns -1 if the request
+ * lists nothing, else what encoding_list returns.  A byte range (see
+ * range.h) may come before or after the list.
+ */
+int encoding_requested(char *path, encoding_t *encs);
+
+/*
+ * Writes the key of the enc variant of key to buf, len bytes long.
+ * Returns -1 if it does not fit.
+ */
+int encoding_key(char *buf, size_t len, char *key, encoding_t enc);
+
+#endif
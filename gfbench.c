@@ -0,0 +1,801 @@
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfbench [options]\n"                                                       \
+"options:\n"                                                                  \
+"  -s [server_addr]    Server address (Default: 127.0.0.1)\n"                 \
+"  -p [server_port]    Server port (Default: 8888)\n"                         \
+"  -t [thread_count]   Num client threads (Default: 4)\n"                     \
+"  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
+"  -r [request_count]  Num total requests (Default: 1000)\n"                  \
+"  -Z [skew]           Pick paths from a Zipf distribution with this\n"      \
+"                      exponent, the first path being the most popular\n"   \
+"                      (Default: 0, every path in turn)\n"                  \
+"  -k [per_conn]       Requests sent on one connection, 1 for no keep-alive\n" \
+"                      (Default: 1)\n"                                        \
+"  -d [depth]          Requests in flight on a connection (Default: 1)\n"     \
+"                      -k and -d need a webproxy started with -k\n"           \
+"  -P [server_pid]     Also report the write system calls of the server\n"   \
+"                      process and the TCP segments sent per response\n"     \
+"  -C [pid]            Also report the CPU time process pid used per GB\n"    \
+"                      served; may be given for several processes\n"         \
+"  -e [encodings]      Accept these content encodings, e.g. gzip, and count\n" \
+"                      the responses that came encoded (Default: none)\n"   \
+"  -b [percent]        Drop each connection once this share of its file came\n" \
+"                      and fetch the rest on a new one with a byte range\n"  \
+"                      (Default: 0, off; implies -k 1 -d 1)\n"               \
+"  -B                  With -b, fetch the whole file again instead, as a\n"  \
+"                      client without byte ranges has to\n"                  \
+"  -L [sizes]          Also report latency per object size class, the\n"    \
+"                      classes ending at these sizes, e.g. 16k,256k\n"       \
+"                      (Default: none)\n"                                     \
+"  -h                  Show this help message\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"server",             required_argument,      NULL,           's'},
+  {"port",               required_argument,      NULL,           'p'},
+  {"nthreads",           required_argument,      NULL,           't'},
+  {"workload-path",      required_argument,      NULL,           'w'},
+  {"nrequests",          required_argument,      NULL,           'r'},
+  {"zipf",               required_argument,      NULL,           'Z'},
+  {"per-conn",           required_argument,      NULL,           'k'},
+  {"depth",              required_argument,      NULL,           'd'},
+  {"server-pid",         required_argument,      NULL,           'P'},
+  {"cpu-pid",            required_argument,      NULL,           'C'},
+  {"encodings",          required_argument,      NULL,           'e'},
+  {"break",              required_argument,      NULL,           'b'},
+  {"restart",            no_argument,            NULL,           'B'},
+  {"size-classes",       required_argument,      NULL,           'L'},
+  {"help",               no_argument,            NULL,           'h'},
+  {NULL,                 0,                      NULL,             0}
+};
+
+#define MAX_PATH_LEN 256
+#define MAX_CPU_PIDS 8
+#define MAX_CLASSES  8
+#define READ_BUFLEN  (64 * 1024)
+/* A server without keep-alive never answers the second request */
+#define RECV_TIMEOUT 10
+
+typedef struct {
+	int fd;
+	char buf[READ_BUFLEN];
+	int pos, len;
+	int timed_out;
+	double *sent_at;	/* when each request in flight went out */
+	ssize_t range;		/* offset the last request asked from, or -1 */
+	size_t got;		/* body bytes of the last response read */
+	size_t size;		/* size of the file it was a part of */
+} conn_t;
+
+typedef struct {
+	long ok, not_found, errors, conns, retried;
+	long encoded;		/* of the ok ones, with -e */
+	long broken;		/* transfers dropped and finished, with -b */
+	unsigned long long bytes;
+	/* Seconds from sending each answered request to its last byte */
+	double *latencies;
+	unsigned char *classes;	/* and the size class of its file, with -L */
+	long nlatencies, latencies_size;
+} stats_t;
+
+static struct addrinfo *server;
+static char **paths;
+static int npaths;
+/* Share of requests going to paths[0..i], with -Z */
+static double *zipf_cdf;
+static long nrequests = 1000;
+static int per_conn = 1, depth = 1;
+static char *encodings;
+static int break_pct, restart;
+/* Largest file size in each class but the last, with -L */
+static size_t class_ends[MAX_CLASSES];
+static int nclasses;
+static long next_request;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_t totals;
+
+static int _fill(conn_t *c)
+{
+	ssize_t read_len;
+
+	if (c->pos == c->len) {
+		c->pos = c->len = 0;
+	}
+	read_len = recv(c->fd, c->buf + c->len, READ_BUFLEN - c->len, 0);
+	if (read_len <= 0) {
+		c->timed_out = read_len == -1 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK);
+		return -1;
+	}
+	c->len += read_len;
+
+	return 0;
+}
+
+/*
+ * Reads one response, but only percent of its body.  Returns its status
+ * (200, 400 or 500) and adds the body bytes read to s->bytes, or returns
+ * -1 if the connection ended before a complete response.  A part that
+ * is not the one asked for counts as a 500.
+ */
+static int _read_response(conn_t *c, stats_t *s, int percent)
+{
+	char header[128], *end;
+	size_t file_len, take, offset, len, file_size;
+	int header_len = 0, blanks = 0;
+
+	/*
+	 * "Getfile OK <len> " is followed directly by the data, or with -e
+	 * "Getfile OK <len> <encoding> ", and with a range by
+	 * "range=<offset>+<len>/<file size> " after that.
+	 */
+	while (1) {
+		if (c->pos == c->len && _fill(c) == -1) {
+			return -1;
+		}
+		header[header_len++] = c->buf[c->pos++];
+		header[header_len] = '\0';
+		if (header[header_len - 1] == '\n') {
+			break;
+		}
+		if (!strncmp(header, "Getfile OK ", 11) && header_len > 11 &&
+		    header[header_len - 1] == ' ' &&
+		    ++blanks == 1 + !!encodings + (c->range != -1)) {
+			break;
+		}
+		if (header_len == sizeof(header) - 1) {
+			return -1;
+		}
+	}
+	c->size = 0;
+	if (strncmp(header, "Getfile OK ", 11)) {
+		return strstr(header, "FILE_NOT_FOUND") ? 400 : 500;
+	}
+	file_len = c->size = strtoul(header + 11, &end, 10);
+	if (encodings && strncmp(end, " identity ", 10)) {
+		s->encoded++;
+	}
+	if (c->range != -1 && (!(end = strstr(end, " range=")) ||
+	    sscanf(end, " range=%zu+%zu/%zu", &offset, &len, &file_size) != 3 ||
+	    len != file_len || offset != c->range ||
+	    offset + len != file_size)) {
+		return 500;
+	}
+	if (c->range != -1) {
+		c->size = file_size;
+	}
+	c->got = 0;
+	file_len = file_len / 100 * percent + file_len % 100 * percent / 100;
+	while (file_len) {
+		if (c->pos == c->len && _fill(c) == -1) {
+			return -1;
+		}
+		take = c->len - c->pos < file_len ? c->len - c->pos : file_len;
+		c->pos += take;
+		file_len -= take;
+		s->bytes += take;
+		c->got += take;
+	}
+
+	return 200;
+}
+
+static void _zipf_init(double skew)
+{
+	double sum = 0;
+	int i;
+
+	zipf_cdf = malloc(npaths * sizeof(*zipf_cdf));
+	for (i = 0; i < npaths; i++) {
+		sum += 1 / pow(i + 1, skew);
+		zipf_cdf[i] = sum;
+	}
+	for (i = 0; i < npaths; i++) {
+		zipf_cdf[i] /= sum;
+	}
+}
+
+/*
+ * The path of request number index.  With -Z it is drawn from a hash
+ * of index, so a retried request asks for the same path again.
+ */
+static char *_path(long index)
+{
+	unsigned long long x = index * 0x9e3779b97f4a7c15ULL;
+	double u;
+	int lo = 0, hi = npaths - 1, mid;
+
+	if (!zipf_cdf) {
+		return paths[index % npaths];
+	}
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	u = (x >> 11) / 9007199254740992.0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (zipf_cdf[mid] > u) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return paths[lo];
+}
+
+static double _now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* The size class of a file of size bytes. */
+static int _class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < nclasses && size > class_ends[i]; i++)
+		;
+
+	return i;
+}
+
+static void _add_latency(stats_t *s, double latency, int class)
+{
+	if (s->nlatencies == s->latencies_size) {
+		s->latencies_size = s->latencies_size ? 2 * s->latencies_size :
+		    1024;
+		s->latencies = realloc(s->latencies,
+		    s->latencies_size * sizeof(*s->latencies));
+		s->classes = realloc(s->classes,
+		    s->latencies_size * sizeof(*s->classes));
+	}
+	s->classes[s->nlatencies] = class;
+	s->latencies[s->nlatencies++] = latency;
+}
+
+static int _cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The latency below which a share q of the responses came, in ms. */
+static double _percentile(stats_t *s, double q)
+{
+	long i = q * s->nlatencies;
+
+	return 1000 * s->latencies[i < s->nlatencies ? i :
+	    s->nlatencies - 1];
+}
+
+/*
+ * Sends request number index, the sent-th one on connection c, for the
+ * file from offset range on, or all of it if range is -1.
+ */
+static int _send_request(conn_t *c, long index, long sent, ssize_t range)
+{
+	char request[MAX_PATH_LEN + 64], part[32] = "";
+	int len;
+
+	if (range != -1) {
+		snprintf(part, sizeof(part), " range=%zd", range);
+	}
+	len = snprintf(request, sizeof(request), "GETFILE GET %s%s%s%s\r\n\r\n",
+	    _path(index), encodings ? " " : "", encodings ? encodings : "",
+	    part);
+	c->range = range;
+	c->sent_at[sent % depth] = _now();
+
+	return send(c->fd, request, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+/* Takes up to n request numbers, returning how many it got. */
+static long _claim(long n, long *first)
+{
+	long got;
+
+	pthread_mutex_lock(&stats_mutex);
+	*first = next_request;
+	got = nrequests - next_request < n ? nrequests - next_request : n;
+	next_request += got;
+	pthread_mutex_unlock(&stats_mutex);
+
+	return got;
+}
+
+/* Hands back request numbers that were not answered. */
+static void _unclaim(long n, stats_t *s)
+{
+	pthread_mutex_lock(&stats_mutex);
+	nrequests += n;
+	pthread_mutex_unlock(&stats_mutex);
+	s->retried += n;
+}
+
+/* Opens a new connection to the server on c. */
+static int _connect(conn_t *c, stats_t *s)
+{
+	struct timeval timeout = { RECV_TIMEOUT, 0 };
+	int on = 1;
+
+	c->fd = socket(server->ai_family, SOCK_STREAM, 0);
+	if (c->fd == -1 || connect(c->fd, server->ai_addr,
+	    server->ai_addrlen) == -1) {
+		perror("connect");
+		if (c->fd != -1) {
+			close(c->fd);
+		}
+		return -1;
+	}
+	setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	s->conns++;
+	c->pos = c->len = c->timed_out = 0;
+
+	return 0;
+}
+
+/*
+ * With -b, fetches request number index on a connection that is dropped
+ * once break_pct percent of the file came, then the rest, or with -B
+ * the whole file, on a second one.  Returns the status of the second
+ * response, or -1.  The latency is that of both together.
+ */
+static int _broken_transfer(conn_t *c, long index, stats_t *s)
+{
+	double start = _now();
+	int status = -1;
+
+	if (_connect(c, s) == -1) {
+		return -1;
+	}
+	if (_send_request(c, index, 0, -1) == -1 ||
+	    (status = _read_response(c, s, break_pct)) != 200) {
+		close(c->fd);
+		return status == 400 ? 400 : -1;
+	}
+	close(c->fd);
+	if (_connect(c, s) == -1) {
+		return -1;
+	}
+	if (_send_request(c, index, 1, restart ? -1 : c->got) == -1 ||
+	    (status = _read_response(c, s, 100)) == -1) {
+		close(c->fd);
+		return -1;
+	}
+	close(c->fd);
+	s->broken++;
+	_add_latency(s, _now() - start, _class(c->size));
+
+	return status;
+}
+
+static void *_client(void *arg)
+{
+	stats_t s;
+	conn_t *c = malloc(sizeof(*c));
+	long first, n, sent, done;
+	int status;
+
+	memset(&s, 0, sizeof(s));
+	c->sent_at = malloc(depth * sizeof(*c->sent_at));
+	while ((n = _claim(per_conn, &first)) > 0) {
+		if (break_pct) {
+			status = _broken_transfer(c, first, &s);
+			if (status == 200) {
+				s.ok++;
+			} else if (status == 400) {
+				s.not_found++;
+			} else {
+				s.errors++;
+			}
+			continue;
+		}
+		if (_connect(c, &s) == -1) {
+			s.errors += n;
+			continue;
+		}
+		sent = done = 0;
+		/* The rest may only follow once the first answer is in */
+		if (_send_request(c, first, 0, -1) == 0) {
+			sent = 1;
+		}
+		while (done < sent) {
+			if ((status = _read_response(c, &s, 100)) == -1) {
+				break;
+			}
+			_add_latency(&s, _now() - c->sent_at[done % depth],
+			    _class(c->size));
+			done++;
+			if (status == 200) {
+				s.ok++;
+			} else if (status == 400) {
+				s.not_found++;
+			} else {
+				s.errors++;
+			}
+			while (sent < n && sent - done < depth &&
+			    _send_request(c, first + sent, sent, -1) == 0) {
+				sent++;
+			}
+		}
+		close(c->fd);
+		if (c->timed_out) {
+			fprintf(stderr, "no answer in %d s\n", RECV_TIMEOUT);
+			s.errors += n - done;
+		} else if (done < n) {
+			/* The server ended the connection early, retry them */
+			_unclaim(n - done, &s);
+		}
+	}
+	free(c->sent_at);
+	free(c);
+
+	pthread_mutex_lock(&stats_mutex);
+	totals.ok += s.ok;
+	totals.not_found += s.not_found;
+	totals.errors += s.errors;
+	totals.conns += s.conns;
+	totals.retried += s.retried;
+	totals.encoded += s.encoded;
+	totals.broken += s.broken;
+	totals.bytes += s.bytes;
+	for (n = 0; n < s.nlatencies; n++) {
+		_add_latency(&totals, s.latencies[n], s.classes[n]);
+	}
+	pthread_mutex_unlock(&stats_mutex);
+	free(s.latencies);
+	free(s.classes);
+
+	return NULL;
+}
+
+/* Write system calls made so far by process pid, or -1. */
+static long _syscw(int pid)
+{
+	char path[64];
+	long count = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", pid);
+	if (!(f = fopen(path, "r"))) {
+		return -1;
+	}
+	while (fscanf(f, "%63s", path) == 1) {
+		if (!strcmp(path, "syscw:") && fscanf(f, "%ld", &count) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+
+	return count;
+}
+
+/*
+ * TCP segments sent by the whole host so far, or -1.  Over loopback
+ * this counts both the client's and the server's segments, ACKs
+ * included.
+ */
+static long _tcp_out_segs()
+{
+	char names[1024], values[1024], *name, *value, *n_save, *v_save;
+	long count = -1;
+	FILE *f;
+
+	if (!(f = fopen("/proc/net/snmp", "r"))) {
+		return -1;
+	}
+	while (fgets(names, sizeof(names), f) &&
+	    fgets(values, sizeof(values), f)) {
+		if (strncmp(names, "Tcp:", 4)) {
+			continue;
+		}
+		name = strtok_r(names, " \n", &n_save);
+		value = strtok_r(values, " \n", &v_save);
+		while (name && value && strcmp(name, "OutSegs")) {
+			name = strtok_r(NULL, " \n", &n_save);
+			value = strtok_r(NULL, " \n", &v_save);
+		}
+		if (name && value) {
+			count = atol(value);
+		}
+		break;
+	}
+	fclose(f);
+
+	return count;
+}
+
+/* User plus system CPU seconds used so far by process pid, or -1. */
+static double _cpu_seconds(int pid)
+{
+	unsigned long utime, stime;
+	char path[64], buf[1024], *p;
+	ssize_t len;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (!(f = fopen(path, "r"))) {
+		return -1;
+	}
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len > 0 ? len : 0] = '\0';
+	/* The command name may hold spaces, the fields after it cannot */
+	if (!(p = strrchr(buf, ')')) || sscanf(p + 2,
+	    "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+	    &utime, &stime) != 2) {
+		return -1;
+	}
+
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int _load_workload(char *path)
+{
+	char line[MAX_PATH_LEN];
+	FILE *f;
+	int cap = 0;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0]) {
+			continue;
+		}
+		if (npaths == cap) {
+			cap = cap ? cap * 2 : 64;
+			paths = realloc(paths, cap * sizeof(*paths));
+		}
+		paths[npaths++] = strdup(line);
+	}
+	fclose(f);
+
+	return npaths ? 0 : -1;
+}
+
+/*
+ * Parses the -L list of class ends, sizes in bytes with an optional k
+ * or m suffix, in ascending order.  Returns -1 if it is not one.
+ */
+static int _parse_classes(char *list)
+{
+	char *end;
+	size_t size;
+
+	while (*list) {
+		size = strtoul(list, &end, 10);
+		if (end == list || nclasses == MAX_CLASSES - 1) {
+			return -1;
+		}
+		if (*end == 'k' || *end == 'K') {
+			size <<= 10;
+			end++;
+		} else if (*end == 'm' || *end == 'M') {
+			size <<= 20;
+			end++;
+		}
+		if ((*end && *end != ',') ||
+		    (nclasses && size <= class_ends[nclasses - 1])) {
+			return -1;
+		}
+		class_ends[nclasses++] = size;
+		list = *end ? end + 1 : end;
+	}
+
+	return nclasses ? 0 : -1;
+}
+
+/* Prints the latency percentiles of the responses for files in class. */
+static void _report_class(int class)
+{
+	stats_t c;
+	long i;
+
+	memset(&c, 0, sizeof(c));
+	for (i = 0; i < totals.nlatencies; i++) {
+		if (totals.classes[i] == class) {
+			_add_latency(&c, totals.latencies[i], class);
+		}
+	}
+	if (class == nclasses) {
+		fprintf(stdout, "  > %zu bytes: ", class_ends[class - 1]);
+	} else {
+		fprintf(stdout, "  <= %zu bytes: ", class_ends[class]);
+	}
+	if (!c.nlatencies) {
+		fprintf(stdout, "none\n");
+		return;
+	}
+	qsort(c.latencies, c.nlatencies, sizeof(*c.latencies), _cmp_double);
+	fprintf(stdout, "%ld, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+	    c.nlatencies, _percentile(&c, 0.5), _percentile(&c, 0.99),
+	    1000 * c.latencies[c.nlatencies - 1]);
+	free(c.latencies);
+	free(c.classes);
+}
+
+int main(int argc, char **argv)
+{
+	char *server_addr = "127.0.0.1", *port = "8888";
+	char *workload = "workload.txt";
+	struct addrinfo hints;
+	struct timespec start, end;
+	pthread_t *threads;
+	int option_char, nthreads = 4, i, server_pid = 0;
+	int cpu_pids[MAX_CPU_PIDS], ncpu_pids = 0;
+	long syscw = 0, segs = 0, nresponses;
+	double elapsed, cpu[MAX_CPU_PIDS], gb, skew = 0;
+
+	while ((option_char = getopt_long(argc, argv, "s:p:t:w:r:Z:k:d:P:C:e:b:BL:h",
+	    gLongOptions, NULL)) != -1) {
+		switch (option_char) {
+			case 's': // server
+				server_addr = optarg;
+				break;
+			case 'p': // port
+				port = optarg;
+				break;
+			case 't': // thread-count
+				nthreads = atoi(optarg);
+				break;
+			case 'w': // workload
+				workload = optarg;
+				break;
+			case 'r': // request count
+				nrequests = atol(optarg);
+				break;
+			case 'Z': // zipf skew
+				skew = atof(optarg);
+				break;
+			case 'k': // requests per connection
+				per_conn = atoi(optarg);
+				break;
+			case 'd': // pipeline depth
+				depth = atoi(optarg);
+				break;
+			case 'P': // server pid
+				server_pid = atoi(optarg);
+				break;
+			case 'C': // cpu pid
+				if (ncpu_pids == MAX_CPU_PIDS) {
+					fprintf(stderr, "%s", USAGE);
+					exit(1);
+				}
+				cpu_pids[ncpu_pids++] = atoi(optarg);
+				break;
+			case 'e': // accepted encodings
+				encodings = optarg;
+				break;
+			case 'b': // break transfers
+				break_pct = atoi(optarg);
+				break;
+			case 'B': // restart broken transfers
+				restart = 1;
+				break;
+			case 'L': // latency size classes
+				if (_parse_classes(optarg) == -1) {
+					fprintf(stderr, "%s", USAGE);
+					exit(1);
+				}
+				break;
+			case 'h': // help
+				fprintf(stdout, "%s", USAGE);
+				exit(0);
+			default:
+				fprintf(stderr, "%s", USAGE);
+				exit(1);
+		}
+	}
+	if (break_pct) {
+		per_conn = depth = 1;
+	}
+	if (nthreads < 1 || per_conn < 1 || depth < 1 || break_pct < 0 ||
+	    break_pct > 100) {
+		fprintf(stderr, "%s", USAGE);
+		exit(1);
+	}
+	if (_load_workload(workload) == -1) {
+		fprintf(stderr, "no paths in %s\n", workload);
+		exit(1);
+	}
+	if (skew > 0) {
+		_zipf_init(skew);
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((i = getaddrinfo(server_addr, port, &hints, &server)) != 0) {
+		fprintf(stderr, "%s: %s\n", server_addr, gai_strerror(i));
+		exit(1);
+	}
+
+	threads = malloc(nthreads * sizeof(*threads));
+	if (server_pid) {
+		syscw = _syscw(server_pid);
+		segs = _tcp_out_segs();
+	}
+	for (i = 0; i < ncpu_pids; i++) {
+		cpu[i] = _cpu_seconds(cpu_pids[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, _client, NULL);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	nresponses = totals.ok + totals.not_found + totals.errors;
+	if (server_pid && nresponses) {
+		fprintf(stdout, "%.2f server write calls, %.2f TCP segments "
+		    "per response\n",
+		    (double)(_syscw(server_pid) - syscw) / nresponses,
+		    (double)(_tcp_out_segs() - segs) / nresponses);
+	}
+	gb = totals.bytes / 1e9;
+	for (i = 0; i < ncpu_pids && gb > 0; i++) {
+		fprintf(stdout, "process %d: %.3f CPU seconds per GB\n",
+		    cpu_pids[i], (_cpu_seconds(cpu_pids[i]) - cpu[i]) / gb);
+	}
+
+	fprintf(stdout, "%ld ok, %ld not found, %ld errors on %ld connections "
+	    "(%ld retried)\n", totals.ok, totals.not_found, totals.errors,
+	    totals.conns, totals.retried);
+	if (encodings) {
+		fprintf(stdout, "%ld of %ld ok responses encoded\n",
+		    totals.encoded, totals.ok);
+	}
+	if (break_pct) {
+		fprintf(stdout, "%ld transfers broken at %d%% and %s\n",
+		    totals.broken, break_pct, restart ? "restarted" :
+		    "resumed");
+	}
+	fprintf(stdout, "%.3f s, %.0f requests/s, %.2f MB/s\n", elapsed,
+	    (totals.ok + totals.not_found) / elapsed,
+	    totals.bytes / elapsed / (1 << 20));
+	if (totals.nlatencies && nclasses) {
+		/* Before the sort below parts latencies from their classes */
+		fprintf(stdout, "latency by file size:\n");
+		for (i = 0; i <= nclasses; i++) {
+			_report_class(i);
+		}
+	}
+	if (totals.nlatencies) {
+		qsort(totals.latencies, totals.nlatencies,
+		    sizeof(*totals.latencies), _cmp_double);
+		fprintf(stdout, "latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		    _percentile(&totals, 0.5), _percentile(&totals, 0.99),
+		    1000 * totals.latencies[totals.nlatencies - 1]);
+	}
+
+	freeaddrinfo(server);
+	free(threads);
+
+	return totals.errors ? 1 : 0;
+}
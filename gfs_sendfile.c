@@ -0,0 +1,31 @@
+#include <errno.h>
+#include <stdio.h>
+#include <sys/sendfile.h>
+
+#include "gfserver.h"
+
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fd, off_t offset, size_t len)
+{
+	ssize_t written;
+	size_t sent = 0;
+
+	while (sent < len) {
+		/* An explicit offset leaves the position of a shared fd alone */
+		written = sendfile(ctx->socket, fd, &offset, len - sent);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("sendfile");
+			return -1;
+		}
+		if (written == 0) {
+			/* The file ended early */
+			break;
+		}
+		sent += written;
+		ctx->bytes_transferred += written;
+	}
+
+	return sent;
+}
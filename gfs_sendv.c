@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "gfserver.h"
+
+ssize_t gfs_sendv(gfcontext_t *ctx, gfstatus_t status, size_t file_len,
+    struct iovec *iov, int iovcnt)
+{
+	return gfs_sendv_encoded(ctx, status, file_len, NULL, iov, iovcnt);
+}
+
+ssize_t gfs_sendv_encoded(gfcontext_t *ctx, gfstatus_t status,
+    size_t file_len, const char *encoding, struct iovec *iov, int iovcnt)
+{
+	return gfs_sendv_range(ctx, status, file_len, encoding, -1, 0, iov,
+	    iovcnt);
+}
+
+ssize_t gfs_sendv_range(gfcontext_t *ctx, gfstatus_t status,
+    size_t file_len, const char *encoding, ssize_t offset, size_t file_size,
+    struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[GFS_SENDV_MAX + 1];
+	char header[128];
+	int len;
+	ssize_t written;
+	size_t sent = 0;
+	int i = 0, n = iovcnt + 1;
+
+	if (iovcnt < 0 || iovcnt > GFS_SENDV_MAX) {
+		fprintf(stderr, "gfs_sendv: Invalid iovcnt argument\n");
+		return -1;
+	}
+	/* The same headers gfs_sendheader writes */
+	switch (status) {
+	case GF_OK:
+		len = snprintf(header, sizeof(header), "Getfile OK %lu ",
+		    file_len);
+		if (encoding) {
+			len += snprintf(header + len, sizeof(header) - len,
+			    "%s ", encoding);
+		}
+		if (offset != -1) {
+			snprintf(header + len, sizeof(header) - len,
+			    "range=%zd+%lu/%lu ", offset, file_len, file_size);
+		}
+		break;
+	case GF_FILE_NOT_FOUND:
+		strcpy(header, "GetFile FILE_NOT_FOUND 0\n");
+		break;
+	case GF_ERROR:
+		strcpy(header, "GetFile ERROR 0\n");
+		break;
+	default:
+		fprintf(stderr, "gfs_sendv: Invalid gfstatus argument\n");
+		return -1;
+	}
+	vec[0].iov_base = header;
+	vec[0].iov_len = strlen(header);
+	memcpy(vec + 1, iov, iovcnt * sizeof(*iov));
+	ctx->file_len = file_len;
+	ctx->bytes_transferred = 0;
+
+	while (i < n) {
+		written = writev(ctx->socket, vec + i, n - i);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("writev");
+			return -1;
+		}
+		/* Skip what went out, counting the file bytes among it */
+		for (; i < n && written >= vec[i].iov_len; i++) {
+			written -= vec[i].iov_len;
+			sent += i ? vec[i].iov_len : 0;
+		}
+		if (i < n) {
+			vec[i].iov_base = (char *)vec[i].iov_base + written;
+			vec[i].iov_len -= written;
+			sent += i ? written : 0;
+		}
+	}
+	ctx->bytes_transferred = sent;
+
+	return sent;
+}
@@ -2,6 +2,7 @@
 #define __GETFILE_SERVER_H__
 
 #include <pthread.h>
+#include <sys/uio.h>
 #include "steque.h"
 
 #define MAX_REQUEST_LEN 128
@@ -118,4 +119,46 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Sends the Getfile header for status and file_len together with the
+ * iovcnt buffers in iov (at most GFS_SENDV_MAX) in one vectored write,
+ * so a small file leaves with its header in a single system call and
+ * segment.  The rest of the file, if any, follows with gfs_send.
+ * Returns the number of file bytes sent, or -1 on error.  This function
+ * should only be called from within a callback registered with the
+ * GFS_WORKER_FUNC option, in place of gfs_sendheader.
+ */
+#define GFS_SENDV_MAX 8
+ssize_t gfs_sendv(gfcontext_t *ctx, gfstatus_t status, size_t file_len,
+    struct iovec *iov, int iovcnt);
+
+/*
+ * gfs_sendv for a request that listed the content encodings it accepts
+ * (see encoding.h).  An OK header also names encoding, the one the file
+ * is sent in, after the length.
+ */
+ssize_t gfs_sendv_encoded(gfcontext_t *ctx, gfstatus_t status,
+    size_t file_len, const char *encoding, struct iovec *iov, int iovcnt);
+
+/*
+ * gfs_sendv_encoded for a request that asked for a byte range (see
+ * range.h), file_len being the length of the part sent.  Unless offset
+ * is -1, an OK header also tells where the part starts in the file and
+ * that the whole file is file_size bytes long.
+ */
+ssize_t gfs_sendv_range(gfcontext_t *ctx, gfstatus_t status,
+    size_t file_len, const char *encoding, ssize_t offset, size_t file_size,
+    struct iovec *iov, int iovcnt);
+
+/*
+ * Sends len bytes of the open file fd, starting at offset, to the client
+ * with sendfile, so they go from the page cache to the socket without
+ * passing through a user space buffer.  Neither the file position of fd
+ * nor anything else about it changes, so fd may be shared.  Returns the
+ * number of bytes sent, which is short if the file ends early, or -1 on
+ * error.  This function should only be called from within a callback
+ * registered with the GFS_WORKER_FUNC option, after the header.
+ */
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fd, off_t offset, size_t len);
+
 #endif
\ No newline at end of file
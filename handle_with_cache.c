@@ -1,4 +1,5 @@
 #define _POSIX_SOURCE
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <fcntl.h>
 #include <curl/curl.h>
@@ -7,155 +8,1280 @@
 #include <errno.h>
 #include <mqueue.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <semaphore.h>
+#include <stdio.h>
+#include <time.h>
 
 #include <pthread.h>
+#include "affinity.h"
+#include "encoding.h"
 #include "gfserver.h"
+#include "keyfilter.h"
+#include "l1cache.h"
+#include "range.h"
+#include "shm_channel.h"
+#include "trace.h"
 
-#define QUEUE_NAME            "/simplecache_mq"
+/* How often the proxy tries to re-register with a restarted cache */
+#define RECONNECT_MS 10
+/* Descriptors passed by the cache that no request has taken yet */
+#define MAX_PASSED   64
+/* Most segments one quantum comes through at once */
+#define MAX_STRIPES  16
+/* Chunks per stripe in a striped quantum when -Q does not say */
+#define STRIPE_CHUNKS 32
+/* Longest path a request may ask for a variant of */
+#define MAX_KEY_LEN   512
 
 static steque_t *seg_q;
 static pthread_mutex_t *seg_q_mutex;
 static pthread_cond_t *seg_q_cond;
 static unsigned long seg_size;
+static cpu_set_t *worker_cpus;
+static int nworkers;
+static __thread int worker_node = -2;
+static int next_segment;
+
+/*
+ * The connection to simplecached.  cache_gen changes every time the
+ * cache goes away, so a request can tell whether the cache it sent to
+ * is still the one running.
+ */
+static char cache_ns[MAX_SHM_NAME];
+static int cache_fd = -1;
+static mqd_t cache_q = (mqd_t)-1;
+static volatile int cache_up;
+static volatile int cache_gen;
+static long cache_timeout_ms = 5000;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t cache_q_lock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+ * The key filter and the generation it was opened under, guarded by
+ * filter_lock.  A request takes a reference on the mapping it reads, so
+ * the mapping of the filter before goes once the last one is done.
+ */
+struct filter_ref {
+	keyfilter_t *filter;
+	int refs;
+};
+static struct filter_ref *key_filter;
+static volatile uint64_t *generation;
+static uint64_t filter_gen;
+static pthread_rwlock_t filter_lock = PTHREAD_RWLOCK_INITIALIZER;
+static shm_doorbell_t *doorbell;
+static size_t transfer_quantum;
+static long pace_rate;
+static int max_stripes = 1;
+
+/*
+ * The segment pool grows by a segment whenever a request waited
+ * pool_grow_ms for one, up to max, and retires the segments that none
+ * of the requests of a whole pool_idle_ms needed, down to its initial
+ * size.  Guarded by seg_q_mutex.
+ */
+static struct {
+	int size, min, max, peak;
+	int waiting;
+	int free_low;		/* fewest free segments since the last check */
+	unsigned long checkouts, waits, grown, retired;
+	double wait_s, max_wait_s;
+} pool;
+static long pool_grow_ms = 2;
+static long pool_idle_ms = 5000;
+
+/*
+ * Every segment there is, free or checked out, so the proxy can remove
+ * them all when it exits.  Guarded by segments_mutex.
+ */
+static struct shm_info **segments;
+static int nsegments, segments_cap;
+static pthread_mutex_t segments_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Responses to requests that listed encodings, by the one they got */
+static struct {
+	unsigned long responses, bytes;
+} encoded[NENCODINGS];
+
+/*
+ * Files the cache passed as descriptors, by the segment of the request
+ * they answer.  Guarded by cache_mutex, with cache_cond signalling new
+ * arrivals.
+ */
+static struct {
+	char mem_name[MAX_SHM_NAME];
+	int fd;
+} passed[MAX_PASSED];
+static int npassed;
 
 struct shm_info {
   int  memfd;
-  char mem_name[12];
-  char sem1_name[12];
-  char sem2_name[12];
+  char mem_name[MAX_SHM_NAME];
+  char sem1_name[MAX_SHM_NAME];
+  char sem2_name[MAX_SHM_NAME];
+  int  node;
 };
 
-struct mem_info {
-  char mem_name[12];
-  char sem1_name[12];
-  char sem2_name[12];
-};
+static void _key_filter_put(struct filter_ref *ref)
+{
+	if (ref && __sync_sub_and_fetch(&ref->refs, 1) == 0) {
+		keyfilter_close(ref->filter);
+		free(ref);
+	}
+}
 
-struct request_info {
-	struct mem_info mem_i;
-	int mem_size;
-	int file_len;
-	char file_path[0];
-};
+/*
+ * Replaces the key filter with the one published for generation gen.
+ * If that cannot be opened the old one is dropped all the same, since
+ * it may turn away keys the cache now has, and filter_gen stays put so
+ * the next request tries again.  The caller holds filter_lock for
+ * writing.
+ */
+static void _key_filter_open(uint64_t gen)
+{
+	struct filter_ref *old = key_filter;
+	keyfilter_t *filter;
+
+	key_filter = NULL;
+	if ((filter = keyfilter_open(KEYFILTER_NAME))) {
+		key_filter = malloc(sizeof(*key_filter));
+		key_filter->filter = filter;
+		key_filter->refs = 1;
+		filter_gen = gen;
+	}
+	_key_filter_put(old);
+}
+
+/* Registers with simplecached and opens its request queue. */
+static int _cache_open()
+{
+	mqd_t q;
+	int fd;
+
+	if ((fd = shm_channel_register(cache_ns)) == -1) {
+		return -1;
+	}
+	/* The cache only accepts proxies once its queue exists */
+	if ((q = mq_open(QUEUE_NAME, O_WRONLY)) == (mqd_t)-1) {
+		perror("mq_open");
+		close(fd);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&cache_q_lock);
+	if (cache_q != (mqd_t)-1) {
+		mq_close(cache_q);
+	}
+	cache_q = q;
+	pthread_rwlock_unlock(&cache_q_lock);
+	/* Both outlive the cache */
+	if (!generation) {
+		generation = shm_channel_generation(0);
+	}
+	if (!doorbell) {
+		doorbell = shm_channel_doorbell(0);
+	}
+	/* The keys of this cache, published before it took registrations */
+	pthread_rwlock_wrlock(&filter_lock);
+	_key_filter_open(generation ? *generation : 0);
+	pthread_rwlock_unlock(&filter_lock);
+
+	pthread_mutex_lock(&cache_mutex);
+	cache_fd = fd;
+	cache_up = 1;
+	pthread_mutex_unlock(&cache_mutex);
+	pthread_cond_broadcast(&cache_cond);
+
+	return 0;
+}
+
+/*
+ * Returns a reference on the key filter, opening it again once the
+ * generation moved: simplecached publishes the keys of a reload before
+ * it bumps it.  Returns NULL if there is no filter to go by.
+ */
+static struct filter_ref *_key_filter_get()
+{
+	struct filter_ref *ref;
+	uint64_t gen;
+
+	pthread_rwlock_rdlock(&filter_lock);
+	if (generation && (gen = *generation) != filter_gen) {
+		pthread_rwlock_unlock(&filter_lock);
+		pthread_rwlock_wrlock(&filter_lock);
+		if ((gen = *generation) != filter_gen) {
+			_key_filter_open(gen);
+		}
+	}
+	if ((ref = key_filter)) {
+		__sync_add_and_fetch(&ref->refs, 1);
+	}
+	pthread_rwlock_unlock(&filter_lock);
+
+	return ref;
+}
+
+/*
+ * Removes the descriptor passed for segment mem_name (any, if NULL)
+ * from the table and returns it, or returns -2 if there is none.  The
+ * caller holds cache_mutex.
+ */
+static int _unstash_fd(char *mem_name)
+{
+	int i, fd;
+
+	for (i = 0; i < npassed; i++) {
+		if (!mem_name || !strcmp(passed[i].mem_name, mem_name)) {
+			fd = passed[i].fd;
+			passed[i] = passed[--npassed];
+			return fd;
+		}
+	}
+
+	return -2;
+}
+
+/*
+ * Files a descriptor the cache passed.  A full table only holds the
+ * leftovers of failed requests, so the oldest entry makes room.
+ */
+static void _stash_fd(char *mem_name, int fd)
+{
+	pthread_mutex_lock(&cache_mutex);
+	if (npassed == MAX_PASSED) {
+		if (passed[0].fd != -1) {
+			close(passed[0].fd);
+		}
+		passed[0] = passed[--npassed];
+	}
+	strcpy(passed[npassed].mem_name, mem_name);
+	passed[npassed++].fd = fd;
+	pthread_mutex_unlock(&cache_mutex);
+	pthread_cond_broadcast(&cache_cond);
+}
+
+/*
+ * Sleeps in the registration connection, filing the descriptors the
+ * cache passes, until the cache closes it, which the kernel does as
+ * soon as the cache dies.  Then registers again under the same
+ * namespace.
+ */
+static void *_cache_watch(void *arg)
+{
+	struct timespec pause = { 0, RECONNECT_MS * 1000000L };
+	char mem_name[MAX_SHM_NAME];
+	int fd;
+
+	while (1) {
+		while (shm_channel_recv_fd(cache_fd, mem_name, &fd) == 0) {
+			_stash_fd(mem_name, fd);
+		}
+		fprintf(stderr, "lost simplecached, reconnecting\n");
+		pthread_mutex_lock(&cache_mutex);
+		cache_up = 0;
+		cache_gen++;
+		close(cache_fd);
+		while ((fd = _unstash_fd(NULL)) != -2) {
+			if (fd != -1) {
+				close(fd);
+			}
+		}
+		pthread_mutex_unlock(&cache_mutex);
+		pthread_cond_broadcast(&cache_cond);
+		while (_cache_open() == -1) {
+			nanosleep(&pause, NULL);
+		}
+		fprintf(stdout, "Re-registered with simplecached as %s\n",
+		    cache_ns);
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+int handle_with_cache_connect(char *ns, long timeout_ms)
+{
+	struct timespec pause = { 0, RECONNECT_MS * 1000000L };
+	pthread_t watcher;
+	int waited = 0;
+
+	cache_timeout_ms = timeout_ms;
+	while (_cache_open() == -1) {
+		if (!waited++) {
+			fprintf(stdout, "waiting for simplecached\n");
+			fflush(stdout);
+		}
+		nanosleep(&pause, NULL);
+	}
+	strcpy(ns, cache_ns);
+	if (pthread_create(&watcher, NULL, _cache_watch, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(watcher);
+
+	return 0;
+}
+
+/* The caller of these two holds segments_mutex. */
+static void _track(struct shm_info *shm_blk)
+{
+	if (nsegments == segments_cap) {
+		segments_cap = segments_cap ? 2 * segments_cap : 64;
+		segments = realloc(segments, segments_cap * sizeof(*segments));
+	}
+	segments[nsegments++] = shm_blk;
+}
+
+static void _untrack(struct shm_info *shm_blk)
+{
+	int i;
+
+	for (i = 0; i < nsegments; i++) {
+		if (segments[i] == shm_blk) {
+			segments[i] = segments[--nsegments];
+			break;
+		}
+	}
+}
 
 int handle_with_cache_init(steque_t *segfds_q, unsigned long segment_size,
-		pthread_mutex_t *segfds_q_mutex, pthread_cond_t *segfds_q_cond)
+		pthread_mutex_t *segfds_q_mutex, pthread_cond_t *segfds_q_cond,
+		cpu_set_t *cpus)
 {
+	int i;
+
 	seg_q = segfds_q;
 	seg_size = segment_size;
 	seg_q_mutex = segfds_q_mutex;
 	seg_q_cond = segfds_q_cond;
+	worker_cpus = cpus;
+	next_segment = steque_size(segfds_q);
+	pool.size = pool.min = pool.max = pool.peak = pool.free_low =
+	    steque_size(segfds_q);
+	pthread_mutex_lock(&segments_mutex);
+	for (i = 0; i < pool.size; i++) {
+		_track((struct shm_info *)steque_front(segfds_q));
+		steque_cycle(segfds_q);
+	}
+	pthread_mutex_unlock(&segments_mutex);
 
 	return 0;
 }
 
-ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg)
+/*
+ * Removes every segment.  segments_mutex stays locked until the process
+ * exits, so no transfer makes a new one in the meantime.
+ */
+void handle_with_cache_cleanup()
 {
-	mqd_t msg_q;
-	void *mem;
-	struct request_info *req;
 	struct shm_info *shm_blk;
+	int i;
+
+	pthread_mutex_lock(&segments_mutex);
+	for (i = 0; i < nsegments; i++) {
+		shm_blk = segments[i];
+		if (shm_unlink(shm_blk->mem_name) == 0) {
+			fprintf(stdout, "Shared mem %s removed from system.\n",
+			    shm_blk->mem_name);
+		}
+		if (sem_unlink(shm_blk->sem1_name) == 0) {
+			fprintf(stdout, "Semaphore %s removed from system.\n",
+			    shm_blk->sem1_name);
+		}
+		if (sem_unlink(shm_blk->sem2_name) == 0) {
+			fprintf(stdout, "Semaphore %s removed from system.\n",
+			    shm_blk->sem2_name);
+		}
+	}
+}
+
+void handle_with_cache_pace(size_t quantum, long rate)
+{
+	transfer_quantum = quantum;
+	pace_rate = rate;
+}
+
+void handle_with_cache_stripes(int stripes)
+{
+	max_stripes = stripes < 1 ? 1 : stripes > MAX_STRIPES ? MAX_STRIPES :
+	    stripes;
+}
+
+static int _shm_node(steque_item item)
+{
+	return ((struct shm_info *)item)->node;
+}
+
+/*
+ * The gfserver threads are created inside gfserver, so each one pins
+ * itself to its CPU the first time it handles a request.
+ */
+static void _pin_worker()
+{
+	int cpu;
+
+	worker_node = -1;
+	if (!worker_cpus) {
+		return;
+	}
+	cpu = affinity_cpu(worker_cpus, __sync_fetch_and_add(&nworkers, 1));
+	if (affinity_pin(cpu) != 0) {
+		fprintf(stderr, "unable to pin worker to cpu %d\n", cpu);
+		return;
+	}
+	worker_node = affinity_node(cpu);
+}
+
+static int _cache_alive(void *gen)
+{
+	return cache_up && cache_gen == *(int *)gen;
+}
+
+static void _deadline(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	ts->tv_sec += ts->tv_nsec / 1000000000L;
+	ts->tv_nsec %= 1000000000L;
+}
+
+/*
+ * Hands req to the cache, waiting up to the timeout for a cache that is
+ * restarting.  Stores the generation of the cache it went to in gen.
+ */
+static int _cache_send(struct request_info *req, size_t len, int *gen)
+{
+	struct timespec deadline;
+	int ret;
+
+	_deadline(&deadline, cache_timeout_ms);
+	pthread_mutex_lock(&cache_mutex);
+	while (!cache_up) {
+		if (pthread_cond_timedwait(&cache_cond, &cache_mutex,
+		    &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&cache_mutex);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	*gen = cache_gen;
+	pthread_mutex_unlock(&cache_mutex);
+
+	pthread_rwlock_rdlock(&cache_q_lock);
+	ret = mq_timedsend(cache_q, (char *)req, len, 0, &deadline);
+	pthread_rwlock_unlock(&cache_q_lock);
+
+	return ret;
+}
+
+/*
+ * Takes the descriptor the cache passed for the request on segment
+ * mem_name.  The cache sends it before it posts the status, but the
+ * watcher may not have filed it yet.
+ */
+static int _take_fd(char *mem_name, int gen)
+{
+	struct timespec deadline;
+	int fd;
+
+	_deadline(&deadline, cache_timeout_ms);
+	pthread_mutex_lock(&cache_mutex);
+	while ((fd = _unstash_fd(mem_name)) == -2) {
+		if (!_cache_alive(&gen)) {
+			errno = EPIPE;
+			break;
+		}
+		if (pthread_cond_timedwait(&cache_cond, &cache_mutex,
+		    &deadline) == ETIMEDOUT) {
+			errno = ETIMEDOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if (fd == -1) {
+		errno = EMFILE;
+	}
+
+	return fd < 0 ? -1 : fd;
+}
+
+/*
+ * After a failed transfer the cache may still hold the segment and its
+ * semaphores, so the segment gets a new name and a fresh object.  A cache
+ * thread still working on the old request then writes into the unlinked
+ * object, and a stale request that is still queued finds no segment.
+ */
+static void _reclaim(struct shm_info *shm_blk)
+{
+	int index = __sync_fetch_and_add(&next_segment, 1);
+	int fd;
+
+	pthread_mutex_lock(&cache_mutex);
+	if ((fd = _unstash_fd(shm_blk->mem_name)) >= 0) {
+		close(fd);
+	}
+	if (cache_up) {
+		shm_channel_retire(cache_fd, shm_blk->mem_name);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	close(shm_blk->memfd);
+	pthread_mutex_lock(&segments_mutex);
+	shm_unlink(shm_blk->mem_name);
+	shm_channel_name(shm_blk->mem_name, cache_ns, "m", index);
+	shm_channel_name(shm_blk->sem1_name, cache_ns, "s1", index);
+	shm_channel_name(shm_blk->sem2_name, cache_ns, "s2", index);
+	shm_blk->memfd = shm_channel_create(shm_blk->mem_name, seg_size,
+	    shm_blk->node);
+	pthread_mutex_unlock(&segments_mutex);
+}
+
+/* Creates a segment for the pool on node, under a name not used before. */
+static struct shm_info *_segment_create(int node)
+{
+	struct shm_info *shm_blk = malloc(sizeof(*shm_blk));
+	int index = __sync_fetch_and_add(&next_segment, 1);
+
+	shm_channel_name(shm_blk->mem_name, cache_ns, "m", index);
+	shm_channel_name(shm_blk->sem1_name, cache_ns, "s1", index);
+	shm_channel_name(shm_blk->sem2_name, cache_ns, "s2", index);
+	shm_blk->node = node;
+	pthread_mutex_lock(&segments_mutex);
+	shm_blk->memfd = shm_channel_create(shm_blk->mem_name, seg_size, node);
+	if (shm_blk->memfd >= 0) {
+		_track(shm_blk);
+	}
+	pthread_mutex_unlock(&segments_mutex);
+	if (shm_blk->memfd < 0) {
+		free(shm_blk);
+		return NULL;
+	}
+
+	return shm_blk;
+}
+
+/* Removes a free segment for good, and has the cache let go of it too. */
+static void _segment_destroy(struct shm_info *shm_blk)
+{
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_up) {
+		shm_channel_retire(cache_fd, shm_blk->mem_name);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	close(shm_blk->memfd);
+	pthread_mutex_lock(&segments_mutex);
+	_untrack(shm_blk);
+	shm_unlink(shm_blk->mem_name);
+	pthread_mutex_unlock(&segments_mutex);
+	free(shm_blk);
+}
+
+/* Takes the segment returned longest ago, returns going to the front. */
+static struct shm_info *_pop_oldest()
+{
+	int n = steque_size(seg_q);
+
+	while (--n > 0) {
+		steque_cycle(seg_q);
+	}
+
+	return (struct shm_info *)steque_pop(seg_q);
+}
+
+/*
+ * Every pool_idle_ms, retires the segments that stayed free all along,
+ * those returned longest ago first.
+ */
+static void *_pool_shrink(void *arg)
+{
+	struct timespec pause;
+	struct shm_info *shm_blk;
+	int n, retired;
+
+	pause.tv_sec = pool_idle_ms / 1000;
+	pause.tv_nsec = pool_idle_ms % 1000 * 1000000L;
+	while (1) {
+		nanosleep(&pause, NULL);
+		pthread_mutex_lock(seg_q_mutex);
+		n = pool.size - pool.min;
+		if (pool.free_low < n) {
+			n = pool.free_low;
+		}
+		for (retired = 0; retired < n; retired++) {
+			shm_blk = _pop_oldest();
+			pool.size--;
+			pool.retired++;
+			pthread_mutex_unlock(seg_q_mutex);
+			_segment_destroy(shm_blk);
+			pthread_mutex_lock(seg_q_mutex);
+		}
+		if (retired) {
+			fprintf(stdout, "Segment pool shrank to %d\n", pool.size);
+			fflush(stdout);
+		}
+		pool.free_low = steque_size(seg_q);
+		pthread_mutex_unlock(seg_q_mutex);
+	}
+
+	return NULL;
+}
+
+int handle_with_cache_pool(int max_segments, long grow_ms, long idle_ms)
+{
+	pthread_t shrinker;
+
+	pool.max = max_segments > pool.min ? max_segments : pool.min;
+	pool_grow_ms = grow_ms;
+	pool_idle_ms = idle_ms;
+	if (pool.max == pool.min || idle_ms <= 0) {
+		return 0;
+	}
+	if (pthread_create(&shrinker, NULL, _pool_shrink, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(shrinker);
+
+	return 0;
+}
+
+void handle_with_cache_report(FILE *out)
+{
+	int enc;
+
+	pthread_mutex_lock(seg_q_mutex);
+	fprintf(out, "Segment pool: %d segments (%d to %d, peak %d), "
+	    "%d waiting, %lu of %lu checkouts waited, %.3f ms on average, "
+	    "%.3f ms at most, %lu grown, %lu retired\n", pool.size, pool.min,
+	    pool.max, pool.peak, pool.waiting, pool.waits, pool.checkouts,
+	    pool.waits ? 1000 * pool.wait_s / pool.waits : 0.0,
+	    1000 * pool.max_wait_s, pool.grown, pool.retired);
+	pthread_mutex_unlock(seg_q_mutex);
+	for (enc = 0; enc < NENCODINGS; enc++) {
+		if (encoded[enc].responses) {
+			fprintf(out, "Encoding %s: %lu responses, %lu bytes\n",
+			    encoding_name(enc), encoded[enc].responses,
+			    encoded[enc].bytes);
+		}
+	}
+	fflush(out);
+}
+
+/* What a request has sent of its file so far, over all its quanta. */
+struct transfer {
+	uint64_t id;
+	char *path;		/* key of the object or of its variant */
+	const char *encoding;	/* for the header, NULL if none was asked for */
+	int variant;		/* a miss falls back on the next encoding */
+	ssize_t file_size;	/* -1 until the cache answered */
+	int ranged;		/* the client asked for a byte range */
+	size_t first;		/* where the part to send starts */
+	size_t end;		/* and ends, SIZE_MAX until cut at the file's */
+	size_t offset;		/* where the next byte to send is */
+	int found;
+	int header_sent;
+	int gone;		/* a write to the client failed */
+	int file_fd;		/* descriptor the cache passed, or -1 */
+	char *copy;		/* the file, for the L1 cache */
+	struct timespec start;
+};
+
+/*
+ * With -R, sleeps until sending what went out so far at pace_rate
+ * bytes per second would have taken.  No segment is held meanwhile.
+ */
+static void _pace(struct transfer *t)
+{
+	struct timespec now, pause;
+	double ahead;
+
+	if (!pace_rate) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ahead = (double)(t->offset - t->first) / pace_rate - (now.tv_sec -
+	    t->start.tv_sec) - (now.tv_nsec - t->start.tv_nsec) / 1e9;
+	if (ahead > 0) {
+		pause.tv_sec = ahead;
+		pause.tv_nsec = (ahead - pause.tv_sec) * 1e9;
+		nanosleep(&pause, NULL);
+	}
+}
+
+/* One of the segments a quantum comes through, and where it stands. */
+struct stripe {
+	struct shm_info *shm_blk;
+	void *mem;
 	sem_t *sem1;
 	sem_t *sem2;
-	int file_in_cache;
-	size_t file_size = 0;
-	size_t bytes_transferred = 0;
-	ssize_t write_len;
-	size_t cache_file_size;
+	int gen;
+	enum { STRIPE_STATUS, STRIPE_SIZE, STRIPE_DATA, STRIPE_TRAILER } state;
+	size_t pos;		/* where its next chunk starts in the file */
+};
+
+/*
+ * Waits for a free segment, or creates one once it has waited
+ * pool_grow_ms and the pool may grow.  The caller holds seg_q_mutex.
+ */
+static struct shm_info *_wait_segment()
+{
+	struct timespec start, end, deadline;
+	struct shm_info *grown = NULL;
+	double waited;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	_deadline(&deadline, pool_grow_ms);
+	pool.waiting++;
+	while (steque_isempty(seg_q) && !grown) {
+		if (pool.size == pool.max) {
+			pthread_cond_wait(seg_q_cond, seg_q_mutex);
+			continue;
+		}
+		if (pthread_cond_timedwait(seg_q_cond, seg_q_mutex,
+		    &deadline) != ETIMEDOUT || !steque_isempty(seg_q) ||
+		    pool.size == pool.max) {
+			continue;
+		}
+		pool.size++;
+		pthread_mutex_unlock(seg_q_mutex);
+		grown = _segment_create(worker_node < 0 ? -1 : worker_node);
+		pthread_mutex_lock(seg_q_mutex);
+		if (!grown) {
+			/* Out of shared memory, make do with what there is */
+			pool.size--;
+			pool.max = pool.size;
+			continue;
+		}
+		pool.grown++;
+		if (pool.size > pool.peak) {
+			pool.peak = pool.size;
+		}
+		fprintf(stdout, "Segment pool grew to %d, %d waiting\n",
+		    pool.size, pool.waiting);
+		fflush(stdout);
+	}
+	pool.waiting--;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	waited = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) /
+	    1e9;
+	pool.waits++;
+	pool.wait_s += waited;
+	if (waited > pool.max_wait_s) {
+		pool.max_wait_s = waited;
+	}
+
+	return grown ? grown : (struct shm_info *)affinity_pop(seg_q,
+	    _shm_node, worker_node);
+}
+
+/*
+ * Checks out up to n segments, preferring ones on this thread's node,
+ * and returns how many it got.  Only the first one is waited for.
+ */
+static int _checkout(struct stripe *stripes, int n)
+{
+	int k = 0;
 
 	pthread_mutex_lock(seg_q_mutex);
-	while (steque_isempty(seg_q)) {
-		pthread_cond_wait(seg_q_cond, seg_q_mutex);
+	pool.checkouts++;
+	do {
+		if (!k && steque_isempty(seg_q)) {
+			stripes[k].shm_blk = _wait_segment();
+		} else {
+			stripes[k].shm_blk = (struct shm_info *)affinity_pop(
+			    seg_q, _shm_node, worker_node);
+		}
+		stripes[k].mem = MAP_FAILED;
+		stripes[k].sem1 = stripes[k].sem2 = SEM_FAILED;
+		stripes[k++].state = STRIPE_STATUS;
+	} while (k < n && !steque_isempty(seg_q));
+	if (steque_size(seg_q) < pool.free_low) {
+		pool.free_low = steque_size(seg_q);
 	}
-	shm_blk = (struct shm_info *)steque_pop(seg_q);
 	pthread_mutex_unlock(seg_q_mutex);
 
-	if ((sem1 = sem_open(shm_blk->sem1_name, O_CREAT, 0644, 0)) ==
+	return k;
+}
+
+/* Maps the segment of s and asks the cache for quantum bytes from s->pos. */
+static int _stripe_open(struct transfer *t, struct stripe *s, size_t quantum,
+    size_t stride)
+{
+	struct request_info *req;
+	struct shm_info *shm_blk = s->shm_blk;
+	size_t req_len;
+
+	s->mem = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    shm_blk->memfd, 0);
+	if (s->mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if ((s->sem1 = sem_open(shm_blk->sem1_name, O_CREAT, 0644, 0)) ==
 	    SEM_FAILED) {
 		perror("sem_open");
 		return -1;
     	}
-    	if ((sem2 = sem_open(shm_blk->sem2_name, O_CREAT, 0644, 0)) ==
+    	if ((s->sem2 = sem_open(shm_blk->sem2_name, O_CREAT, 0644, 0)) ==
 	    SEM_FAILED) {
 		perror("sem_open");
 		return -1;
     	}
-retry:
-	errno = 0;
-	msg_q = mq_open(QUEUE_NAME, O_WRONLY);
-	if (msg_q == -1) {
-		if (errno == ENOENT || errno == EACCES) {
-			/* simplecached isn't ready yet, sleep and then retry */
-			fprintf(stdout, "waiting for simplecached\n");
-			sleep(2);
-			goto retry;
-		}
-		perror("mq_open");
-		return -1;
-	}
 
-	mem = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-	    shm_blk->memfd, 0);
-	if (!mem) {
-		perror("mmap");
-		return -1;
-	}
-	req = malloc(sizeof(*req) + strlen(path) + 1);
+	req_len = sizeof(*req) + strlen(t->path) + 1;
+	req = malloc(req_len);
 	memcpy(&req->mem_i, (char *)shm_blk + sizeof(int), sizeof(req->mem_i));
 	req->mem_size = seg_size;
-	req->file_len = strlen(path) + 1;
-	strncpy(req->file_path, path, strlen(path));
-	req->file_path[strlen(path)] = '\0';
-	mq_send(msg_q, (char *)req, sizeof(*req) + strlen(path) + 1, 0);
+	req->node = shm_blk->node;
+	req->trace_id = t->id;
+	req->offset = s->pos;
+	req->quantum = quantum;
+	req->stride = stride;
+	req->file_len = strlen(t->path) + 1;
+	strncpy(req->file_path, t->path, strlen(t->path));
+	req->file_path[strlen(t->path)] = '\0';
+	if (_cache_send(req, req_len, &s->gen) == -1) {
+		free(req);
+		return -1;
+	}
 	free(req);
+	trace_event(t->id, TRACE_QUEUED, 0);
 
-	sem_wait(sem1);
-	file_in_cache = *(int *)mem;
-	sem_post(sem1);
+	return 0;
+}
 
-	if (file_in_cache == -1) {
-		 gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-		 goto finish;
-	}
-	sem_wait(sem1);
-	file_size = *(size_t *)mem;
-	cache_file_size = file_size;
-	gfs_sendheader(ctx, GF_OK, file_size);
-	sem_post(sem1);
-	if (!file_size) {
-		goto finish;
-	}
-	while (file_size) {
-		sem_wait(sem1);
-		bytes_transferred =  seg_size < file_size ?
-		    seg_size : file_size;
-		write_len = gfs_send(ctx, (char *)mem, bytes_transferred);
-		if (write_len != bytes_transferred) {
-			fprintf(stderr, "write error");
-		}
-		file_size -= bytes_transferred;
-		sem_post(sem1);
+/* Gives the segment of s back, renewing it if the cache may still use it. */
+static void _stripe_close(struct stripe *s, int failed)
+{
+	struct shm_info *shm_blk = s->shm_blk;
+
+	if (s->sem1 != SEM_FAILED) {
+		sem_close(s->sem1);
 	}
-	sem_wait(sem1);
-	file_size = *(size_t *)mem;
-	if (file_size) {
-		fprintf(stderr, "transfer error");
+	if (s->sem2 != SEM_FAILED) {
+		sem_close(s->sem2);
 	}
-	sem_post(sem1);
-
-finish:
-	mq_close(msg_q);
-	sem_close(sem1);
-	sem_close(sem2);
 	sem_unlink(shm_blk->sem1_name);
 	sem_unlink(shm_blk->sem2_name);
-	munmap(mem, seg_size);
+	if (s->mem != MAP_FAILED) {
+		munmap(s->mem, seg_size);
+	}
+	if (failed) {
+		_reclaim(shm_blk);
+	}
 	pthread_mutex_lock(seg_q_mutex);
 	steque_push(seg_q, shm_blk);
 	pthread_mutex_unlock(seg_q_mutex);
 	pthread_cond_signal(seg_q_cond);
+}
+
+/* Sends the OK header for the part t sends, with the iovcnt buffers in iov. */
+static ssize_t _send_header(gfcontext_t *ctx, struct transfer *t,
+    struct iovec *iov, int iovcnt)
+{
+	t->header_sent = 1;
+
+	return gfs_sendv_range(ctx, GF_OK, t->end - t->first, t->encoding,
+	    t->ranged ? t->first : -1, t->file_size, iov, iovcnt);
+}
 
-	return cache_file_size;
+/*
+ * Sends the next len bytes of the file, the header going with the
+ * first.  Once the client is gone they are only counted.
+ */
+static void _send_chunk(gfcontext_t *ctx, struct transfer *t, char *data,
+    size_t len)
+{
+	struct iovec iov;
+	ssize_t write_len;
+
+	if (t->gone) {
+		write_len = len;
+	} else if (!t->header_sent) {
+		iov.iov_base = data;
+		iov.iov_len = len;
+		write_len = _send_header(ctx, t, &iov, 1);
+	} else {
+		write_len = gfs_send(ctx, data, len);
+	}
+	t->gone |= write_len != len;
+	if (t->copy) {
+		memcpy(t->copy + t->offset, data, len);
+	}
+	trace_event(t->id, TRACE_PROXY_CHUNK, t->offset / seg_size);
+	t->offset += len;
 }
 
+/*
+ * One round trip with the cache.  Asks for the file from t->offset on
+ * and passes at most a quantum of it (all the rest of the part without
+ * -Q and -S) on to the client.  If the cache passes a descriptor
+ * instead, stores it in t->file_fd and leaves sending the file to the
+ * caller.  Returns -1 if the transfer failed.
+ *
+ * With -S, once the file size is known a quantum comes through as many
+ * segments as are free, each filled by its own cache worker.  The
+ * client gets the chunks in order, but whichever segment is filled
+ * gets drained: a chunk that came early waits in memory, so a cache
+ * worker never waits on a sibling that is still queued behind it.
+ */
+static int _fetch_quantum(gfcontext_t *ctx, struct transfer *t)
+{
+	struct stripe stripes[MAX_STRIPES], *s;
+	sem_t *filled[MAX_STRIPES];
+	shm_peer_t peer;
+	size_t base = t->offset, end = 0, limit, stride, chunk, file_size;
+	char *ahead = NULL;	/* chunks that came before their turn */
+	char *arrived = NULL;
+	int k, want = 1, i, first, status, pending, done, failed = 0;
+
+	if (max_stripes > 1 && t->file_size != -1) {
+		limit = t->end - t->offset;
+		if (transfer_quantum && transfer_quantum < limit) {
+			limit = transfer_quantum;
+		}
+		want = (limit + seg_size - 1) / seg_size;
+		if (want > max_stripes) {
+			want = max_stripes;
+		}
+	}
+	k = _checkout(stripes, want);
+	trace_event(t->id, TRACE_SEGMENT, k);
+
+	limit = transfer_quantum;
+	if (max_stripes > 1 && t->file_size == -1) {
+		/* One chunk tells the size, striping starts after it */
+		if (!limit || limit > seg_size) {
+			limit = seg_size;
+		}
+	} else if (max_stripes > 1 && !limit) {
+		/* Bounds what may have to wait in memory */
+		limit = k * seg_size * STRIPE_CHUNKS;
+	}
+	/* The cache reads no more of the file than the client asked for */
+	if (t->end != SIZE_MAX && (!limit || limit > t->end - t->offset)) {
+		limit = t->end - t->offset;
+	}
+	stride = k > 1 ? k * seg_size : 0;
+	for (i = 0; i < k; i++) {
+		/* An empty range asks from past any end, for the size only */
+		stripes[i].pos = t->offset == t->end ? SIZE_MAX :
+		    t->offset + i * seg_size;
+		if (_stripe_open(t, &stripes[i], limit ? limit - i * seg_size :
+		    0, stride) == -1) {
+			goto fail;
+		}
+		filled[i] = stripes[i].sem1;
+	}
+	peer.timeout_ms = cache_timeout_ms;
+	peer.alive = _cache_alive;
+	peer.arg = &stripes[0].gen;
+
+	pending = k;
+	while (pending) {
+		/* Hope for the stripe with the client's next bytes */
+		first = end ? (t->offset - base) / seg_size % k : 0;
+		while (!filled[first]) {
+			first = (first + 1) % k;
+		}
+		if ((i = shm_channel_recv_any(filled, k, first, &peer)) == -1) {
+			goto fail;
+		}
+		s = &stripes[i];
+		done = 0;
+		switch (s->state) {
+		case STRIPE_STATUS:
+			status = *(int *)s->mem;
+			trace_event(t->id, TRACE_PROXY_LOOKUP, status != -1);
+			if (status == -1 && t->file_size != -1) {
+				/* The file went away between two quanta */
+				errno = ENOENT;
+				goto fail;
+			}
+			if (status == -1) {
+				t->found = 0;
+				if (!t->variant) {
+					gfs_sendv(ctx, GF_FILE_NOT_FOUND, 0,
+					    NULL, 0);
+				}
+				done = 1;
+				break;
+			}
+			if (status == 2 && (k > 1 || (t->file_fd =
+			    _take_fd(s->shm_blk->mem_name, s->gen)) == -1)) {
+				goto fail;
+			}
+			s->state = STRIPE_SIZE;
+			break;
+		case STRIPE_SIZE:
+			file_size = *(size_t *)s->mem;
+			if (t->file_size != -1 && file_size != t->file_size) {
+				errno = ESTALE;
+				goto fail;
+			}
+			t->file_size = file_size;
+			/* A range is cut short at the end of the file */
+			if (t->end > file_size) {
+				t->end = file_size;
+			}
+			if (t->first > file_size) {
+				t->first = t->offset = file_size;
+			}
+			end = limit && base + limit < t->end ? base + limit :
+			    t->end;
+			if (!t->header_sent && t->first == t->end) {
+				_send_header(ctx, t, NULL, 0);
+			}
+			if (!file_size || t->file_fd != -1) {
+				done = 1;
+				break;
+			}
+			/* Keep a copy of a small file for the L1 cache */
+			if (!t->header_sent && !t->copy && !t->first &&
+			    t->end == file_size && l1cache_fits(file_size)) {
+				t->copy = malloc(file_size);
+			}
+			s->state = s->pos < end ? STRIPE_DATA : STRIPE_TRAILER;
+			break;
+		case STRIPE_DATA:
+			chunk = seg_size < end - s->pos ? seg_size : end - s->pos;
+			if (s->pos == t->offset) {
+				_send_chunk(ctx, t, s->mem, chunk);
+				while (arrived && t->offset < end &&
+				    arrived[(t->offset - base) / seg_size]) {
+					_send_chunk(ctx, t, ahead + t->offset - base,
+					    seg_size < end - t->offset ? seg_size :
+					    end - t->offset);
+				}
+			} else {
+				if (!ahead) {
+					ahead = malloc(end - base);
+					arrived = calloc((end - base) / seg_size + 1,
+					    1);
+				}
+				memcpy(ahead + s->pos - base, s->mem, chunk);
+				arrived[(s->pos - base) / seg_size] = 1;
+			}
+			s->pos += stride ? stride : chunk;
+			if (s->pos >= end) {
+				s->state = STRIPE_TRAILER;
+			}
+			break;
+		case STRIPE_TRAILER:
+			if (*(size_t *)s->mem) {
+				fprintf(stderr, "transfer error");
+			}
+			done = 1;
+			break;
+		}
+		shm_channel_ack(s->sem2, doorbell);
+		if (done) {
+			filled[i] = NULL;
+			pending--;
+		}
+	}
+	goto finish;
+
+fail:
+	fprintf(stderr, "request for %s on %s failed: %s\n", t->path,
+	    stripes[0].shm_blk->mem_name, strerror(errno));
+	failed = 1;
+finish:
+	for (i = 0; i < k; i++) {
+		_stripe_close(&stripes[i], failed);
+	}
+	free(ahead);
+	free(arrived);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * Sends the part of the file the cache passed from t->offset on,
+ * quantum by quantum.
+ */
+static void _send_passed(gfcontext_t *ctx, struct transfer *t)
+{
+	size_t len;
+
+	/* The file goes from the cache's page cache to the client */
+	if (!t->header_sent) {
+		_send_header(ctx, t, NULL, 0);
+	}
+	while (t->offset < t->end) {
+		len = t->end - t->offset;
+		if (transfer_quantum && len > transfer_quantum) {
+			len = transfer_quantum;
+		}
+		if (gfs_sendfile(ctx, t->file_fd, t->offset, len) != len) {
+			t->gone = 1;
+			break;
+		}
+		trace_event(t->id, TRACE_PROXY_CHUNK, t->offset / seg_size);
+		t->offset += len;
+		if (t->offset < t->end) {
+			_pace(t);
+		}
+	}
+	close(t->file_fd);
+}
+
+/*
+ * Serves the object cached under key, in encoding (-1 if the client did
+ * not list any), or only range of it if that is not NULL.  A variant
+ * the cache does not have is not answered: the request is left to the
+ * next encoding and *missing set.
+ */
+static ssize_t _serve(gfcontext_t *ctx, char *key, int encoding,
+    const range_t *range, int variant, int *missing)
+{
+	struct transfer t;
+	struct iovec iov;
+	size_t first = 0;
+	ssize_t ret;
+	int failed = 0;
+	uint64_t id = trace_id();
+	l1cache_entry_t *hit;
+	uint64_t l1_gen = l1cache_generation();
+	struct filter_ref *filter;
+	int known;
+
+	*missing = 0;
+	trace_event(id, TRACE_PROXY_START, 0);
+	/* A request for a hot object never leaves the proxy */
+	if ((hit = l1cache_get(key))) {
+		iov.iov_len = hit->len;
+		if (range) {
+			range_clip(range, hit->len, &first, &iov.iov_len);
+		}
+		iov.iov_base = (char *)hit->data + first;
+		ret = gfs_sendv_range(ctx, GF_OK, iov.iov_len, encoding == -1 ?
+		    NULL : encoding_name(encoding), range ? first : -1,
+		    hit->len, &iov, 1);
+		/*
+		 * An OK header only fails to go out whole if the write does,
+		 * so cut the connection as a failed transfer below does
+		 */
+		if (ret == -1) {
+			ret = ctx->bytes_transferred;
+			ctx->bytes_transferred = ctx->file_len;
+			shutdown(ctx->socket, SHUT_RDWR);
+		}
+		l1cache_put(hit);
+		trace_event(id, TRACE_PROXY_FINISH, 0);
+		return ret;
+	}
+	/* Neither does a request for a key the cache does not have */
+	filter = _key_filter_get();
+	known = !filter || keyfilter_may_contain(filter->filter, key);
+	_key_filter_put(filter);
+	if (!known) {
+		*missing = variant;
+		if (!variant) {
+			gfs_sendv(ctx, GF_FILE_NOT_FOUND, 0, NULL, 0);
+		}
+		trace_event(id, TRACE_PROXY_FINISH, 0);
+		return 0;
+	}
+	if (worker_node == -2) {
+		_pin_worker();
+	}
+
+	memset(&t, 0, sizeof(t));
+	t.id = id;
+	t.path = key;
+	t.encoding = encoding == -1 ? NULL : encoding_name(encoding);
+	t.variant = variant;
+	t.file_size = -1;
+	t.ranged = range != NULL;
+	t.end = SIZE_MAX;
+	if (range) {
+		t.first = t.offset = range->offset;
+		if (range->length < SIZE_MAX - range->offset) {
+			t.end = range->offset + range->length;
+		}
+	}
+	t.found = 1;
+	t.file_fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &t.start);
+	/*
+	 * With -Q a large file comes in quanta, each of which goes to the
+	 * back of the cache's queue, so transfers take turns at the segments
+	 * and the cache threads instead of holding them to the end.
+	 */
+	do {
+		if (t.offset != t.first) {
+			_pace(&t);
+		}
+		if (_fetch_quantum(ctx, &t) == -1) {
+			failed = 1;
+			break;
+		}
+	} while (t.found && !t.gone && t.file_fd == -1 && t.offset < t.end);
+	if (t.file_fd != -1) {
+		_send_passed(ctx, &t);
+	}
+	/*
+	 * A client that went away, say to resume with a range later, is not
+	 * sent the quanta after the one its connection broke in
+	 */
+	failed |= t.gone;
+
+	ret = t.found ? t.end - t.first : 0;
+	*missing = variant && !t.found && !failed;
+	if (failed) {
+		/*
+		 * gfserver answers GF_ERROR when nothing was sent yet.
+		 * Otherwise it would pad the file with zeros on close, so cut
+		 * the connection and let the client see it end short of
+		 * file_len.
+		 */
+		ret = -1;
+		if (t.header_sent) {
+			ret = ctx->bytes_transferred;
+			ctx->bytes_transferred = ctx->file_len;
+			shutdown(ctx->socket, SHUT_RDWR);
+		}
+	} else if (t.copy) {
+		l1cache_offer(key, t.copy, t.file_size, l1_gen);
+		t.copy = NULL;
+	}
+	free(t.copy);
+	trace_event(id, TRACE_PROXY_FINISH, 0);
+
+	return ret;
+}
+
+ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg)
+{
+	encoding_t encs[NENCODINGS];
+	char key[MAX_KEY_LEN];
+	range_t range, *part;
+	int i, n, missing, encoding;
+	ssize_t ret;
+
+	if ((i = range_requested(path, &range)) == -1) {
+		gfs_sendv(ctx, GF_ERROR, 0, NULL, 0);
+		return 0;
+	}
+	part = i == 0 ? &range : NULL;
+	/* Precompressed variants first, in the order the client prefers */
+	n = encoding_requested(path, encs);
+	for (i = 0, missing = 1; i < n && missing; i++) {
+		if (encoding_key(key, sizeof(key), path, encs[i]) == 0) {
+			encoding = encs[i];
+			ret = _serve(ctx, key, encoding, part, 1, &missing);
+		}
+	}
+	if (missing) {
+		encoding = n == -1 ? -1 : ENCODING_IDENTITY;
+		ret = _serve(ctx, path, encoding, part, 0, &missing);
+	}
+	if (encoding != -1 && ret > 0) {
+		__sync_add_and_fetch(&encoded[encoding].responses, 1);
+		__sync_add_and_fetch(&encoded[encoding].bytes, ret);
+	}
+
+	return ret;
+}
@@ -38,6 +38,7 @@ ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg)
 	CURLcode ccode;
 	int write_len;
 	struct MemoryStruct chunk;
+	struct iovec iov;
 
 	memset(&chunk, 0, sizeof(chunk));
 	strcpy(buffer, url_base);
@@ -65,10 +66,11 @@ ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg)
 		return EXIT_FAILURE;
 	}
 	if (status != 200) {
-		return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+		return gfs_sendv(ctx, GF_FILE_NOT_FOUND, 0, NULL, 0);
 	}
-	gfs_sendheader(ctx, GF_OK, chunk.size);
-	write_len = gfs_send(ctx, chunk.memory, chunk.size);
+	iov.iov_base = chunk.memory;
+	iov.iov_len = chunk.size;
+	write_len = gfs_sendv(ctx, GF_OK, chunk.size, &iov, 1);
 	if (write_len != chunk.size) {
 		fprintf(stderr, "handle_with_curl write error");
 	}	
@@ -13,6 +13,7 @@ ssize_t handle_with_file(gfcontext_t *ctx, char *path, void* arg){
 	ssize_t read_len, write_len;
 	char buffer[4096];
 	char *data_dir = arg;
+	struct iovec iov;
 
 	strcpy(buffer,data_dir);
 	strcat(buffer,path);
@@ -20,7 +21,7 @@ ssize_t handle_with_file(gfcontext_t *ctx, char *path, void* arg){
 	if( 0 > (fildes = open(buffer, O_RDONLY))){
 		if (errno == ENOENT)
 			/* If the file just wasn't found, then send FILE_NOT_FOUND code*/ 
-			return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+			return gfs_sendv(ctx, GF_FILE_NOT_FOUND, 0, NULL, 0);
 		else
 			/* Otherwise, it must have been a server error. gfserver library will handle*/ 
 			return EXIT_FAILURE;
@@ -30,18 +31,24 @@ ssize_t handle_with_file(gfcontext_t *ctx, char *path, void* arg){
 	file_len = lseek(fildes, 0, SEEK_END);
 	lseek(fildes, 0, SEEK_SET);
 
-	gfs_sendheader(ctx, GF_OK, file_len);
+	/* The header goes out together with the first chunk. */
+	read_len = file_len ? read(fildes, buffer, 4096) : 0;
+	if (read_len < 0 || (read_len == 0 && file_len)){
+		fprintf(stderr, "handle_with_file read error, %zd, 0, %zu", read_len, file_len );
+		return EXIT_FAILURE;
+	}
+	iov.iov_base = buffer;
+	iov.iov_len = read_len;
+	if (gfs_sendv(ctx, GF_OK, file_len, &iov, 1) != read_len){
+		fprintf(stderr, "handle_with_file write error");
+		return EXIT_FAILURE;
+	}
 
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len){
-		read_len = read(fildes, buffer, 4096);
-		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-			return EXIT_FAILURE;
-		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len){
+	/* The kernel sends the rest straight from the page cache. */
+	bytes_transferred = read_len;
+	if (bytes_transferred < file_len){
+		write_len = gfs_sendfile(ctx, fildes, bytes_transferred, file_len - bytes_transferred);
+		if (write_len != file_len - bytes_transferred){
 			fprintf(stderr, "handle_with_file write error");
 			return EXIT_FAILURE;
 		}
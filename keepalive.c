@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "keepalive.h"
+
+/* Room for a couple of pipelined requests */
+#define KEEPALIVE_BUFLEN (4 * MAX_REQUEST_LEN)
+
+static ssize_t (*worker_func)(gfcontext_t *, char *, void *);
+static long idle_timeout_ms;
+static int max_conn_requests;
+/* Readable once draining starts, which wakes every idle connection */
+static int drain_fds[2] = { -1, -1 };
+static volatile int draining;
+
+void keepalive_init(ssize_t (*handler)(gfcontext_t *, char *, void *),
+    long idle_ms, int max_requests)
+{
+	worker_func = handler;
+	idle_timeout_ms = idle_ms;
+	max_conn_requests = max_requests;
+	if (pipe2(drain_fds, O_CLOEXEC) == -1) {
+		drain_fds[0] = drain_fds[1] = -1;
+	}
+}
+
+void keepalive_drain()
+{
+	draining = 1;
+	if (drain_fds[1] != -1 && write(drain_fds[1], "", 1) == -1) {
+		drain_fds[1] = -1;
+	}
+}
+
+/*
+ * Parses the request at the start of buf, which is len bytes long and
+ * '\0' terminated.  Returns the number of bytes it takes up and points
+ * path at the (terminated) path in it, 0 if more bytes are needed, or
+ * -1 if it is malformed.  Only the bytes of the request are modified.
+ */
+static int _parse(char *buf, int len, char **path)
+{
+	char *start = buf, *end, *scheme, *method;
+
+	/* Skip what is left of the blank line that ended the last one */
+	start += strspn(start, "\r\n");
+	if (!(end = strchr(start, '\n'))) {
+		return len < KEEPALIVE_BUFLEN - 1 ? 0 : -1;
+	}
+	*end = '\0';
+	scheme = strsep(&start, " \t\r");
+	method = start ? strsep(&start, " \t\r") : NULL;
+	*path = start ? strsep(&start, " \t\r") : NULL;
+	if (strcasecmp(scheme, "GETFILE") || !method ||
+	    strcasecmp(method, "GET") || !*path || **path != '/') {
+		return -1;
+	}
+	/*
+	 * What follows the path on the line lists the encodings the client
+	 * accepts.  A path that ends the line is ended by the line's '\0',
+	 * so move it back by one, over the end of the method, to leave an
+	 * empty rest after it rather than the next request, as gfserver
+	 * does.
+	 */
+	if (!start) {
+		memmove(*path - 1, *path, strlen(*path) + 1);
+		(*path)--;
+	}
+
+	return end + 1 - buf;
+}
+
+/*
+ * Reads until buf holds a whole request.  Returns its length, or -1
+ * once the client closed the connection, went idle or sent garbage, or
+ * the proxy is draining.
+ */
+static int _next_request(int sock, char *buf, int *len, char **path)
+{
+	struct pollfd pfd[2];
+	ssize_t read_len;
+	int req_len;
+
+	while ((req_len = _parse(buf, *len, path)) == 0) {
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = drain_fds[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if (poll(pfd, 2, idle_timeout_ms) <= 0 || pfd[1].revents) {
+			return -1;
+		}
+		read_len = recv(sock, buf + *len, KEEPALIVE_BUFLEN - 1 - *len, 0);
+		if (read_len <= 0) {
+			return -1;
+		}
+		*len += read_len;
+		buf[*len] = '\0';
+	}
+
+	return req_len;
+}
+
+/*
+ * Runs the handler with the socket corked, so the header and a small
+ * file leave in one segment.  Otherwise Nagle holds the data back until
+ * the client acknowledges the header, which on a connection that stays
+ * open can take a delayed ACK.
+ */
+static ssize_t _serve(gfcontext_t *ctx, char *path, void *arg)
+{
+	ssize_t ret;
+	int on = 1, off = 0;
+
+	setsockopt(ctx->socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	ret = worker_func(ctx, path, arg);
+	setsockopt(ctx->socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+	return ret;
+}
+
+ssize_t keepalive_handler(gfcontext_t *ctx, char *path, void *arg)
+{
+	char buf[KEEPALIVE_BUFLEN];
+	ssize_t ret, total = 0;
+	int len = 0, req_len = 0, nrequests = 1, on = 1;
+
+	buf[0] = '\0';
+	setsockopt(ctx->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	ret = _serve(ctx, path, arg);
+	while (1) {
+		if (ret < 0) {
+			/* What gfserver does with a failed request */
+			gfs_sendheader(ctx, GF_ERROR, 0);
+		} else {
+			total += ret;
+		}
+		/* Drop the request just served, keep what was pipelined */
+		memmove(buf, buf + req_len, len - req_len + 1);
+		len -= req_len;
+		if (nrequests == max_conn_requests || draining ||
+		    ctx->bytes_transferred < ctx->file_len ||
+		    (req_len = _next_request(ctx->socket, buf, &len,
+		    &path)) == -1) {
+			break;
+		}
+		nrequests++;
+		ret = _serve(ctx, path, arg);
+	}
+	/* Tell a client with requests still in flight to retry them */
+	shutdown(ctx->socket, SHUT_WR);
+
+	return total;
+}
@@ -0,0 +1,38 @@
+#ifndef _KEEPALIVE_H_
+#define _KEEPALIVE_H_
+
+#include <sys/types.h>
+
+#include "gfserver.h"
+
+/*
+ * Persistent GETFILE connections.  gfserver reads one request per
+ * connection and closes it once the handler returns.  keepalive_handler
+ * wraps the real handler and, after answering the request gfserver
+ * read, keeps reading "GETFILE GET path" requests from the same socket
+ * and answers them back to back, in order.
+ *
+ * A client that wants several files on one connection sends its first
+ * request on its own and may pipeline the rest once the first response
+ * header has arrived (before that, gfserver could read them together
+ * with the first request into its fixed size buffer).  Clients that
+ * send a single request never notice the difference, since the
+ * connection ends as soon as they close it.
+ *
+ * The connection is closed once it has been idle for idle_ms or has
+ * served max_requests requests.  The server shuts down its side first,
+ * so a client with requests still in flight sees end of stream and can
+ * retry them on a new connection.
+ */
+void keepalive_init(ssize_t (*handler)(gfcontext_t *, char *, void *),
+    long idle_ms, int max_requests);
+
+ssize_t keepalive_handler(gfcontext_t *ctx, char *path, void *arg);
+
+/*
+ * Ends every connection once its current request is answered, instead
+ * of waiting for more, so a draining proxy is not held up by idle ones.
+ */
+void keepalive_drain();
+
+#endif
@@ -0,0 +1,151 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "keyfilter.h"
+
+#define KEYFILTER_MAGIC   0x6b666c74
+/* About 1% false positives */
+#define KEYFILTER_BITS    10
+#define KEYFILTER_HASHES  7
+#define KEYFILTER_MINBITS 1024
+
+static unsigned long nchecks, nrejected;
+
+static size_t _size(uint64_t nbits)
+{
+	return sizeof(keyfilter_t) + nbits / 8;
+}
+
+/*
+ * The two halves of a 64 bit FNV-1a hash, combined as h1 + i * h2,
+ * stand in for nhashes independent hashes.
+ */
+static void _hash(char *key, uint32_t *h1, uint32_t *h2)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*key) {
+		hash = (hash ^ (unsigned char)*key++) * 1099511628211ULL;
+	}
+	*h1 = hash;
+	*h2 = (hash >> 32) | 1;
+}
+
+keyfilter_t *keyfilter_create(char *name, uint64_t nkeys)
+{
+	keyfilter_t *filter;
+	uint64_t nbits = KEYFILTER_MINBITS;
+	int fd;
+
+	while (nbits < nkeys * KEYFILTER_BITS) {
+		nbits <<= 1;
+	}
+	/* Proxies keep whatever they mapped of the old one */
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd == -1) {
+		perror("shm_open");
+		return NULL;
+	}
+	if (ftruncate(fd, _size(nbits)) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	filter = mmap(NULL, _size(nbits), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	close(fd);
+	if (filter == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	filter->nhashes = KEYFILTER_HASHES;
+	filter->nbits = nbits;
+	filter->nkeys = 0;
+
+	return filter;
+}
+
+void keyfilter_add(keyfilter_t *filter, char *key)
+{
+	uint32_t h1, h2, i;
+	uint64_t bit;
+
+	_hash(key, &h1, &h2);
+	for (i = 0; i < filter->nhashes; i++) {
+		bit = (h1 + (uint64_t)i * h2) & (filter->nbits - 1);
+		filter->bits[bit / 8] |= 1 << (bit % 8);
+	}
+	filter->nkeys++;
+}
+
+void keyfilter_publish(keyfilter_t *filter)
+{
+	__sync_synchronize();
+	filter->magic = KEYFILTER_MAGIC;
+}
+
+void keyfilter_close(keyfilter_t *filter)
+{
+	munmap(filter, _size(filter->nbits));
+}
+
+keyfilter_t *keyfilter_open(char *name)
+{
+	keyfilter_t *filter;
+	struct stat st;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(*filter)) {
+		close(fd);
+		return NULL;
+	}
+	filter = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (filter == MAP_FAILED) {
+		return NULL;
+	}
+	if (filter->magic != KEYFILTER_MAGIC ||
+	    st.st_size != _size(filter->nbits)) {
+		munmap(filter, st.st_size);
+		return NULL;
+	}
+	__sync_synchronize();
+
+	return filter;
+}
+
+int keyfilter_may_contain(keyfilter_t *filter, char *key)
+{
+	uint32_t h1, h2, i;
+	uint64_t bit;
+
+	__sync_add_and_fetch(&nchecks, 1);
+	_hash(key, &h1, &h2);
+	for (i = 0; i < filter->nhashes; i++) {
+		bit = (h1 + (uint64_t)i * h2) & (filter->nbits - 1);
+		if (!(filter->bits[bit / 8] & 1 << (bit % 8))) {
+			__sync_add_and_fetch(&nrejected, 1);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void keyfilter_report(FILE *out)
+{
+	if (!nchecks) {
+		return;
+	}
+	fprintf(out, "Key filter: %lu of %lu lookups answered as missing "
+	    "locally\n", nrejected, nchecks);
+	fflush(out);
+}
@@ -0,0 +1,48 @@
+#ifndef _KEYFILTER_H_
+#define _KEYFILTER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Bloom filter of the keys simplecached serves, published in shared
+ * memory so a proxy can answer requests for paths the cache certainly
+ * does not have without asking it.  A key that was added always
+ * matches; a key that was not matches with a probability of about 1%.
+ *
+ * simplecached builds a fresh filter every time it loads its index,
+ * under a new object, so proxies that still map the old one are never
+ * confused by a half built filter.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t nhashes;
+	uint64_t nbits;		/* a power of two */
+	uint64_t nkeys;
+	uint8_t bits[];
+} keyfilter_t;
+
+/*
+ * Creates the filter called name, sized for nkeys keys, replacing any
+ * older one.  Returns NULL on error.
+ */
+keyfilter_t *keyfilter_create(char *name, uint64_t nkeys);
+
+void keyfilter_add(keyfilter_t *filter, char *key);
+
+/* Makes a filter whose keys were all added visible to keyfilter_open. */
+void keyfilter_publish(keyfilter_t *filter);
+
+/* Unmaps filter, which stays published for whoever opens it. */
+void keyfilter_close(keyfilter_t *filter);
+
+/* Maps the published filter called name read only, or returns NULL. */
+keyfilter_t *keyfilter_open(char *name);
+
+/* Returns 0 if key is certainly not in the filter. */
+int keyfilter_may_contain(keyfilter_t *filter, char *key);
+
+/* Prints how many lookups the filters of this process turned away. */
+void keyfilter_report(FILE *out);
+
+#endif
@@ -0,0 +1,286 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "l1cache.h"
+
+#define L1_BUCKETS     4096
+#define L1_STRIPES     64
+#define L1_SKETCH_BITS 13
+#define L1_SKETCH      (1 << L1_SKETCH_BITS)
+/* How many of the oldest entries are candidates for eviction */
+#define L1_SAMPLE      8
+/* Accesses between two halvings of the popularity counters */
+#define L1_AGE_EVERY   (8 * L1_SKETCH)
+
+static l1cache_entry_t *buckets[L1_BUCKETS];
+static pthread_rwlock_t stripes[L1_STRIPES];
+/* Held by every thread that changes the table, and guards what follows */
+static pthread_mutex_t l1_mutex = PTHREAD_MUTEX_INITIALIZER;
+static l1cache_entry_t *oldest, *newest;
+static size_t used_bytes;
+static size_t capacity, max_object_len;
+static volatile uint64_t *cache_generation;
+
+/*
+ * Popularity estimate: two counters per path, of which the smaller
+ * one counts, in a table much smaller than the set of paths.
+ */
+static unsigned char sketch[L1_SKETCH];
+static unsigned long accesses;
+
+static struct {
+	unsigned long hits, misses, stale, admitted, rejected, evicted;
+} stats;
+
+static uint32_t _hash(char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*path) {
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+	}
+
+	return hash;
+}
+
+static unsigned char *_counter(uint32_t hash, int i)
+{
+	return &sketch[i ? (hash * 0x9e3779b1u) >> (32 - L1_SKETCH_BITS) :
+	    hash & (L1_SKETCH - 1)];
+}
+
+static unsigned _popularity(uint32_t hash)
+{
+	unsigned a = *_counter(hash, 0), b = *_counter(hash, 1);
+
+	return a < b ? a : b;
+}
+
+/*
+ * Counts an access to hash.  Threads racing on a counter may lose a
+ * count, which an estimate can afford.
+ */
+static void _touch(uint32_t hash)
+{
+	unsigned char *c;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		c = _counter(hash, i);
+		if (*c < 255) {
+			(*c)++;
+		}
+	}
+	/* Halving every counter now and then lets old popularity fade */
+	if (__sync_add_and_fetch(&accesses, 1) % L1_AGE_EVERY == 0) {
+		for (i = 0; i < L1_SKETCH; i++) {
+			sketch[i] >>= 1;
+		}
+	}
+}
+
+/* A stale entry is worth nothing. */
+static unsigned _weight(l1cache_entry_t *e)
+{
+	return e->generation != *cache_generation ? 0 :
+	    _popularity(e->hash);
+}
+
+static pthread_rwlock_t *_stripe(uint32_t hash)
+{
+	return &stripes[hash % L1_BUCKETS % L1_STRIPES];
+}
+
+/* Walks the chain of hash.  The caller holds its stripe or l1_mutex. */
+static l1cache_entry_t *_find(char *path, uint32_t hash)
+{
+	l1cache_entry_t *e = buckets[hash % L1_BUCKETS];
+
+	while (e && (e->hash != hash || strcmp(e->path, path))) {
+		e = e->next;
+	}
+
+	return e;
+}
+
+static void _release(l1cache_entry_t *e)
+{
+	if (__sync_sub_and_fetch(&e->refs, 1) == 0) {
+		free(e->data);
+		free(e);
+	}
+}
+
+/*
+ * Takes e out of the table.  The caller holds l1_mutex, and the stripe
+ * of e keeps lookups out while the chain changes.  Requests still
+ * sending e keep it alive until they let go of it.
+ */
+static void _unlink(l1cache_entry_t *e)
+{
+	l1cache_entry_t **p = &buckets[e->hash % L1_BUCKETS];
+
+	pthread_rwlock_wrlock(_stripe(e->hash));
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+	pthread_rwlock_unlock(_stripe(e->hash));
+	if (e->older) {
+		e->older->newer = e->newer;
+	} else {
+		oldest = e->newer;
+	}
+	if (e->newer) {
+		e->newer->older = e->older;
+	} else {
+		newest = e->older;
+	}
+	used_bytes -= e->len;
+	_release(e);
+}
+
+int l1cache_init(size_t max_bytes, size_t max_object,
+    volatile uint64_t *generation)
+{
+	int i;
+
+	for (i = 0; i < L1_STRIPES; i++) {
+		pthread_rwlock_init(&stripes[i], NULL);
+	}
+	max_object_len = max_object;
+	cache_generation = generation;
+	capacity = max_bytes;
+
+	return 0;
+}
+
+uint64_t l1cache_generation()
+{
+	return cache_generation ? *cache_generation : 0;
+}
+
+int l1cache_fits(size_t len)
+{
+	return capacity && len <= max_object_len && len <= capacity;
+}
+
+l1cache_entry_t *l1cache_get(char *path)
+{
+	l1cache_entry_t *e;
+	uint32_t hash;
+	int stale = 0;
+
+	if (!capacity) {
+		return NULL;
+	}
+	hash = _hash(path);
+	_touch(hash);
+	pthread_rwlock_rdlock(_stripe(hash));
+	if ((e = _find(path, hash)) && e->generation != *cache_generation) {
+		stale = 1;
+		e = NULL;
+	}
+	if (e) {
+		__sync_add_and_fetch(&e->refs, 1);
+	}
+	pthread_rwlock_unlock(_stripe(hash));
+
+	if (stale) {
+		__sync_add_and_fetch(&stats.stale, 1);
+		pthread_mutex_lock(&l1_mutex);
+		if ((e = _find(path, hash)) &&
+		    e->generation != *cache_generation) {
+			_unlink(e);
+		}
+		pthread_mutex_unlock(&l1_mutex);
+		e = NULL;
+	}
+	__sync_add_and_fetch(e ? &stats.hits : &stats.misses, 1);
+
+	return e;
+}
+
+void l1cache_put(l1cache_entry_t *entry)
+{
+	_release(entry);
+}
+
+void l1cache_offer(char *path, char *data, size_t len, uint64_t generation)
+{
+	uint32_t hash = _hash(path);
+	unsigned popularity = _popularity(hash);
+	l1cache_entry_t *e, *victim;
+	int i;
+
+	if (!l1cache_fits(len) || generation != *cache_generation) {
+		free(data);
+		return;
+	}
+	pthread_mutex_lock(&l1_mutex);
+	/* Another request for the same path got here first */
+	if ((e = _find(path, hash))) {
+		if (e->generation == *cache_generation) {
+			pthread_mutex_unlock(&l1_mutex);
+			free(data);
+			return;
+		}
+		_unlink(e);
+	}
+	while (used_bytes + len > capacity) {
+		/* The least popular of the oldest entries makes room */
+		victim = NULL;
+		for (e = oldest, i = 0; e && i < L1_SAMPLE; e = e->newer, i++) {
+			if (!victim || _weight(e) < _weight(victim)) {
+				victim = e;
+			}
+		}
+		if (!victim || _weight(victim) >= popularity) {
+			pthread_mutex_unlock(&l1_mutex);
+			__sync_add_and_fetch(&stats.rejected, 1);
+			free(data);
+			return;
+		}
+		_unlink(victim);
+		__sync_add_and_fetch(&stats.evicted, 1);
+	}
+
+	e = malloc(sizeof(*e) + strlen(path) + 1);
+	strcpy(e->path, path);
+	e->hash = hash;
+	e->generation = generation;
+	e->refs = 1;
+	e->len = len;
+	e->data = data;
+	e->older = newest;
+	e->newer = NULL;
+	pthread_rwlock_wrlock(_stripe(hash));
+	e->next = buckets[hash % L1_BUCKETS];
+	buckets[hash % L1_BUCKETS] = e;
+	pthread_rwlock_unlock(_stripe(hash));
+	if (newest) {
+		newest->newer = e;
+	} else {
+		oldest = e;
+	}
+	newest = e;
+	used_bytes += len;
+	pthread_mutex_unlock(&l1_mutex);
+	__sync_add_and_fetch(&stats.admitted, 1);
+}
+
+void l1cache_report(FILE *out)
+{
+	unsigned long lookups = stats.hits + stats.misses;
+
+	if (!capacity) {
+		return;
+	}
+	fprintf(out, "L1 cache: %lu hits, %lu misses (%.1f%% hits), %lu stale, "
+	    "%lu admitted, %lu rejected, %lu evicted, %zu bytes used\n",
+	    stats.hits, stats.misses,
+	    lookups ? 100.0 * stats.hits / lookups : 0.0, stats.stale,
+	    stats.admitted, stats.rejected, stats.evicted, used_bytes);
+	fflush(out);
+}
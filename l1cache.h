@@ -0,0 +1,64 @@
+#ifndef _L1CACHE_H_
+#define _L1CACHE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Hot small objects kept inside webproxy, so requests for them never
+ * reach simplecached.  Lookups only take a read lock on one stripe of
+ * the hash table; inserts and evictions also take a global lock.
+ *
+ * The cache holds at most max_bytes of objects of at most max_object
+ * bytes each.  Every lookup, hit or miss, counts towards the estimated
+ * popularity of its path, and a new object only displaces older ones
+ * that are less popular than it is.
+ *
+ * Entries remember the generation simplecached had when they were
+ * fetched and stop matching as soon as simplecached bumps it (see
+ * shm_channel_generation).
+ */
+typedef struct l1cache_entry {
+	struct l1cache_entry *next;	/* hash chain */
+	struct l1cache_entry *older, *newer;	/* insertion order */
+	uint64_t generation;
+	uint32_t hash;
+	int refs;
+	size_t len;
+	char *data;
+	char path[];
+} l1cache_entry_t;
+
+/*
+ * Sets the cache up.  generation points at the counter simplecached
+ * bumps.  Until this is called (or with max_bytes 0) every lookup
+ * misses.
+ */
+int l1cache_init(size_t max_bytes, size_t max_object,
+    volatile uint64_t *generation);
+
+/*
+ * Returns the entry for path, which stays valid until it is handed to
+ * l1cache_put, or NULL on a miss.
+ */
+l1cache_entry_t *l1cache_get(char *path);
+
+void l1cache_put(l1cache_entry_t *entry);
+
+/* The generation to fetch an object under, read before asking for it. */
+uint64_t l1cache_generation();
+
+/* Returns 1 if an object of len bytes may be offered. */
+int l1cache_fits(size_t len);
+
+/*
+ * Offers len bytes of data, fetched for path under generation, to the
+ * cache, which takes over the malloc'ed buffer either way.
+ */
+void l1cache_offer(char *path, char *data, size_t len, uint64_t generation);
+
+/* Prints the hit ratio and the other counters. */
+void l1cache_report(FILE *out);
+
+#endif
@@ -0,0 +1,66 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "range.h"
+
+#define RANGE_TOKEN "range="
+
+/* Parses the decimal number at s, and points end past it. */
+static int _number(const char *s, size_t *n, const char **end)
+{
+	unsigned long long value;
+	char *stop;
+
+	if (*s < '0' || *s > '9') {
+		return -1;
+	}
+	errno = 0;
+	value = strtoull(s, &stop, 10);
+	if (errno == ERANGE || value > SIZE_MAX) {
+		return -1;
+	}
+	*n = value;
+	*end = stop;
+
+	return 0;
+}
+
+int range_parse(const char *token, range_t *range)
+{
+	const char *s = token + strlen(RANGE_TOKEN);
+
+	if (strncmp(token, RANGE_TOKEN, strlen(RANGE_TOKEN)) ||
+	    _number(s, &range->offset, &s) == -1) {
+		return -1;
+	}
+	range->length = RANGE_TO_END;
+	if (*s == '+' && _number(s + 1, &range->length, &s) == -1) {
+		return -1;
+	}
+
+	return *s && !strchr(" \t\r\n", *s) ? -1 : 0;
+}
+
+void range_clip(const range_t *range, size_t file_size, size_t *first,
+    size_t *len)
+{
+	*first = range->offset < file_size ? range->offset : file_size;
+	*len = range->length < file_size - *first ? range->length :
+	    file_size - *first;
+}
+
+/* The rest of the line follows the '\0' that ends path (see keepalive.c). */
+int range_requested(char *path, range_t *range)
+{
+	char *token = path + strlen(path) + 1;
+
+	while (*(token += strspn(token, " \t")) && !strchr("\r\n", *token)) {
+		if (!strncmp(token, RANGE_TOKEN, strlen(RANGE_TOKEN))) {
+			return range_parse(token, range);
+		}
+		token += strcspn(token, " \t\r\n");
+	}
+
+	return 1;
+}
@@ -0,0 +1,55 @@
+#ifndef _RANGE_H_
+#define _RANGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte ranges.  A client that wants part of a file, say the rest of one
+ * whose transfer broke off, asks for length bytes from offset on with
+ * a token after the path, before or after the encodings it accepts
+ * (see encoding.h):
+ *
+ *     GETFILE GET /big.jpg range=1048576+65536\r\n\r\n
+ *
+ * "range=offset" asks for everything from offset on.  A range is cut
+ * short at the end of the file, so one that starts there or later gets
+ * no data.  The length in the OK header is that of the part sent, and
+ * after the encoding, if the client listed any, comes where the part
+ * starts, its length and that of the whole file:
+ *
+ *     Getfile OK 65536 range=1048576+65536/5242880 <data>
+ *
+ * The range of a variant is one of its encoded bytes.
+ */
+typedef struct {
+	size_t offset;
+	size_t length;		/* RANGE_TO_END for the rest of the file */
+} range_t;
+
+#define RANGE_TO_END SIZE_MAX
+
+/*
+ * Parses the "range=" token at the start of token, up to the first
+ * blank, into range.  Returns 0, or -1 if it is malformed.
+ */
+int range_parse(const char *token, range_t *range);
+
+/*
+ * Cuts range short at the end of a file_size bytes file, storing where
+ * the part sent starts in first and its length in len.  A range that
+ * starts at the end of the file or past it gets first = file_size and
+ * no data.
+ */
+void range_clip(const range_t *range, size_t file_size, size_t *first,
+    size_t *len);
+
+/*
+ * Parses the range a request asks for after path, which gfserver or
+ * keepalive split off its request line.  Returns 0 and fills range if
+ * there is one, 1 if the request asks for the whole file and -1 if its
+ * range is malformed.
+ */
+int range_requested(char *path, range_t *range);
+
+#endif
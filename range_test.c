@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "encoding.h"
+#include "range.h"
+
+/*
+ * Edge cases of byte range parsing and clipping, see range.h.  Built
+ * and run by make test.
+ */
+
+#define FILE_SIZE 100
+
+static int failures;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__,	\
+		    #cond);						\
+		failures++;						\
+	}								\
+} while (0)
+
+/* Parses token and clips it to FILE_SIZE, checking both steps. */
+static void _parsed(const char *token, size_t offset, size_t length,
+    size_t first, size_t len)
+{
+	range_t range;
+	size_t got_first, got_len;
+
+	if (range_parse(token, &range) == -1) {
+		fprintf(stderr, "%s: rejected\n", token);
+		failures++;
+		return;
+	}
+	CHECK(range.offset == offset);
+	CHECK(range.length == length);
+	range_clip(&range, FILE_SIZE, &got_first, &got_len);
+	if (got_first != first || got_len != len) {
+		fprintf(stderr, "%s: clipped to %zu+%zu, not %zu+%zu\n",
+		    token, got_first, got_len, first, len);
+		failures++;
+	}
+}
+
+static void _malformed(const char *token)
+{
+	range_t range;
+
+	if (range_parse(token, &range) != -1) {
+		fprintf(stderr, "%s: accepted\n", token);
+		failures++;
+	}
+}
+
+/*
+ * Checks what range_requested and encoding_requested make of rest, the
+ * part of a request line after the path.
+ */
+static void _requested(const char *rest, int ret, size_t offset,
+    size_t length, int nencs)
+{
+	char line[256];
+	encoding_t encs[NENCODINGS];
+	range_t range;
+
+	/* gfserver ends the path with a '\0', see keepalive.c */
+	strcpy(line, "/path");
+	strcpy(line + strlen(line) + 1, rest);
+	if (range_requested(line, &range) != ret) {
+		fprintf(stderr, "\"%s\": range_requested did not return %d\n",
+		    rest, ret);
+		failures++;
+	} else if (ret == 0) {
+		CHECK(range.offset == offset);
+		CHECK(range.length == length);
+	}
+	if (encoding_requested(line, encs) != nencs) {
+		fprintf(stderr, "\"%s\": not %d encodings\n", rest, nencs);
+		failures++;
+	} else if (nencs > 0) {
+		CHECK(encs[0] == ENCODING_GZIP);
+	}
+}
+
+int main()
+{
+	/* Offset 0 */
+	_parsed("range=0", 0, RANGE_TO_END, 0, FILE_SIZE);
+	_parsed("range=0+10", 0, 10, 0, 10);
+	/* Offset at the end of the file and past it */
+	_parsed("range=100", 100, RANGE_TO_END, FILE_SIZE, 0);
+	_parsed("range=100+10", 100, 10, FILE_SIZE, 0);
+	_parsed("range=150+10", 150, 10, FILE_SIZE, 0);
+	_parsed("range=90+20", 90, 20, 90, 10);
+	/* No data at all */
+	_parsed("range=0+0", 0, 0, 0, 0);
+	_parsed("range=5+0", 5, 0, 5, 0);
+	/* No length is the rest of the file, a '+' without one is wrong */
+	_parsed("range=5", 5, RANGE_TO_END, 5, 95);
+	_malformed("range=5+");
+	/* offset + length past SIZE_MAX */
+	_parsed("range=18446744073709551615+10", SIZE_MAX, 10, FILE_SIZE, 0);
+	_parsed("range=10+18446744073709551615", 10, SIZE_MAX, 10, 90);
+	_parsed("range=18446744073709551615+18446744073709551615",
+	    SIZE_MAX, SIZE_MAX, FILE_SIZE, 0);
+	_malformed("range=18446744073709551616");
+	_malformed("range=5+99999999999999999999");
+	/* The token ends at a blank */
+	_parsed("range=5+10 gzip", 5, 10, 5, 10);
+	_parsed("range=5+10\r\n", 5, 10, 5, 10);
+	/* Malformed tokens */
+	_malformed("range=");
+	_malformed("range");
+	_malformed("range5");
+	_malformed("Range=5");
+	_malformed("range=abc");
+	_malformed("range=-5");
+	_malformed("range=+5");
+	_malformed("range= 5");
+	_malformed("range=5x");
+	_malformed("range=5+x");
+	_malformed("range=5+-1");
+	_malformed("range=5+10+3");
+	_malformed("range=5,6");
+	_malformed("range=5-10");
+
+	/* The range before and after the encodings, or alone */
+	_requested(" range=5+10 gzip\r\n", 0, 5, 10, 1);
+	_requested(" gzip range=5+10\r\n", 0, 5, 10, 1);
+	_requested(" gzip,zstd range=5\r\n", 0, 5, RANGE_TO_END, 2);
+	_requested(" range=0\r\n", 0, 0, RANGE_TO_END, -1);
+	_requested("\trange=7+1\t\r\n", 0, 7, 1, -1);
+	_requested(" gzip\r\n", 1, 0, 0, 1);
+	_requested("\r\n", 1, 0, 0, -1);
+	_requested("", 1, 0, 0, -1);
+	_requested(" range=x gzip\r\n", -1, 0, 0, 1);
+	_requested(" gzip range=5+\r\n", -1, 0, 0, 1);
+
+	if (failures) {
+		fprintf(stderr, "%d range checks failed\n", failures);
+		return 1;
+	}
+	fprintf(stdout, "range checks passed\n");
+
+	return 0;
+}
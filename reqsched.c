@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "affinity.h"
+#include "reqsched.h"
+#include "steque.h"
+
+#define NBUCKETS 32
+
+typedef struct {
+	void *req;
+	size_t size;
+	long long enq_ns;
+	unsigned long seq;
+	int refs;
+	int taken;
+} entry_t;
+
+typedef struct {
+	unsigned long count;
+	unsigned long buckets[NBUCKETS];
+} histogram_t;
+
+static reqsched_policy_t policy;
+static long long aging_ns;
+static size_t small_limit;
+static int (*req_node)(void *);
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+/* FIFO order, the large lane, and the arrival order for SOF aging */
+static steque_t fifo_q;
+/* The small lane */
+static steque_t small_q;
+/* Min-heap on (size, seq) for SOF */
+static entry_t **heap;
+static int heap_len, heap_cap;
+
+static int nqueued, nsmall;
+static unsigned long next_seq;
+static histogram_t waits[2];
+
+static long long _now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int _entry_node(steque_item item)
+{
+	return req_node(((entry_t *)item)->req);
+}
+
+static int _entry_less(entry_t *a, entry_t *b)
+{
+	return a->size < b->size || (a->size == b->size && a->seq < b->seq);
+}
+
+static void _heap_push(entry_t *e)
+{
+	int i, parent;
+
+	if (heap_len == heap_cap) {
+		heap_cap = heap_cap ? heap_cap * 2 : 64;
+		heap = realloc(heap, heap_cap * sizeof(*heap));
+	}
+	for (i = heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!_entry_less(e, heap[parent])) {
+			break;
+		}
+		heap[i] = heap[parent];
+	}
+	heap[i] = e;
+}
+
+static entry_t *_heap_pop()
+{
+	entry_t *top = heap[0], *last = heap[--heap_len];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < heap_len) {
+		if (child + 1 < heap_len &&
+		    _entry_less(heap[child + 1], heap[child])) {
+			child++;
+		}
+		if (!_entry_less(heap[child], last)) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+
+	return top;
+}
+
+static void _release(entry_t *e)
+{
+	if (--e->refs == 0) {
+		free(e);
+	}
+}
+
+/*
+ * SOF keeps every entry both in the heap and in arrival order.  An
+ * entry taken through one of them is only marked there and dropped
+ * from the other one when it reaches its front.
+ */
+static entry_t *_pop_sof()
+{
+	entry_t *e;
+
+	while (!steque_isempty(&fifo_q) &&
+	    ((entry_t *)steque_front(&fifo_q))->taken) {
+		_release(steque_pop(&fifo_q));
+	}
+	e = steque_front(&fifo_q);
+	if (_now_ns() - e->enq_ns > aging_ns) {
+		steque_pop(&fifo_q);
+	} else {
+		while ((e = _heap_pop())->taken) {
+			_release(e);
+		}
+	}
+	e->taken = 1;
+	_release(e);
+
+	return e;
+}
+
+static void _record(entry_t *e)
+{
+	long long wait_us = (_now_ns() - e->enq_ns) / 1000;
+	histogram_t *h = &waits[e->size > small_limit];
+	int bucket = 0;
+
+	while (wait_us > 0 && bucket < NBUCKETS - 1) {
+		wait_us >>= 1;
+		bucket++;
+	}
+	h->buckets[bucket]++;
+	h->count++;
+}
+
+void reqsched_init(reqsched_policy_t sched_policy, long aging_ms,
+    size_t small_size, int (*node_of)(void *))
+{
+	policy = sched_policy;
+	aging_ns = aging_ms * 1000000LL;
+	small_limit = small_size;
+	req_node = node_of;
+	steque_init(&fifo_q);
+	steque_init(&small_q);
+}
+
+int reqsched_policy(char *name, reqsched_policy_t *sched_policy)
+{
+	if (!strcmp(name, "fifo")) {
+		*sched_policy = REQSCHED_FIFO;
+	} else if (!strcmp(name, "sof")) {
+		*sched_policy = REQSCHED_SOF;
+	} else if (!strcmp(name, "lanes")) {
+		*sched_policy = REQSCHED_LANES;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+void reqsched_push(void *req, size_t size)
+{
+	entry_t *e = malloc(sizeof(*e));
+
+	e->req = req;
+	e->size = size;
+	e->enq_ns = _now_ns();
+	e->taken = 0;
+	e->refs = 1;
+
+	pthread_mutex_lock(&sched_mutex);
+	e->seq = next_seq++;
+	switch (policy) {
+	case REQSCHED_SOF:
+		e->refs = 2;
+		_heap_push(e);
+		steque_enqueue(&fifo_q, e);
+		break;
+	case REQSCHED_LANES:
+		if (size <= small_limit) {
+			steque_enqueue(&small_q, e);
+			nsmall++;
+			break;
+		}
+		/* fall through */
+	default:
+		steque_enqueue(&fifo_q, e);
+		break;
+	}
+	nqueued++;
+	pthread_mutex_unlock(&sched_mutex);
+
+	/* Small-lane workers may be the only ones able to take it */
+	if (policy == REQSCHED_LANES) {
+		pthread_cond_broadcast(&sched_cond);
+	} else {
+		pthread_cond_signal(&sched_cond);
+	}
+}
+
+void *reqsched_pop(int block, int node, int small_only)
+{
+	entry_t *e = NULL;
+	void *req = NULL;
+
+	pthread_mutex_lock(&sched_mutex);
+	while (block && (small_only ? !nsmall : !nqueued)) {
+		pthread_cond_wait(&sched_cond, &sched_mutex);
+	}
+	if (small_only ? !nsmall : !nqueued) {
+		pthread_mutex_unlock(&sched_mutex);
+		return NULL;
+	}
+	if (policy == REQSCHED_SOF) {
+		e = _pop_sof();
+	} else if (small_only || steque_isempty(&fifo_q)) {
+		e = affinity_pop(&small_q, _entry_node, node);
+		nsmall--;
+	} else {
+		e = affinity_pop(&fifo_q, _entry_node, node);
+	}
+	nqueued--;
+	_record(e);
+	req = e->req;
+	pthread_mutex_unlock(&sched_mutex);
+
+	/* SOF entries are freed once both of their queues dropped them */
+	if (policy != REQSCHED_SOF) {
+		free(e);
+	}
+
+	return req;
+}
+
+static long _percentile(histogram_t *h, double p)
+{
+	unsigned long seen = 0, target = h->count * p;
+	int bucket;
+
+	for (bucket = 0; bucket < NBUCKETS; bucket++) {
+		seen += h->buckets[bucket];
+		if (seen > target) {
+			break;
+		}
+	}
+
+	return 1L << bucket;
+}
+
+void reqsched_report(FILE *out)
+{
+	static char *names[] = { "small", "large" };
+	histogram_t copy[2], h;
+	int i;
+
+	pthread_mutex_lock(&sched_mutex);
+	memcpy(copy, waits, sizeof(copy));
+	pthread_mutex_unlock(&sched_mutex);
+	for (i = 0; i < 2; i++) {
+		h = copy[i];
+		if (!h.count) {
+			continue;
+		}
+		fprintf(out, "queue wait %s: %lu reqs, p50 <%ldus p90 <%ldus "
+		    "p99 <%ldus\n", names[i], h.count, _percentile(&h, 0.5),
+		    _percentile(&h, 0.9), _percentile(&h, 0.99));
+	}
+}
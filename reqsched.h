@@ -0,0 +1,56 @@
+#ifndef _REQSCHED_H_
+#define _REQSCHED_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Orders the requests handed from the receive loop of simplecached to
+ * its worker threads.
+ *
+ * REQSCHED_FIFO   Requests are served in arrival order.
+ *
+ * REQSCHED_SOF    The request for the smallest object is served first,
+ *                 unless the oldest request has waited longer than the
+ *                 aging bound, in which case it goes first.
+ *
+ * REQSCHED_LANES  Requests for objects up to the small limit go to a
+ *                 separate lane.  Workers started as small-lane workers
+ *                 only serve that lane; the others serve the large lane
+ *                 first and help with the small one when it is empty.
+ */
+typedef enum {
+	REQSCHED_FIFO,
+	REQSCHED_SOF,
+	REQSCHED_LANES
+} reqsched_policy_t;
+
+/*
+ * Initializes the scheduler.  node_of returns the NUMA node of a
+ * request, which FIFO and lane scheduling use to prefer requests on the
+ * popping worker's node.  small_limit is the largest object size (in
+ * bytes) counted as small, for the lanes and for the statistics.
+ */
+void reqsched_init(reqsched_policy_t policy, long aging_ms, size_t small_limit,
+    int (*node_of)(void *));
+
+/* Parses a policy name (fifo, sof or lanes).  Returns -1 if unknown. */
+int reqsched_policy(char *name, reqsched_policy_t *policy);
+
+/* Queues req, which asks for an object of size bytes. */
+void reqsched_push(void *req, size_t size);
+
+/*
+ * Returns the next request for a worker on node (-1 for any), or NULL
+ * if block is not set and there is nothing to do.  small_only restricts
+ * the worker to the small lane.
+ */
+void *reqsched_pop(int block, int node, int small_only);
+
+/*
+ * Prints the queueing delay percentiles of small and large requests
+ * measured so far.
+ */
+void reqsched_report(FILE *out);
+
+#endif
@@ -1 +1,448 @@
-//In case you want to implement the shared memory IPC as a library...
\ No newline at end of file
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <stddef.h>
+
+#include "affinity.h"
+#include "shm_channel.h"
+
+/* How often a waiter checks that its peer is still there */
+#define LIVENESS_SLICE_NS 5000000L
+/* How often a waiter on several segments looks at the others */
+#define ANY_SLICE_NS      1000000L
+
+static void _add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	ts->tv_sec += ts->tv_nsec / 1000000000L;
+	ts->tv_nsec %= 1000000000L;
+}
+
+static int _before(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Waits for sem in short slices, giving up once the peer's deadline
+ * passes or the peer is found to be gone.
+ */
+static int _sem_wait(sem_t *sem, shm_peer_t *peer)
+{
+	struct timespec deadline, slice;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	_add_ns(&deadline, peer->timeout_ms * 1000000L);
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &slice);
+		_add_ns(&slice, LIVENESS_SLICE_NS);
+		if (!_before(&slice, &deadline)) {
+			slice = deadline;
+		}
+		if (sem_timedwait(sem, &slice) == 0) {
+			return 0;
+		}
+		if (errno != ETIMEDOUT && errno != EINTR) {
+			return -1;
+		}
+		if (peer->alive && !peer->alive(peer->arg)) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (!_before(&slice, &deadline)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+/* Publishes the segment contents and waits for the peer to drain it. */
+int shm_channel_post(sem_t *filled, sem_t *drained, shm_peer_t *peer)
+{
+	sem_post(filled);
+	return _sem_wait(drained, peer);
+}
+
+/* Waits until the peer has filled the segment. */
+int shm_channel_recv(sem_t *filled, shm_peer_t *peer)
+{
+	return _sem_wait(filled, peer);
+}
+
+/*
+ * Waits until any of the n segments whose filled semaphore is not NULL
+ * has been filled, and returns its index.  filled[first], which must
+ * not be NULL, is the one the caller hopes for: the others are only
+ * looked at when it stays empty for a while.
+ */
+int shm_channel_recv_any(sem_t **filled, int n, int first, shm_peer_t *peer)
+{
+	struct timespec deadline, slice;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	_add_ns(&deadline, peer->timeout_ms * 1000000L);
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &slice);
+		_add_ns(&slice, ANY_SLICE_NS);
+		if (!_before(&slice, &deadline)) {
+			slice = deadline;
+		}
+		if (sem_timedwait(filled[first], &slice) == 0) {
+			return first;
+		}
+		if (errno != ETIMEDOUT && errno != EINTR) {
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			if (i != first && filled[i] &&
+			    sem_trywait(filled[i]) == 0) {
+				return i;
+			}
+		}
+		if (peer->alive && !peer->alive(peer->arg)) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (!_before(&slice, &deadline)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+/* Hands the segment back to the peer once its contents are consumed. */
+void shm_channel_ack(sem_t *drained, shm_doorbell_t *bell)
+{
+	sem_post(drained);
+	if (bell) {
+		shm_channel_ring(bell);
+	}
+}
+
+void shm_channel_ring(shm_doorbell_t *bell)
+{
+	/* Orders the post before the look at sleepers, see the arming */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&bell->sleepers, __ATOMIC_RELAXED)) {
+		return;
+	}
+	__atomic_add_fetch(&bell->rings, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &bell->rings, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+uint32_t shm_channel_doorbell_arm(shm_doorbell_t *bell)
+{
+	__atomic_add_fetch(&bell->sleepers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&bell->rings, __ATOMIC_SEQ_CST);
+}
+
+void shm_channel_doorbell_disarm(shm_doorbell_t *bell)
+{
+	__atomic_sub_fetch(&bell->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+void shm_channel_doorbell_wait(shm_doorbell_t *bell, uint32_t seen,
+    long long timeout_ns)
+{
+	struct timespec timeout;
+
+	timeout.tv_sec = timeout_ns / 1000000000LL;
+	timeout.tv_nsec = timeout_ns % 1000000000LL;
+	/* Returns right away if it rang since seen */
+	syscall(SYS_futex, &bell->rings, FUTEX_WAIT, seen, &timeout, NULL, 0);
+}
+
+shm_doorbell_t *shm_channel_doorbell(int create)
+{
+	shm_doorbell_t *bell;
+	int fd;
+
+	fd = shm_open(DOORBELL_NAME, create ? O_CREAT | O_RDWR : O_RDWR,
+	    0666);
+	if (fd == -1) {
+		perror("shm_open");
+		return NULL;
+	}
+	if (create && ftruncate(fd, sizeof(*bell)) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	bell = mmap(NULL, sizeof(*bell), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	close(fd);
+	if (bell == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	/* Nobody waits on it yet, whatever a cache before this one left */
+	if (create) {
+		__atomic_store_n(&bell->sleepers, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return bell;
+}
+
+static socklen_t _register_addr(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	/* Abstract socket, the leading '\0' keeps it off the file system */
+	strncpy(addr->sun_path + 1, REGISTER_SOCKET,
+	    sizeof(addr->sun_path) - 2);
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 +
+	    strlen(REGISTER_SOCKET);
+}
+
+int shm_channel_listen()
+{
+	struct sockaddr_un addr;
+	socklen_t len = _register_addr(&addr);
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, len) == -1 ||
+	    listen(fd, 16) == -1) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Reads exactly len bytes, returning -1 on error or end of stream. */
+static int _read_full(int fd, char *buf, size_t len)
+{
+	ssize_t read_len;
+	size_t got = 0;
+
+	while (got < len) {
+		read_len = read(fd, buf + got, len - got);
+		if (read_len <= 0) {
+			return -1;
+		}
+		got += read_len;
+	}
+
+	return 0;
+}
+
+int shm_channel_accept(int listen_fd, char *ns)
+{
+	char reply[MAX_SHM_NAME];
+	int fd;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+		perror("accept");
+		return -1;
+	}
+	/* A proxy that was registered before asks to keep its namespace */
+	if (_read_full(fd, reply, sizeof(reply)) == -1) {
+		close(fd);
+		return -1;
+	}
+	reply[sizeof(reply) - 1] = '\0';
+	if (reply[0]) {
+		strcpy(ns, reply);
+	}
+	memset(reply, 0, sizeof(reply));
+	strncpy(reply, ns, sizeof(reply) - 1);
+	if (write(fd, reply, sizeof(reply)) != sizeof(reply)) {
+		perror("write");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int shm_channel_register(char *ns)
+{
+	struct sockaddr_un addr;
+	socklen_t len = _register_addr(&addr);
+	char request[MAX_SHM_NAME];
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, len) == -1) {
+		close(fd);
+		return -1;
+	}
+	memset(request, 0, sizeof(request));
+	strncpy(request, ns, sizeof(request) - 1);
+	if (write(fd, request, sizeof(request)) != sizeof(request) ||
+	    _read_full(fd, ns, MAX_SHM_NAME) == -1) {
+		close(fd);
+		return -1;
+	}
+	ns[MAX_SHM_NAME - 1] = '\0';
+
+	return fd;
+}
+
+int shm_channel_pass_fd(int sock, char *mem_name, int fd)
+{
+	char tag[MAX_SHM_NAME];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	memset(tag, 0, sizeof(tag));
+	strncpy(tag, mem_name, sizeof(tag) - 1);
+	iov.iov_base = tag;
+	iov.iov_len = sizeof(tag);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	/* A message this small is queued whole or not at all */
+	return sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+	    sizeof(tag) ? 0 : -1;
+}
+
+int shm_channel_recv_fd(int sock, char *mem_name, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t len;
+
+	iov.iov_base = mem_name;
+	iov.iov_len = MAX_SHM_NAME;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	do {
+		len = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	} while (len == -1 && errno == EINTR);
+	if (len != MAX_SHM_NAME) {
+		return -1;
+	}
+	mem_name[MAX_SHM_NAME - 1] = '\0';
+	*fd = -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	return 0;
+}
+
+int shm_channel_retire(int sock, char *mem_name)
+{
+	char tag[MAX_SHM_NAME];
+
+	memset(tag, 0, sizeof(tag));
+	strncpy(tag, mem_name, sizeof(tag) - 1);
+
+	return send(sock, tag, sizeof(tag), MSG_NOSIGNAL) == sizeof(tag) ?
+	    0 : -1;
+}
+
+int shm_channel_recv_retired(int sock, char *mem_name)
+{
+	if (_read_full(sock, mem_name, MAX_SHM_NAME) == -1) {
+		return -1;
+	}
+	mem_name[MAX_SHM_NAME - 1] = '\0';
+
+	return 0;
+}
+
+void shm_channel_name(char *name, char *ns, char *kind, int index)
+{
+	snprintf(name, MAX_SHM_NAME, "%s.%s%d", ns, kind, index);
+}
+
+int shm_channel_create(char *name, size_t size, int node)
+{
+	void *mem;
+	int fd;
+
+	/* A fresh object, so stale mappings of the old one cannot touch it */
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_RDWR | O_EXCL, 0777);
+	if (fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	if (ftruncate(fd, size) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	if (node < 0) {
+		return fd;
+	}
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED || affinity_bind(mem, size, node) != 0) {
+		perror("mbind");
+	}
+	if (mem != MAP_FAILED) {
+		munmap(mem, size);
+	}
+
+	return fd;
+}
+
+volatile uint64_t *shm_channel_generation(int create)
+{
+	void *mem;
+	int fd;
+
+	fd = shm_open(GENERATION_NAME, create ? O_CREAT | O_RDWR : O_RDONLY,
+	    0644);
+	if (fd == -1) {
+		perror("shm_open");
+		return NULL;
+	}
+	/* Keeps the count when the object is already there */
+	if (create && ftruncate(fd, sizeof(uint64_t)) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, sizeof(uint64_t), create ? PROT_READ | PROT_WRITE :
+	    PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return (volatile uint64_t *)mem;
+}
@@ -1 +1,207 @@
-//In case you want to implement the shared memory IPC as a library...
\ No newline at end of file
+#ifndef _SHM_CHANNEL_H_
+#define _SHM_CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+
+#define QUEUE_NAME            "/simplecache_mq"
+#define MAX_CACHE_REQUEST_LEN 512
+#define MAX_SHM_NAME          32
+/* Abstract Unix socket on which simplecached registers proxies */
+#define REGISTER_SOCKET       "simplecached"
+/* Shared counter of what simplecached serves, see shm_channel_generation */
+#define GENERATION_NAME       "/simplecache_gen"
+/* Filter of the keys simplecached serves, see keyfilter.h */
+#define KEYFILTER_NAME        "/simplecache_keys"
+/* Doorbell of simplecached's io_uring workers, see shm_channel_doorbell */
+#define DOORBELL_NAME         "/simplecache_bell"
+
+/*
+ * Names of the shared memory segment and the pair of semaphores that
+ * make up one channel between webproxy and simplecached.
+ */
+struct mem_info {
+	char mem_name[MAX_SHM_NAME];
+	char sem1_name[MAX_SHM_NAME];
+	char sem2_name[MAX_SHM_NAME];
+};
+
+/*
+ * Message sent by webproxy on QUEUE_NAME for every request.  node is
+ * the NUMA node the segment is bound to (-1 if it is not bound),
+ * trace_id identifies the request in the trace ring (see trace.h) and
+ * file_len is the length of file_path including the terminating '\0'.
+ */
+struct request_info {
+	struct mem_info mem_i;
+	int mem_size;
+	int node;
+	uint64_t trace_id;
+	size_t offset;		/* where the part to send starts */
+	size_t quantum;		/* its length at most, 0 for the rest */
+	size_t stride;		/* from one chunk to the next, 0 if adjacent */
+	int file_len;
+	char file_path[0];
+};
+
+/*
+ * Every message on a channel is a write into the segment by
+ * simplecached followed by a post on sem1 ("filled").  webproxy waits
+ * on sem1, consumes the segment and posts sem2 ("drained"), after which
+ * simplecached may reuse the segment.  The messages of one request are,
+ * in order:
+ *
+ *   int     1 if the file is in the cache, -1 otherwise (then done),
+ *           or 2 if simplecached passed its descriptor instead
+ *   size_t  the file length (done if 0, or if the status was 2)
+ *   data    min(mem_size, remaining) bytes, repeated until the part
+ *           asked for (offset and quantum in request_info) is sent
+ *   size_t  0, marking the end of the transfer
+ *
+ * The status and the length always describe the whole file, so a proxy
+ * fetching a file one quantum at a time sees if it changed in between.
+ * A request with an offset past the end of the file gets them and the
+ * trailer only, which is how a proxy learns the length of a file it
+ * needs none of, say for an empty byte range.
+ *
+ * A quantum may come through several segments at once, one request per
+ * segment.  Stripe i of k then asks for the chunks at offset + i *
+ * mem_size with a stride of k * mem_size, and is never answered with a
+ * descriptor.
+ *
+ * With status 2 the file never goes through the segment.  Before
+ * posting the status simplecached sends the open file, tagged with the
+ * segment name, over the proxy's registration connection (see
+ * shm_channel_pass_fd), and the proxy sends it to its client from there.
+ *
+ * No wait on a channel is unbounded.  A wait fails with ETIMEDOUT once
+ * timeout_ms passes without the peer making progress, and with EPIPE as
+ * soon as alive (if set) reports that the peer is gone.  After a failed
+ * wait the channel is in an unknown state and its segment must not be
+ * reused as it is.
+ */
+typedef struct {
+	long timeout_ms;
+	int (*alive)(void *);
+	void *arg;
+} shm_peer_t;
+
+/*
+ * A thread that serves many channels at once, like an io_uring worker
+ * of simplecached, cannot block on all their semaphores.  It sleeps on
+ * the doorbell instead, which whoever drains a segment rings after
+ * posting sem2.  rings is a futex word bumped by every ring that finds
+ * a sleeper, so ringing costs a system call only while somebody waits.
+ */
+typedef struct {
+	uint32_t rings;
+	uint32_t sleepers;
+} shm_doorbell_t;
+
+int shm_channel_post(sem_t *filled, sem_t *drained, shm_peer_t *peer);
+int shm_channel_recv(sem_t *filled, shm_peer_t *peer);
+int shm_channel_recv_any(sem_t **filled, int n, int first, shm_peer_t *peer);
+/* Rings bell too, unless it is NULL */
+void shm_channel_ack(sem_t *drained, shm_doorbell_t *bell);
+
+/*
+ * Maps the doorbell.  simplecached passes create to make it before it
+ * takes registrations; proxies map the one that is there.  Returns NULL
+ * on error.
+ */
+shm_doorbell_t *shm_channel_doorbell(int create);
+void shm_channel_ring(shm_doorbell_t *bell);
+
+/*
+ * A sleeper arms the bell, which returns the rings so far, then looks
+ * at its semaphores one last time and only then waits, so a post it
+ * missed always comes with a ring.  The wait returns at the first ring
+ * after seen or after timeout_ns.  Disarm once awake.
+ */
+uint32_t shm_channel_doorbell_arm(shm_doorbell_t *bell);
+void shm_channel_doorbell_wait(shm_doorbell_t *bell, uint32_t seen,
+    long long timeout_ns);
+void shm_channel_doorbell_disarm(shm_doorbell_t *bell);
+
+/*
+ * Creates (or recreates from scratch) the segment called name, binding
+ * it to NUMA node unless node is -1.  Returns its descriptor or -1.
+ */
+int shm_channel_create(char *name, size_t size, int node);
+
+/*
+ * Registration.  Before creating its segments a proxy connects to
+ * REGISTER_SOCKET and simplecached answers with a namespace that no
+ * other proxy gets, so several proxies can share one cache without
+ * clobbering each other's segments and semaphores.  The connection
+ * stays open for as long as the proxy runs.  It carries the descriptors
+ * the cache passes one way, and the names of segments the proxy retires
+ * the other.
+ */
+
+/* Creates the listening socket in simplecached.  Returns -1 on error. */
+int shm_channel_listen();
+
+/*
+ * Accepts a proxy on the listening socket and sends it namespace ns,
+ * or the namespace the proxy asked to keep, which is then copied into
+ * ns.  Returns the connection, or -1 on error.
+ */
+int shm_channel_accept(int listen_fd, char *ns);
+
+/*
+ * Registers with simplecached and stores the namespace in ns, which
+ * must hold MAX_SHM_NAME bytes.  If ns is not empty the proxy asks to
+ * keep that namespace, as it does when re-registering with a restarted
+ * cache.  Returns the connection, or -1 if simplecached is not running.
+ */
+int shm_channel_register(char *ns);
+
+/*
+ * Passes descriptor fd to the proxy on registration connection sock,
+ * tagged with mem_name, the segment of the request it belongs to.  Never
+ * blocks, so a proxy that is slow to take descriptors only makes the
+ * cache fall back to the segment.  Returns -1 if fd was not sent.
+ */
+int shm_channel_pass_fd(int sock, char *mem_name, int fd);
+
+/*
+ * Waits for the next descriptor on registration connection sock and
+ * stores its tag in mem_name (MAX_SHM_NAME bytes) and the descriptor in
+ * fd, which is -1 if it did not make it (the proxy ran out of them).
+ * Returns -1 once the cache closed the connection.
+ */
+int shm_channel_recv_fd(int sock, char *mem_name, int *fd);
+
+/*
+ * Tells the cache on registration connection sock that the proxy
+ * removed segment mem_name for good, so the cache can drop any mapping
+ * of it it keeps.  Returns -1 if the cache did not get it.
+ */
+int shm_channel_retire(int sock, char *mem_name);
+
+/*
+ * Waits for the next segment the proxy on registration connection sock
+ * retires and stores its name in mem_name (MAX_SHM_NAME bytes).
+ * Returns -1 once the proxy closed the connection.
+ */
+int shm_channel_recv_retired(int sock, char *mem_name);
+
+/*
+ * Formats the name of object kind ("m" for the segment, "s1" and "s2"
+ * for the semaphores) of segment index in namespace ns.
+ */
+void shm_channel_name(char *name, char *ns, char *kind, int index);
+
+/*
+ * Maps the generation counter, which simplecached bumps whenever what
+ * it serves may have changed: when it starts and on SIGHUP.  Copies of
+ * files fetched under an older generation are out of date.  The object
+ * outlives simplecached, so a proxy keeps its mapping across restarts
+ * of the cache.  simplecached passes create to make it; proxies map it
+ * read only.  Returns NULL on error.
+ */
+volatile uint64_t *shm_channel_generation(int create);
+
+#endif
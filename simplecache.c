@@ -1,84 +1,381 @@
+#define _GNU_SOURCE
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "encoding.h"
 
 #define MAX_KEYLEN 256
 
 typedef struct{
 	int fildes;
+	off_t size;
 	char key[MAX_KEYLEN];
 } item_t;
 
-static int nitems;
-static item_t *items;
+typedef struct{
+	int nitems;
+	item_t *items;
+} table_t;
+
+/*
+ * Workers look keys up under the read lock, a reload only takes the
+ * write lock to swap in the table it built.
+ */
+static table_t *table;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * What simplecache_precompress was asked for, redone on every reload.
+ * reload_mutex keeps a reload and simplecache_precompress apart.
+ */
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static encoding_t pre_encs[NENCODINGS];
+static int pre_nencs;
+static size_t pre_max_size;
 
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
 
-int simplecache_init(char *filename){
+static void _free_table(table_t *t){
+	int i;
+	for(i = 0; i < t->nitems; i++)
+		close(t->items[i].fildes);
+
+	free(t->items);
+	free(t);
+}
+
+/* Reads the cache list in filename into a new table, or returns NULL. */
+static table_t *_load(char *filename){
 	FILE *filelist;
+	struct stat st;
 	int capacity = 16;
 	char *path, *ptr;
+	table_t *t;
+	item_t *items;
 
 	if( NULL == (filelist = fopen(filename, "r"))){
-		fprintf(stderr, "Unable to open file in simplecache_init.\n");
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "Unable to open file %s.\n", filename);
+		return NULL;
 	}
 
-	items = (item_t*) malloc(capacity * sizeof(item_t));
-	nitems = 0;
-	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
+	t = malloc(sizeof(table_t));
+	t->items = items = (item_t*) malloc(capacity * sizeof(item_t));
+	t->nitems = 0;
+	while(fgets(items[t->nitems].key, MAX_KEYLEN, filelist)){
 		/*Taking out EOL character*/
-		items[nitems].key[strlen(items[nitems].key)-1] = '\0';
+		items[t->nitems].key[strlen(items[t->nitems].key)-1] = '\0';
 
 		/* Using space delimiter to sep key and path*/
-		ptr = items[nitems].key;
+		ptr = items[t->nitems].key;
 		strsep(&ptr, " \t"); 		/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
+		if( !path || 0 > (items[t->nitems].fildes = open(path, O_RDONLY))){
 			fprintf(stderr, "Unable to open file %s.\n", path);
-			exit(EXIT_FAILURE);
+			fclose(filelist);
+			_free_table(t);
+			return NULL;
 		}
-		nitems++;
+		items[t->nitems].size = fstat(items[t->nitems].fildes, &st) == 0 ?
+		    st.st_size : -1;
+		t->nitems++;
 
-		if(nitems == capacity){
+		if(t->nitems == capacity){
 			capacity *= 2;
-			items = realloc(items, capacity * sizeof(item_t));
+			t->items = items = realloc(items, capacity * sizeof(item_t));
 		}
 
 	}
 
 	fclose(filelist);
 
-	qsort(items, nitems, sizeof(item_t), _itemcmp);
+	qsort(items, t->nitems, sizeof(item_t), _itemcmp);
+
+	return t;
+}
+
+/*
+ * Compresses the len bytes at in into out, which holds out_len.
+ * Returns the compressed length, or -1 if it would not fit.
+ */
+static ssize_t _compress(encoding_t enc, char *in, size_t len, char *out,
+    size_t out_len){
+	ssize_t ret = -1;
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+
+	switch(enc){
+#ifdef HAVE_ZLIB
+	case ENCODING_GZIP:
+		memset(&zs, 0, sizeof(zs));
+		/* 16 more window bits ask for a gzip header and trailer */
+		if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+		    Z_DEFAULT_STRATEGY) != Z_OK)
+			return -1;
+		zs.next_in = (Bytef *)in;
+		zs.avail_in = len;
+		zs.next_out = (Bytef *)out;
+		zs.avail_out = out_len;
+		if(deflate(&zs, Z_FINISH) == Z_STREAM_END)
+			ret = zs.total_out;
+		deflateEnd(&zs);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ENCODING_ZSTD:
+		ret = ZSTD_compress(out, out_len, in, len, ZSTD_maxCLevel());
+		if(ZSTD_isError(ret))
+			ret = -1;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+int simplecache_encodable(encoding_t enc){
+#ifdef HAVE_ZLIB
+	if(enc == ENCODING_GZIP)
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	if(enc == ENCODING_ZSTD)
+		return 1;
+#endif
+	return 0;
+}
+
+/* Reads all of item into a new buffer. */
+static char *_read_item(item_t *item){
+	char *buf = malloc(item->size);
+	ssize_t n;
+	off_t pos;
+
+	for(pos = 0; pos < item->size; pos += n){
+		n = pread(item->fildes, buf + pos, item->size - pos, pos);
+		if(n <= 0){
+			free(buf);
+			return NULL;
+		}
+	}
+
+	return buf;
+}
+
+/* Keeps len bytes of data in an anonymous file, returning it. */
+static int _store(char *data, size_t len){
+	ssize_t n;
+	size_t pos;
+	int fd;
+
+	if((fd = memfd_create("simplecache variant", MFD_CLOEXEC)) == -1){
+		perror("memfd_create");
+		return -1;
+	}
+	for(pos = 0; pos < len; pos += n){
+		if((n = write(fd, data + pos, len - pos)) <= 0){
+			perror("write");
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/* Adds the variants simplecache_precompress describes to t. */
+static void _precompress(table_t *t, encoding_t *encs, int nencs,
+    size_t max_size){
+	struct {
+		int objects;
+		size_t raw, packed;
+		double cpu_s;
+	} stats[NENCODINGS];
+	struct timespec start, end;
+	int i, j, fd, capacity = t->nitems, n = t->nitems;
+	item_t *items = t->items;
+	char *in, *out;
+	ssize_t len;
+	encoding_t enc;
+
+	memset(stats, 0, sizeof(stats));
+	for(i = 0; i < n; i++){
+		if(items[i].size <= 0 || items[i].size > max_size ||
+		    !(in = _read_item(&items[i])))
+			continue;
+		/* Only a variant at least a tenth smaller is worth keeping */
+		out = malloc(items[i].size - items[i].size / 10);
+		for(j = 0; j < nencs; j++){
+			enc = encs[j];
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+			len = _compress(enc, in, items[i].size, out,
+			    items[i].size - items[i].size / 10);
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+			stats[enc].cpu_s += end.tv_sec - start.tv_sec +
+			    (end.tv_nsec - start.tv_nsec) / 1e9;
+			if(len < 0 || (fd = _store(out, len)) == -1)
+				continue;
+			if(t->nitems == capacity){
+				capacity *= 2;
+				t->items = items = realloc(items,
+				    capacity * sizeof(item_t));
+			}
+			if(encoding_key(items[t->nitems].key, MAX_KEYLEN,
+			    items[i].key, enc) == -1){
+				close(fd);
+				continue;
+			}
+			items[t->nitems].fildes = fd;
+			items[t->nitems].size = len;
+			t->nitems++;
+			stats[enc].objects++;
+			stats[enc].raw += items[i].size;
+			stats[enc].packed += len;
+		}
+		free(out);
+		free(in);
+	}
+
+	qsort(items, t->nitems, sizeof(item_t), _itemcmp);
+
+	for(j = 0; j < nencs; j++){
+		enc = encs[j];
+		fprintf(stdout, "Precompressed %d of %d objects with %s: %zu "
+		    "bytes to %zu (%.1f%% saved), %.3f s CPU\n",
+		    stats[enc].objects, n, encoding_name(enc), stats[enc].raw,
+		    stats[enc].packed, stats[enc].raw ? 100.0 *
+		    (stats[enc].raw - stats[enc].packed) / stats[enc].raw : 0.0,
+		    stats[enc].cpu_s);
+	}
+	fflush(stdout);
+}
+
+int simplecache_precompress(encoding_t *encs, int nencs, size_t max_size){
+	if(nencs > NENCODINGS)
+		nencs = NENCODINGS;
+	pthread_mutex_lock(&reload_mutex);
+	memcpy(pre_encs, encs, nencs * sizeof(encoding_t));
+	pre_nencs = nencs;
+	pre_max_size = max_size;
+	/* This one changes the table in place */
+	pthread_rwlock_wrlock(&table_lock);
+	_precompress(table, encs, nencs, max_size);
+	pthread_rwlock_unlock(&table_lock);
+	pthread_mutex_unlock(&reload_mutex);
 
 	return EXIT_SUCCESS;
 }
 
-int simplecache_get(char *key){
+static item_t *_lookup(table_t *t, char *key){
 	int lo = 0;
-	int hi = nitems - 1;
+	int hi = t->nitems - 1;
 	int mid, cmp;
 	while (lo <= hi) {
 		// Key is in items[lo..hi] or not present.
 		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
+		cmp = strcmp(key,t->items[mid].key);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else return items[mid].fildes;
+		else return &t->items[mid];
 	}
-	return -1;
+	return NULL;
 }
 
-void simplecache_destroy(){
+int simplecache_reload(char *filename){
+	table_t *t, *old;
+
+	pthread_mutex_lock(&reload_mutex);
+	if( NULL == (t = _load(filename))){
+		pthread_mutex_unlock(&reload_mutex);
+		return EXIT_FAILURE;
+	}
+	if(pre_nencs)
+		_precompress(t, pre_encs, pre_nencs, pre_max_size);
+
+	pthread_rwlock_wrlock(&table_lock);
+	old = table;
+	table = t;
+	pthread_rwlock_unlock(&table_lock);
+	pthread_mutex_unlock(&reload_mutex);
+	/* Whoever got a descriptor from it has a copy of their own */
+	if(old)
+		_free_table(old);
+
+	return EXIT_SUCCESS;
+}
+
+int simplecache_init(char *filename){
+	if(simplecache_reload(filename) != EXIT_SUCCESS)
+		exit(EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+
+int simplecache_get(char *key){
+	item_t *item;
+	int fd = -1;
+
+	pthread_rwlock_rdlock(&table_lock);
+	if(table && (item = _lookup(table, key)))
+		fd = fcntl(item->fildes, F_DUPFD_CLOEXEC, 0);
+	pthread_rwlock_unlock(&table_lock);
+
+	return fd;
+}
+
+ssize_t simplecache_size(char *key){
+	item_t *item;
+	ssize_t size = -1;
+
+	pthread_rwlock_rdlock(&table_lock);
+	if(table && (item = _lookup(table, key)))
+		size = item->size;
+	pthread_rwlock_unlock(&table_lock);
+
+	return size;
+}
+
+int simplecache_count(){
+	int n;
+
+	pthread_rwlock_rdlock(&table_lock);
+	n = table ? table->nitems : 0;
+	pthread_rwlock_unlock(&table_lock);
+
+	return n;
+}
+
+void simplecache_foreach(void (*fn)(char *key, void *arg), void *arg){
 	int i;
-	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
-	
-	free(items);
+
+	pthread_rwlock_rdlock(&table_lock);
+	for(i = 0; table && i < table->nitems; i++)
+		fn(table->items[i].key, arg);
+	pthread_rwlock_unlock(&table_lock);
+}
+
+void simplecache_destroy(){
+	pthread_rwlock_wrlock(&table_lock);
+	if(table)
+		_free_table(table);
+	table = NULL;
+	pthread_rwlock_unlock(&table_lock);
 }
\ No newline at end of file
@@ -1,6 +1,10 @@
 #ifndef _SIMPLECACHE_H_
 #define _SIMPLECACHE_H_
 
+#include <sys/types.h>
+
+#include "encoding.h"
+
 /* 
  * Initializes the input cache given the information from
  * the provided file.  Each row of the file is assumed
@@ -12,10 +16,51 @@
 int simplecache_init(char *filename);
 
 /* 
- * Returns the file descriptor associated with the input key.
+ * Reads the cache list in filename anew, precompressing as
+ * simplecache_precompress was last asked to, and then swaps the new
+ * table in for the old one.  Lookups carry on against the old table
+ * while the new one is built.  On error the old table stays in place
+ * and EXIT_FAILURE is returned.
+ */
+int simplecache_reload(char *filename);
+
+/* 
+ * Returns a new file descriptor for the file associated with the input
+ * key, or -1.  The caller closes it; a reload does not.
  */
 int simplecache_get(char *key);
 
+/* 
+ * Returns the size of the file associated with the input key as it
+ * was when the cache was last (re)loaded, or -1 if the key is not
+ * cached.
+ */
+ssize_t simplecache_size(char *key);
+
+/* 
+ * Adds a variant of every object of at most max_size bytes in each of
+ * the nencs encodings in encs, under the key encoding_key gives it.  A
+ * variant is kept in memory, and only if it is at least a tenth smaller
+ * than its object.  Prints how many bytes each encoding saved and the
+ * CPU time it took.
+ */
+int simplecache_precompress(encoding_t *encs, int nencs, size_t max_size);
+
+/* 
+ * Returns 1 if this build can compress with enc.
+ */
+int simplecache_encodable(encoding_t enc);
+
+/* 
+ * Returns the number of keys in the cache.
+ */
+int simplecache_count();
+
+/* 
+ * Calls fn with every key in the cache and arg.
+ */
+void simplecache_foreach(void (*fn)(char *key, void *arg), void *arg);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
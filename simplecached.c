@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <fcntl.h>
@@ -12,44 +15,114 @@
 #include <mqueue.h>
 #include <sys/mman.h>
 #include <semaphore.h>
+#include <poll.h>
 
+#include "affinity.h"
+#include "cachewarm.h"
+#include "keyfilter.h"
+#include "reqsched.h"
 #include "shm_channel.h"
 #include "simplecache.h"
 #include "steque.h"
+#include "trace.h"
+#include "uring.h"
 
-#define MAX_CACHE_REQUEST_LEN 512
 #define MAX_THREADS	      1000
-#define QUEUE_NAME            "/simplecache_mq"
+#define MAX_QUEUE_DEPTH	      256
+#define URING_MAX_SEGMENTS    64
+#define URING_BELL	      (~0ULL)
+/* Longest sleep of an io_uring worker, in case a ring went amiss */
+#define URING_CHECK_NS	      5000000
+#define MAX_PROXIES	      256
+/* Retired segment names kept for the io_uring workers to catch up on */
+#define RETIRED_NAMES	      64
 
-static steque_t reqs_q;
-static pthread_mutex_t reqs_q_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t reqs_q_cond = PTHREAD_COND_INITIALIZER;
 static mqd_t msg_q;
+/* The cache list, read again on SIGHUP */
+static char *cachedir = "locals.txt";
+static int queue_depth;
+static int nsmall_workers;
+static long peer_timeout_ms = 5000;
+static size_t pass_min_size;
+static volatile uint64_t *generation;
+static shm_doorbell_t *doorbell;
 
-struct mem_info {
-  char mem_name[12];
-  char sem1_name[12];
-  char sem2_name[12];
-};
+/* Namespaces and connections of the proxies currently registered */
+static char proxies[MAX_PROXIES][MAX_SHM_NAME];
+static int proxy_fds[MAX_PROXIES];
+static int nproxies;
+static pthread_mutex_t proxies_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Segments the proxies removed, guarded by proxies_mutex */
+static char retired[RETIRED_NAMES][MAX_SHM_NAME];
+static volatile unsigned nretired;
+static cpu_set_t worker_cpus;
+static int nworker_cpus;
 
-struct request_info {
-	struct mem_info mem_i;
-	int mem_size;
-	int file_len;
-	char *file_path;
-};
+static void _add_key(char *key, void *filter)
+{
+	keyfilter_add(filter, key);
+}
+
+/* Lets proxies answer requests for keys that are not cached themselves. */
+static void _publish_keys()
+{
+	keyfilter_t *filter;
+
+	if (!(filter = keyfilter_create(KEYFILTER_NAME, simplecache_count()))) {
+		fprintf(stderr, "proxies will ask for every key\n");
+		return;
+	}
+	simplecache_foreach(_add_key, filter);
+	keyfilter_publish(filter);
+	/* SIGHUP publishes another one */
+	keyfilter_close(filter);
+}
 
-static void _sig_handler(int signo){
-	if (signo == SIGINT || signo == SIGTERM){
-		pthread_cond_destroy(&reqs_q_cond);
-		pthread_mutex_destroy(&reqs_q_mutex);
-		mq_close(msg_q);
-		if (mq_unlink(QUEUE_NAME) == 0) {
-			fprintf(stdout, "Message queue %s removed from system.\n",
-			    QUEUE_NAME);
+/*
+ * Takes the signals for every other thread, which all block them, so
+ * what they ask for runs outside of a signal handler and may take the
+ * locks the other threads hold.
+ */
+static void *_signals(void *arg)
+{
+	sigset_t *set = arg;
+	int signo;
+
+	while (1) {
+		if (sigwait(set, &signo) != 0) {
+			continue;
+		}
+		if (signo == SIGUSR1) {
+			cachewarm_trigger();
+		} else if (signo == SIGHUP) {
+			if (simplecache_reload(cachedir) != EXIT_SUCCESS) {
+				fprintf(stderr, "reload of %s failed, still "
+				    "serving the old cache\n", cachedir);
+				continue;
+			}
+			fprintf(stdout, "Reloaded %d keys from %s\n",
+			    simplecache_count(), cachedir);
+			fflush(stdout);
+			_publish_keys();
+			/*
+			 * The files changed, proxies drop their copies and
+			 * pick the new key filter up
+			 */
+			if (generation) {
+				__sync_add_and_fetch(generation, 1);
+			}
+		} else {
+			break;
 		}
-		exit(signo);
 	}
+	cachewarm_log_close();
+	reqsched_report(stdout);
+	mq_close(msg_q);
+	if (mq_unlink(QUEUE_NAME) == 0) {
+		fprintf(stdout, "Message queue %s removed from system.\n",
+		    QUEUE_NAME);
+	}
+	exit(signo);
 }
 
 #define USAGE                                                                 \
@@ -58,12 +131,48 @@ static void _sig_handler(int signo){
 "options:\n"                                                                  \
 "  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1000)\n"      \
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
+"  -u [queue_depth]    Use io_uring with up to queue_depth reads in flight\n" \
+"                      per worker thread (Default: 0, Range: 0-256)\n"        \
+"  -w [trace]          Warm the page cache from an access trace at startup\n" \
+"                      and on SIGUSR1 (workload.txt format)\n"              \
+"  -l [access_log]     Record requested keys to access_log, which is also\n" \
+"                      the warmup trace when -w is not given\n"             \
+"  -b [rate]           Warmup read bandwidth in KB/s (Default: 10240, 0 for\n"\
+"                      unbounded)\n"                                         \
+"  -a [cpu_list]       Pin worker threads to these CPUs, e.g. 0-3,8, and\n"  \
+"                      prefer requests whose segment is on their NUMA node\n"\
+"  -s [policy]         Request scheduling: fifo, sof (smallest object\n"    \
+"                      first) or lanes (small-object lane) (Default: fifo)\n"\
+"  -g [aging_ms]       sof: serve requests older than this first (Default: 50)\n"\
+"  -k [small_size]     Largest object in bytes counted as small (Default: 16384)\n"\
+"  -L [small_threads]  lanes: threads serving only small objects (Default: 1)\n"\
+"  -T [timeout_ms]     Give up on a proxy that stalls this long (Default: 5000)\n"\
+"  -x                  Record request events in the trace ring (see tracedump)\n"\
+"  -F [min_size]       Pass files of at least min_size bytes to the proxy as\n"\
+"                      a descriptor instead of copying them (Default: 0, off)\n"\
+"  -z [encodings]      Keep precompressed variants of objects for clients that\n"\
+"                      accept them, e.g. gzip,zstd (Default: none)\n"        \
+"  -Z [max_size]       Largest object in bytes to precompress (Default: 1048576)\n"\
 "  -h                  Show this help message\n"                              
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
   {"nthreads",           required_argument,      NULL,           't'},
   {"cachedir",           required_argument,      NULL,           'c'},
+  {"uring",              required_argument,      NULL,           'u'},
+  {"warmup",             required_argument,      NULL,           'w'},
+  {"access-log",         required_argument,      NULL,           'l'},
+  {"warmup-rate",        required_argument,      NULL,           'b'},
+  {"cpus",               required_argument,      NULL,           'a'},
+  {"sched",              required_argument,      NULL,           's'},
+  {"aging",              required_argument,      NULL,           'g'},
+  {"small-size",         required_argument,      NULL,           'k'},
+  {"small-threads",      required_argument,      NULL,           'L'},
+  {"timeout",            required_argument,      NULL,           'T'},
+  {"trace",              no_argument,            NULL,           'x'},
+  {"pass-fd",            required_argument,      NULL,           'F'},
+  {"encodings",          required_argument,      NULL,           'z'},
+  {"encode-max-size",    required_argument,      NULL,           'Z'},
   {"help",               no_argument,            NULL,           'h'},
   {NULL,                 0,                      NULL,             0}
 };
@@ -72,6 +181,140 @@ void Usage() {
   fprintf(stdout, "%s", USAGE);
 }
 
+/*
+ * Returns the index of the proxy owning segment mem_name, or -1.  The
+ * caller holds proxies_mutex.
+ */
+static int _proxy_index(char *mem_name)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < nproxies; i++) {
+		len = strlen(proxies[i]);
+		if (!strncmp(mem_name, proxies[i], len) && mem_name[len] == '.') {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Liveness check for shm_channel waits: the proxy owning segment
+ * mem_name is alive while its registration connection is open.
+ */
+static int _proxy_alive(void *mem_name)
+{
+	int alive;
+
+	pthread_mutex_lock(&proxies_mutex);
+	alive = _proxy_index(mem_name) != -1;
+	pthread_mutex_unlock(&proxies_mutex);
+
+	return alive;
+}
+
+/*
+ * Hands cache_fd to the proxy owning segment mem_name when -F asks for
+ * it and the file is large enough.  The lock keeps the registrar from
+ * closing the connection under the send, which never blocks.  Returns 0
+ * if the proxy now has the descriptor.
+ */
+static int _pass_fd(char *mem_name, int cache_fd, size_t file_len)
+{
+	int i, ret = -1;
+
+	if (!pass_min_size || file_len < pass_min_size) {
+		return -1;
+	}
+	pthread_mutex_lock(&proxies_mutex);
+	if ((i = _proxy_index(mem_name)) != -1) {
+		ret = shm_channel_pass_fd(proxy_fds[i], mem_name, cache_fd);
+	}
+	pthread_mutex_unlock(&proxies_mutex);
+
+	return ret;
+}
+
+static int _req_node(void *item)
+{
+	return ((struct request_info *)item)->node;
+}
+
+/*
+ * Pins the index-th worker thread when -a was given and returns the
+ * NUMA node it runs on, or -1.
+ */
+static int _pin_worker(long index)
+{
+	int cpu;
+
+	if (!nworker_cpus) {
+		return -1;
+	}
+	cpu = affinity_cpu(&worker_cpus, index);
+	if (affinity_pin(cpu) != 0) {
+		fprintf(stderr, "unable to pin worker to cpu %d\n", cpu);
+		return -1;
+	}
+
+	return affinity_node(cpu);
+}
+
+/*
+ * Takes the next request, preferring one whose segment is on node so
+ * that the proxy thread and the cache thread of a request share a node.
+ */
+static struct request_info *_next_request(int block, int node, int small_only)
+{
+	return (struct request_info *)reqsched_pop(block, node, small_only);
+}
+
+static size_t _file_len(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		return 0;
+	}
+
+	return st.st_size;
+}
+
+/* Where the part of a file_len bytes file that req asks for ends. */
+static size_t _part_end(struct request_info *req, size_t file_len)
+{
+	if (req->quantum && req->offset + req->quantum < file_len) {
+		return req->offset + req->quantum;
+	}
+
+	return file_len;
+}
+
+/* Where the chunk after the chunk bytes at pos starts, for req. */
+static size_t _next_pos(struct request_info *req, size_t pos, size_t chunk)
+{
+	return req->stride ? pos + req->stride : pos + chunk;
+}
+
+/* How many bytes req has the cache send of a file_len bytes file. */
+static size_t _part_len(struct request_info *req, size_t file_len)
+{
+	size_t end = _part_end(req, file_len), len = 0, pos, chunk;
+
+	if (!req->stride) {
+		return req->offset < end ? end - req->offset : 0;
+	}
+	for (pos = req->offset; pos < end; pos += req->stride) {
+		chunk = end - pos;
+		len += chunk < req->mem_size ? chunk : req->mem_size;
+	}
+
+	return len;
+}
+
 static void *simplecached_worker(void *arg)
 {
 	struct request_info *req;
@@ -80,16 +323,22 @@ static void *simplecached_worker(void *arg)
 	sem_t *sem1;
 	sem_t *sem2;
 	ssize_t read_len;
-	size_t file_len, bytes_transferred;
+	size_t file_len, bytes_transferred, end, chunk;
 	int mem_fd;
+	int passed;
+	int node = _pin_worker((long)arg);
+	int small_only = (long)arg < nsmall_workers;
+	shm_peer_t peer;
 
+	peer.timeout_ms = peer_timeout_ms;
+	peer.alive = _proxy_alive;
 	while (1) {
-		pthread_mutex_lock(&reqs_q_mutex);
-		while (steque_isempty(&reqs_q)) {
-			pthread_cond_wait(&reqs_q_cond, &reqs_q_mutex);
-		}
-		req = (struct request_info *)steque_pop(&reqs_q);
-		pthread_mutex_unlock(&reqs_q_mutex);
+		req = _next_request(1, node, small_only);
+		trace_event(req->trace_id, TRACE_CACHE_START, 0);
+		peer.arg = req->mem_i.mem_name;
+		mem = MAP_FAILED;
+		sem1 = sem2 = SEM_FAILED;
+		cache_fd = -1;
 		mem_fd = shm_open(req->mem_i.mem_name, O_RDWR, 0777);
 		if (mem_fd == -1) {
 			perror("shm_open");
@@ -108,65 +357,694 @@ static void *simplecached_worker(void *arg)
 
 		mem = mmap(NULL, req->mem_size, PROT_READ | PROT_WRITE,
 		    MAP_SHARED, mem_fd, 0);
-		if (!mem) {
+		if (mem == MAP_FAILED) {
 			perror("mmap");
 			goto finish;
 		}
 		cache_fd = simplecache_get(req->file_path);
-		*(int *)mem = cache_fd == -1 ? -1 : 1;
-		sem_post(sem1);
-		sem_wait(sem1);
+		trace_event(req->trace_id, TRACE_CACHE_LOOKUP, cache_fd != -1);
+		file_len = cache_fd == -1 ? 0 : _file_len(cache_fd);
+		passed = cache_fd != -1 && !req->stride &&
+		    _pass_fd(req->mem_i.mem_name, cache_fd, file_len) == 0;
+		*(int *)mem = cache_fd == -1 ? -1 : passed ? 2 : 1;
+		if (shm_channel_post(sem1, sem2, &peer) == -1) {
+			goto abandon;
+		}
 		if (cache_fd == -1) {
 			goto finish;
 		}
-		file_len = lseek(cache_fd, 0, SEEK_END);
-		lseek(cache_fd, 0, SEEK_SET);
 		*(size_t *)mem = file_len;
+		if (shm_channel_post(sem1, sem2, &peer) == -1) {
+			goto abandon;
+		}
 
-		sem_post(sem1);
-		sem_wait(sem1);
-
-		if (!file_len) {
+		if (!file_len || passed) {
 			goto finish;
 		}
-		/* Sending the file contents chunk by chunk. */
-		bytes_transferred = 0;
-		while (bytes_transferred < file_len) {
-			read_len = read(cache_fd, mem, req->mem_size);
+		/*
+		 * Sending the file contents chunk by chunk.  The descriptor
+		 * is shared by every thread serving this file, so read at an
+		 * explicit offset instead of moving the file position.  A
+		 * stripe skips the chunks its sibling requests send.
+		 */
+		bytes_transferred = req->offset;
+		end = _part_end(req, file_len);
+		while (bytes_transferred < end) {
+			chunk = end - bytes_transferred;
+			if (chunk > req->mem_size) {
+				chunk = req->mem_size;
+			}
+			read_len = pread(cache_fd, mem, chunk,
+			    bytes_transferred);
 			if (read_len < 0){
 				perror("read");
 			}
-			bytes_transferred += read_len;
-			sem_post(sem1);
-			sem_wait(sem1);
+			trace_event(req->trace_id, TRACE_CACHE_CHUNK,
+			    bytes_transferred / req->mem_size);
+			bytes_transferred = _next_pos(req, bytes_transferred,
+			    chunk);
+			if (shm_channel_post(sem1, sem2, &peer) == -1) {
+				goto abandon;
+			}
 		}
 		*(size_t *)mem = 0;
-		sem_post(sem1);
-		sem_wait(sem1);
+		if (shm_channel_post(sem1, sem2, &peer) == -1) {
+			goto abandon;
+		}
+		goto finish;
+abandon:
+		/* The proxy recreates the segment, just let go of it */
+		fprintf(stderr, "abandoning %s on %s: %s\n", req->file_path,
+		    req->mem_i.mem_name, strerror(errno));
 finish:
-		sem_close(sem1);
-		sem_close(sem2);
-		munmap(mem, req->mem_size);
-		free(req->file_path);
+		if (sem1 != SEM_FAILED) {
+			sem_close(sem1);
+		}
+		if (sem2 != SEM_FAILED) {
+			sem_close(sem2);
+		}
+		if (mem != MAP_FAILED) {
+			munmap(mem, req->mem_size);
+		}
+		if (mem_fd != -1) {
+			close(mem_fd);
+		}
+		if (cache_fd != -1) {
+			close(cache_fd);
+		}
+		trace_event(req->trace_id, TRACE_CACHE_FINISH, 0);
 		free(req);
 	}
 
 	return NULL;
 }
 
+/*
+ * io_uring mode.  Each worker thread owns a ring and keeps up to
+ * queue_depth requests active at once.  Reads go straight from the
+ * cached file into the request's segment, which is registered with the
+ * ring the first time it is seen, and the completion of a read is what
+ * hands the chunk over to webproxy.  The thread cannot block on the
+ * sem2 of every request waiting on a proxy, so it sleeps on the doorbell
+ * (see shm_channel.h), which the proxies ring when they drain a segment
+ * and the main thread rings when it queues a request.  With reads in
+ * flight it sleeps in the ring, where a futex wait on the doorbell
+ * stands in for the sem2s.
+ */
+enum uring_state {
+	URING_FREE,
+	URING_STATUS,	/* status posted, waiting for the proxy */
+	URING_SIZE,	/* file length posted, waiting for the proxy */
+	URING_READ,	/* read in flight */
+	URING_CHUNK,	/* chunk posted, waiting for the proxy */
+	URING_TRAILER	/* end marker posted, waiting for the proxy */
+};
+
+struct uring_segment {
+	char mem_name[MAX_SHM_NAME];
+	dev_t dev;
+	ino_t ino;
+	void *mem;
+	size_t size;
+	int users;
+};
+
+struct uring_slot {
+	enum uring_state state;
+	struct request_info *req;
+	struct uring_segment *seg;
+	void *mem;
+	int buf_index;
+	sem_t *sem1;
+	sem_t *sem2;
+	int cache_fd;
+	int passed;
+	size_t file_len;
+	size_t offset;
+	size_t end;
+	size_t chunk;
+	size_t filled;
+	long long deadline_ns;
+	long long next_check_ns;
+};
+
+struct uring_worker {
+	uring_t ring;
+	int node;
+	int registered;
+	int inflight;
+	int bell_waiting;	/* futex wait on the doorbell in the ring */
+	int bell_in_ring;	/* 0 if the kernel cannot do that */
+	unsigned next_victim;
+	unsigned seen_retired;
+	struct uring_segment segs[URING_MAX_SEGMENTS];
+	struct uring_slot slots[MAX_QUEUE_DEPTH];
+};
+
+/*
+ * Returns the mapping of the request's segment, reusing (and keeping
+ * registered) the one from an earlier request when the segment has not
+ * been recreated since.
+ */
+static int _uring_map(struct uring_worker *w, struct uring_slot *slot)
+{
+	struct request_info *req = slot->req;
+	struct uring_segment *seg = NULL;
+	struct stat st;
+	unsigned i;
+	int mem_fd;
+
+	mem_fd = shm_open(req->mem_i.mem_name, O_RDWR, 0777);
+	if (mem_fd == -1) {
+		perror("shm_open");
+		return -1;
+	}
+	if (fstat(mem_fd, &st) == -1) {
+		perror("fstat");
+		close(mem_fd);
+		return -1;
+	}
+	for (i = 0; i < URING_MAX_SEGMENTS; i++) {
+		if (w->segs[i].mem &&
+		    !strcmp(w->segs[i].mem_name, req->mem_i.mem_name)) {
+			seg = &w->segs[i];
+			break;
+		}
+	}
+	if (seg && (seg->dev != st.st_dev || seg->ino != st.st_ino ||
+	    seg->size != req->mem_size)) {
+		/* webproxy recreated the segment since it was mapped */
+		if (seg->users) {
+			seg = NULL;
+			goto map_private;
+		}
+		munmap(seg->mem, seg->size);
+		seg->mem = NULL;
+	}
+	for (i = 0; i < URING_MAX_SEGMENTS && !seg; i++) {
+		if (!w->segs[i].mem) {
+			seg = &w->segs[i];
+		}
+	}
+	for (i = 0; i < URING_MAX_SEGMENTS && !seg; i++) {
+		seg = &w->segs[w->next_victim++ % URING_MAX_SEGMENTS];
+		if (seg->users) {
+			seg = NULL;
+			continue;
+		}
+		munmap(seg->mem, seg->size);
+		seg->mem = NULL;
+	}
+map_private:
+	if (!seg) {
+		/* Every cached mapping is busy, map this one for now */
+		slot->seg = NULL;
+		slot->buf_index = -1;
+		slot->mem = mmap(NULL, req->mem_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, mem_fd, 0);
+		close(mem_fd);
+		if (slot->mem == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		return 0;
+	}
+	if (!seg->mem) {
+		seg->mem = mmap(NULL, req->mem_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, mem_fd, 0);
+		if (seg->mem == MAP_FAILED) {
+			perror("mmap");
+			seg->mem = NULL;
+			close(mem_fd);
+			return -1;
+		}
+		strncpy(seg->mem_name, req->mem_i.mem_name,
+		    sizeof(seg->mem_name));
+		seg->dev = st.st_dev;
+		seg->ino = st.st_ino;
+		seg->size = req->mem_size;
+		if (w->registered && uring_register_buffer(&w->ring,
+		    seg - w->segs, seg->mem, seg->size) == -1) {
+			perror("io_uring_register");
+			w->registered = 0;
+		}
+	}
+	close(mem_fd);
+	seg->users++;
+	slot->seg = seg;
+	slot->mem = seg->mem;
+	slot->buf_index = w->registered ? seg - w->segs : -1;
+
+	return 0;
+}
+
+static void _uring_finish(struct uring_slot *slot)
+{
+	if (slot->sem1 != SEM_FAILED) {
+		sem_close(slot->sem1);
+	}
+	if (slot->sem2 != SEM_FAILED) {
+		sem_close(slot->sem2);
+	}
+	if (slot->seg) {
+		slot->seg->users--;
+	} else if (slot->mem != MAP_FAILED) {
+		munmap(slot->mem, slot->req->mem_size);
+	}
+	if (slot->cache_fd != -1) {
+		close(slot->cache_fd);
+	}
+	trace_event(slot->req->trace_id, TRACE_CACHE_FINISH, 0);
+	free(slot->req);
+	slot->req = NULL;
+	slot->state = URING_FREE;
+}
+
+static long long _now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _uring_post(struct uring_slot *slot, enum uring_state state)
+{
+	slot->state = state;
+	slot->next_check_ns = _now_ns() + URING_CHECK_NS;
+	slot->deadline_ns = slot->next_check_ns - URING_CHECK_NS +
+	    peer_timeout_ms * 1000000LL;
+	if (state == URING_CHUNK) {
+		trace_event(slot->req->trace_id, TRACE_CACHE_CHUNK,
+		    slot->offset / slot->req->mem_size);
+	}
+	sem_post(slot->sem1);
+}
+
+/*
+ * Gives up on a request whose proxy did not drain the segment in time
+ * or went away.  Returns 1 if the request was dropped.
+ */
+static int _uring_expired(struct uring_slot *slot, long long now)
+{
+	if (now < slot->next_check_ns) {
+		return 0;
+	}
+	slot->next_check_ns = now + URING_CHECK_NS;
+	if (now < slot->deadline_ns &&
+	    _proxy_alive(slot->req->mem_i.mem_name)) {
+		return 0;
+	}
+	fprintf(stderr, "abandoning %s on %s: %s\n", slot->req->file_path,
+	    slot->req->mem_i.mem_name, now < slot->deadline_ns ?
+	    "proxy gone" : "timed out");
+	_uring_finish(slot);
+
+	return 1;
+}
+
+static void _uring_read(struct uring_worker *w, struct uring_slot *slot)
+{
+	ssize_t read_len;
+
+	if (uring_prep_read(&w->ring, slot->cache_fd,
+	    (char *)slot->mem + slot->filled, slot->chunk - slot->filled,
+	    slot->offset + slot->filled, slot->buf_index,
+	    slot - w->slots) == 0) {
+		slot->state = URING_READ;
+		w->inflight++;
+		return;
+	}
+	/* Submission queue is full, fall back to a synchronous read */
+	read_len = pread(slot->cache_fd, (char *)slot->mem + slot->filled,
+	    slot->chunk - slot->filled, slot->offset + slot->filled);
+	if (read_len < 0) {
+		perror("read");
+	}
+	_uring_post(slot, URING_CHUNK);
+}
+
+static void _uring_next_chunk(struct uring_worker *w, struct uring_slot *slot)
+{
+	if (slot->offset < slot->end) {
+		slot->chunk = slot->end - slot->offset;
+		if (slot->chunk > slot->req->mem_size) {
+			slot->chunk = slot->req->mem_size;
+		}
+		slot->filled = 0;
+		_uring_read(w, slot);
+	} else {
+		*(size_t *)slot->mem = 0;
+		_uring_post(slot, URING_TRAILER);
+	}
+}
+
+static void _uring_start(struct uring_worker *w, struct uring_slot *slot,
+    struct request_info *req)
+{
+	trace_event(req->trace_id, TRACE_CACHE_START, 0);
+	slot->req = req;
+	slot->seg = NULL;
+	slot->mem = MAP_FAILED;
+	slot->sem1 = slot->sem2 = SEM_FAILED;
+	slot->cache_fd = -1;
+	slot->offset = req->offset;
+	if (_uring_map(w, slot) == -1) {
+		_uring_finish(slot);
+		return;
+	}
+	if ((slot->sem1 = sem_open(req->mem_i.sem1_name, O_CREAT, 0644, 0)) ==
+	    SEM_FAILED ||
+	    (slot->sem2 = sem_open(req->mem_i.sem2_name, O_CREAT, 0644, 0)) ==
+	    SEM_FAILED) {
+		perror("sem_open");
+		_uring_finish(slot);
+		return;
+	}
+	slot->cache_fd = simplecache_get(req->file_path);
+	trace_event(req->trace_id, TRACE_CACHE_LOOKUP, slot->cache_fd != -1);
+	slot->file_len = slot->cache_fd == -1 ? 0 : _file_len(slot->cache_fd);
+	slot->end = _part_end(req, slot->file_len);
+	slot->passed = slot->cache_fd != -1 && !req->stride &&
+	    _pass_fd(req->mem_i.mem_name, slot->cache_fd, slot->file_len) == 0;
+	*(int *)slot->mem = slot->cache_fd == -1 ? -1 : slot->passed ? 2 : 1;
+	_uring_post(slot, URING_STATUS);
+}
+
+/* Called once webproxy has drained the segment of a waiting request. */
+static void _uring_drained(struct uring_worker *w, struct uring_slot *slot)
+{
+	switch (slot->state) {
+	case URING_STATUS:
+		if (slot->cache_fd == -1) {
+			_uring_finish(slot);
+			break;
+		}
+		*(size_t *)slot->mem = slot->file_len;
+		_uring_post(slot, URING_SIZE);
+		break;
+	case URING_SIZE:
+		if (!slot->file_len || slot->passed) {
+			_uring_finish(slot);
+			break;
+		}
+		_uring_next_chunk(w, slot);
+		break;
+	case URING_CHUNK:
+		slot->offset = _next_pos(slot->req, slot->offset, slot->chunk);
+		_uring_next_chunk(w, slot);
+		break;
+	case URING_TRAILER:
+		_uring_finish(slot);
+		break;
+	default:
+		break;
+	}
+}
+
+static void _uring_complete(struct uring_worker *w, struct uring_slot *slot,
+    int res)
+{
+	w->inflight--;
+	if (res < 0) {
+		errno = -res;
+		perror("read");
+	} else if (res > 0 && slot->filled + res < slot->chunk) {
+		/* Short read, ask for the rest of the chunk */
+		slot->filled += res;
+		_uring_read(w, slot);
+		return;
+	}
+	_uring_post(slot, URING_CHUNK);
+}
+
+/*
+ * Drops the mappings of segments their proxy retired, which would
+ * otherwise keep the memory of the removed objects around until they
+ * are evicted.  A worker that fell too far behind leaves the rest to
+ * eviction.
+ */
+static void _uring_forget(struct uring_worker *w)
+{
+	char *name;
+	int i;
+
+	if (w->seen_retired == nretired) {
+		return;
+	}
+	pthread_mutex_lock(&proxies_mutex);
+	if (nretired - w->seen_retired > RETIRED_NAMES) {
+		w->seen_retired = nretired - RETIRED_NAMES;
+	}
+	for (; w->seen_retired != nretired; w->seen_retired++) {
+		name = retired[w->seen_retired % RETIRED_NAMES];
+		for (i = 0; i < URING_MAX_SEGMENTS; i++) {
+			if (w->segs[i].mem && !w->segs[i].users &&
+			    !strcmp(w->segs[i].mem_name, name)) {
+				munmap(w->segs[i].mem, w->segs[i].size);
+				w->segs[i].mem = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&proxies_mutex);
+}
+
+/* How long the worker may sleep before a waiting request is due a check. */
+static long long _uring_sleep_ns(struct uring_worker *w, long long now)
+{
+	long long next = now + URING_CHECK_NS;
+	int i;
+
+	for (i = 0; i < queue_depth; i++) {
+		if (w->slots[i].state != URING_FREE &&
+		    w->slots[i].state != URING_READ &&
+		    w->slots[i].next_check_ns < next) {
+			next = w->slots[i].next_check_ns;
+		}
+	}
+
+	/* 0 would wait without a timeout */
+	return next > now ? next - now : 1;
+}
+
+static void *simplecached_uring_worker(void *arg)
+{
+	struct uring_worker *w;
+	struct uring_slot *slot;
+	struct io_uring_cqe *cqe;
+	struct request_info *req;
+	long long now, sleep_ns;
+	uint32_t seen = 0;
+	int i, nactive = 0, progress, armed = 0;
+
+	w = calloc(1, sizeof(*w));
+	w->node = _pin_worker((long)arg);
+	if (uring_init(&w->ring, queue_depth) == -1) {
+		perror("io_uring_setup");
+		fprintf(stderr, "falling back to blocking reads\n");
+		free(w);
+		return simplecached_worker(arg);
+	}
+	w->registered = uring_register_buffers(&w->ring,
+	    URING_MAX_SEGMENTS) == 0;
+	w->seen_retired = nretired;
+	w->bell_in_ring = 1;
+
+	while (1) {
+		progress = 0;
+		_uring_forget(w);
+		/* About to block on the queue, where the bell is no use */
+		if (armed && !nactive) {
+			shm_channel_doorbell_disarm(doorbell);
+			armed = 0;
+		}
+		for (i = 0; i < queue_depth; i++) {
+			slot = &w->slots[i];
+			if (slot->state != URING_FREE) {
+				continue;
+			}
+			if (!(req = _next_request(nactive == 0, w->node, 0))) {
+				break;
+			}
+			_uring_start(w, slot, req);
+			progress++;
+			nactive += slot->state != URING_FREE;
+		}
+
+		while ((cqe = uring_peek_cqe(&w->ring))) {
+			if (cqe->user_data == URING_BELL) {
+				w->bell_waiting = 0;
+				if (cqe->res == -EINVAL) {
+					w->bell_in_ring = 0;
+				}
+				uring_cqe_seen(&w->ring);
+				continue;
+			}
+			slot = &w->slots[cqe->user_data];
+			i = cqe->res;
+			uring_cqe_seen(&w->ring);
+			_uring_complete(w, slot, i);
+			progress++;
+		}
+
+		now = _now_ns();
+		for (i = 0; i < queue_depth; i++) {
+			slot = &w->slots[i];
+			if (slot->state == URING_FREE ||
+			    slot->state == URING_READ) {
+				continue;
+			}
+			if (sem_trywait(slot->sem2) == -1) {
+				nactive -= _uring_expired(slot, now);
+				continue;
+			}
+			_uring_drained(w, slot);
+			progress++;
+			nactive -= slot->state == URING_FREE;
+		}
+
+		if (progress || !nactive) {
+			if (uring_submit_and_wait(&w->ring, 0, 0) == -1) {
+				perror("io_uring_enter");
+			}
+			if (armed) {
+				shm_channel_doorbell_disarm(doorbell);
+				armed = 0;
+			}
+			continue;
+		}
+		/* Nothing to do, arm the bell and look once more */
+		if (!armed) {
+			seen = shm_channel_doorbell_arm(doorbell);
+			armed = 1;
+			continue;
+		}
+
+		sleep_ns = _uring_sleep_ns(w, now);
+		if (w->inflight && w->bell_in_ring && !w->bell_waiting &&
+		    uring_prep_futex_wait(&w->ring, &doorbell->rings, seen,
+		    URING_BELL) == 0) {
+			w->bell_waiting = 1;
+		}
+		/*
+		 * Without the futex wait in the ring, a drain waits for the
+		 * next completion
+		 */
+		if (uring_submit_and_wait(&w->ring, w->inflight ? 1 : 0,
+		    sleep_ns) == -1) {
+			perror("io_uring_enter");
+		}
+		if (!w->inflight) {
+			shm_channel_doorbell_wait(doorbell, seen, sleep_ns);
+		}
+		shm_channel_doorbell_disarm(doorbell);
+		armed = 0;
+	}
+
+	return NULL;
+}
+
+/*
+ * Hands every proxy that connects to REGISTER_SOCKET a namespace of its
+ * own for its segments and semaphores, collects the segments it retires
+ * and notices when it goes away.
+ */
+static void *simplecached_registrar(void *arg)
+{
+	struct pollfd fds[MAX_PROXIES + 1];
+	char ns[MAX_SHM_NAME];
+	char mem_name[MAX_SHM_NAME];
+	unsigned nregistered = 0;
+	int nfds = 1, i, fd;
+
+	fds[0].fd = (long)arg;
+	fds[0].events = POLLIN;
+	while (1) {
+		if (poll(fds, nfds, -1) == -1) {
+			if (errno != EINTR) {
+				perror("poll");
+			}
+			continue;
+		}
+		for (i = nfds - 1; i > 0; i--) {
+			if (!fds[i].revents) {
+				continue;
+			}
+			/* A proxy retiring a segment, or leaving */
+			if (shm_channel_recv_retired(fds[i].fd, mem_name) == 0) {
+				pthread_mutex_lock(&proxies_mutex);
+				strcpy(retired[nretired % RETIRED_NAMES], mem_name);
+				nretired++;
+				pthread_mutex_unlock(&proxies_mutex);
+				continue;
+			}
+			pthread_mutex_lock(&proxies_mutex);
+			fprintf(stdout, "Proxy %s unregistered.\n",
+			    proxies[i - 1]);
+			close(fds[i].fd);
+			fds[i] = fds[--nfds];
+			memcpy(proxies[i - 1], proxies[nfds - 1], MAX_SHM_NAME);
+			proxy_fds[i - 1] = proxy_fds[nfds - 1];
+			nproxies--;
+			pthread_mutex_unlock(&proxies_mutex);
+			fflush(stdout);
+		}
+		if (!(fds[0].revents & POLLIN)) {
+			continue;
+		}
+		/* The pid keeps names unique across restarts of the cache */
+		snprintf(ns, sizeof(ns), "sc%d.%u", (int)getpid(),
+		    nregistered);
+		if ((fd = shm_channel_accept(fds[0].fd, ns)) == -1) {
+			continue;
+		}
+		if (nfds == MAX_PROXIES + 1) {
+			fprintf(stderr, "too many proxies, rejecting %s\n", ns);
+			close(fd);
+			continue;
+		}
+		nregistered++;
+		fds[nfds].fd = fd;
+		fds[nfds].events = POLLIN;
+		pthread_mutex_lock(&proxies_mutex);
+		memcpy(proxies[nfds - 1], ns, MAX_SHM_NAME);
+		proxy_fds[nfds - 1] = fd;
+		nproxies = nfds++;
+		pthread_mutex_unlock(&proxies_mutex);
+		fprintf(stdout, "Proxy %s registered.\n", ns);
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
 int main(int argc, char **argv) {
 	pthread_t thread[MAX_THREADS];
+	pthread_t registrar;
+	pthread_t signal_thread;
+	sigset_t signals;
+	int register_fd;
 	int nthreads = 1;
 	int i;
-	char *cachedir = "locals.txt";
 	char option_char;
 	struct mq_attr msg_q_attr;
 	ssize_t num_bytes_recvd;
 	char *request_str;
 	struct request_info *req;
-	char *ptr;
+	ssize_t file_size;
+	char *trace = NULL;
+	char *access_log = NULL;
+	long warm_rate = 10240;
+	reqsched_policy_t policy = REQSCHED_FIFO;
+	long aging_ms = 50;
+	long small_size = 16384;
+	int small_threads = 1;
+	int tracing = 0;
+	encoding_t encs[NENCODINGS];
+	int nencs = 0;
+	size_t encode_max_size = 1 << 20;
 
-	while ((option_char = getopt_long(argc, argv, "t:c:h", gLongOptions, NULL)) != -1) {
+	while ((option_char = getopt_long(argc, argv, "t:c:u:w:l:b:a:s:g:k:L:T:xF:z:Z:h", gLongOptions, NULL)) != -1) {
 		switch (option_char) {
 			case 't': // thread-count
 				nthreads = atoi(optarg);
@@ -174,6 +1052,66 @@ int main(int argc, char **argv) {
 			case 'c': //cache directory
 				cachedir = optarg;
 				break;
+			case 'u': // io_uring queue depth
+				queue_depth = atoi(optarg);
+				if (queue_depth < 0 || queue_depth > MAX_QUEUE_DEPTH) {
+					Usage();
+					exit(1);
+				}
+				break;
+			case 'w': // warmup trace
+				trace = optarg;
+				break;
+			case 'l': // access log
+				access_log = optarg;
+				break;
+			case 'b': // warmup bandwidth
+				warm_rate = atol(optarg);
+				break;
+			case 'a': // cpu list
+				nworker_cpus = affinity_parse(optarg, &worker_cpus);
+				if (nworker_cpus == -1) {
+					Usage();
+					exit(1);
+				}
+				break;
+			case 's': // scheduling policy
+				if (reqsched_policy(optarg, &policy) == -1) {
+					Usage();
+					exit(1);
+				}
+				break;
+			case 'g': // sof aging bound
+				aging_ms = atol(optarg);
+				break;
+			case 'k': // small object size
+				small_size = atol(optarg);
+				break;
+			case 'L': // small lane threads
+				small_threads = atoi(optarg);
+				break;
+			case 'T': // proxy timeout
+				peer_timeout_ms = atol(optarg);
+				break;
+			case 'x': // request tracing
+				tracing = 1;
+				break;
+			case 'F': // descriptor passing threshold
+				pass_min_size = atol(optarg);
+				break;
+			case 'z': // precompressed variants
+				nencs = encoding_list(optarg, encs);
+				for (i = 0; i < nencs; i++) {
+					if (!simplecache_encodable(encs[i])) {
+						fprintf(stderr, "%s support not "
+						    "built\n", encoding_name(encs[i]));
+						exit(1);
+					}
+				}
+				break;
+			case 'Z': // largest object to precompress
+				encode_max_size = atol(optarg);
+				break;
 			case 'h': // help
 				Usage();
 				exit(0);
@@ -184,21 +1122,57 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (signal(SIGINT, _sig_handler) == SIG_ERR){
-		fprintf(stderr,"Can't catch SIGINT...exiting.\n");
+	/* Every thread started from here on leaves them to _signals */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if (pthread_create(&signal_thread, NULL, _signals, &signals) != 0) {
+		fprintf(stderr,"Can't catch signals...exiting.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if (signal(SIGTERM, _sig_handler) == SIG_ERR){
-		fprintf(stderr,"Can't catch SIGTERM...exiting.\n");
+	/* Initializing the cache */
+	simplecache_init(cachedir);
+	/* Before the key filter, which has the variants too */
+	if (nencs) {
+		simplecache_precompress(encs, nencs, encode_max_size);
+	}
+	_publish_keys();
+	/* This cache may serve other files than the one before it */
+	if ((generation = shm_channel_generation(1))) {
+		__sync_add_and_fetch(generation, 1);
+	}
+	/* Proxies map it when they register */
+	if (!(doorbell = shm_channel_doorbell(1))) {
 		exit(EXIT_FAILURE);
 	}
 
-	/* Initializing the cache */
-	simplecache_init(cachedir);
+	if (access_log && cachewarm_log_open(access_log) != EXIT_SUCCESS) {
+		exit(EXIT_FAILURE);
+	}
+	if (trace || access_log) {
+		cachewarm_init(trace ? trace : access_log, warm_rate * 1024,
+		    trace != NULL);
+	}
 
-	steque_init(&reqs_q);
+	if (tracing && trace_init() != 0) {
+		fprintf(stderr, "tracing disabled\n");
+	}
+
+	reqsched_init(policy, aging_ms, small_size, _req_node);
+	/* Small-lane workers block on their lane, keep the io_uring ones general */
+	if (policy == REQSCHED_LANES && !queue_depth) {
+		nsmall_workers = small_threads < nthreads ? small_threads :
+		    nthreads - 1;
+	}
 
+	if ((register_fd = shm_channel_listen()) == -1) {
+		fprintf(stderr, "Is another simplecached running?\n");
+		exit(1);
+	}
 	msg_q_attr.mq_flags = 0;
 	msg_q_attr.mq_maxmsg = 10;
 	msg_q_attr.mq_msgsize = MAX_CACHE_REQUEST_LEN;
@@ -215,42 +1189,50 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	pthread_create(&registrar, NULL, simplecached_registrar,
+	    (void *)(long)register_fd);
+
 	/*
 	 * Start the worker threads
 	 */
 	for (i = 0; i < nthreads; i++) {
-		pthread_create(&thread[i], NULL, simplecached_worker, NULL);
+		pthread_create(&thread[i], NULL, queue_depth ?
+		    simplecached_uring_worker : simplecached_worker,
+		    (void *)(long)i);
 	}
 	for (;;) {
 		request_str = malloc(MAX_CACHE_REQUEST_LEN + 1);
 		num_bytes_recvd = mq_receive(msg_q, request_str,
 		    MAX_CACHE_REQUEST_LEN + 1, NULL);
 		if (num_bytes_recvd < 0) {
+			free(request_str);
+			if (errno == EINTR) {
+				continue;
+			}
 			perror("mq_receive");
 			break;
 		}
-		req = malloc(sizeof(*req));
-		ptr = request_str;
-		strncpy(req->mem_i.mem_name, ptr,
-		    sizeof(req->mem_i.mem_name));
-		ptr += sizeof(req->mem_i.mem_name);
-		strncpy(req->mem_i.sem1_name, ptr,
-		    sizeof(req->mem_i.sem1_name));
-		ptr += sizeof(req->mem_i.sem1_name);
-		strncpy(req->mem_i.sem2_name, ptr,
-		    sizeof(req->mem_i.sem2_name));
-		ptr += sizeof(req->mem_i.sem2_name);
-		req->mem_size = *(int *)(ptr);
-		ptr += sizeof(int);
-		req->file_len = *(int *)(ptr);
-		ptr += sizeof(int);
-		req->file_path = malloc(req->file_len);
-		strncpy(req->file_path, ptr, req->file_len);
-		free(request_str);
-		pthread_mutex_lock(&reqs_q_mutex);
-		steque_push(&reqs_q, req);
-		pthread_mutex_unlock(&reqs_q_mutex);
-		pthread_cond_signal(&reqs_q_cond);
+		/* The message is the request, just make sure the path ends */
+		request_str[num_bytes_recvd] = '\0';
+		req = (struct request_info *)request_str;
+		trace_event(req->trace_id, TRACE_CACHE_RECV, 0);
+		/*
+		 * One access per request: the later quanta and the other
+		 * stripes of a transfer all ask from past its start
+		 */
+		if (req->offset == 0) {
+			cachewarm_log(req->file_path);
+		}
+		file_size = simplecache_size(req->file_path);
+		/*
+		 * Misses are answered right away, schedule them as empty.  A
+		 * request for a quantum or a stripe of a file weighs what it
+		 * sends.
+		 */
+		file_size = file_size < 0 ? 0 : _part_len(req, file_size);
+		reqsched_push(req, file_size);
+		/* An io_uring worker busy with others may be asleep */
+		shm_channel_ring(doorbell);
 	}
 
 }
\ No newline at end of file
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "supervisor.h"
+
+/* Where a worker finds the pipe that tells the supervisor it listens */
+#define READY_ENV        "WEBPROXY_READY_FD"
+#define READY_TIMEOUT_MS 10000
+/* A worker that dies this soon after it started is restarted slowly */
+#define RESPAWN_DELAY_S  1
+/* Connections on higher descriptors are served but not waited for */
+#define MAX_TRACKED_FD   65536
+
+int __real_bind(int fd, const struct sockaddr *addr, socklen_t len);
+int __real_listen(int fd, int backlog);
+int __real_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int __real_close(int fd);
+
+/* Guards listen_fd, listener_closed and the start of draining */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static int listen_fd = -1;
+static int wake_fds[2] = { -1, -1 };
+static volatile int draining;
+static int listener_closed;
+static volatile int nconns;
+static unsigned char tracked[MAX_TRACKED_FD];
+
+struct worker {
+	pid_t pid;
+	time_t started;
+};
+
+static char **worker_argv;
+
+int supervisor_worker()
+{
+	return getenv(READY_ENV) != NULL;
+}
+
+int __wrap_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	int on = 1;
+
+	if (supervisor_worker() && addr->sa_family != AF_UNIX &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+		perror("setsockopt");
+	}
+
+	return __real_bind(fd, addr, len);
+}
+
+/*
+ * Notes the socket gfserver listens on, and tells the supervisor this
+ * worker takes connections now.
+ */
+int __wrap_listen(int fd, int backlog)
+{
+	socklen_t len = sizeof(int);
+	char *ready;
+	int domain, ret;
+
+	if ((ret = __real_listen(fd, backlog)) == -1 ||
+	    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1 ||
+	    domain == AF_UNIX) {
+		return ret;
+	}
+	pthread_mutex_lock(&drain_mutex);
+	if (listen_fd == -1 && pipe2(wake_fds, O_CLOEXEC) == 0) {
+		/* accept must never block where draining cannot wake it */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		listen_fd = fd;
+	}
+	pthread_mutex_unlock(&drain_mutex);
+	if ((ready = getenv(READY_ENV)) && atoi(ready) > 2) {
+		if (write(atoi(ready), "", 1) == -1) {
+			perror("write");
+		}
+		__real_close(atoi(ready));
+		setenv(READY_ENV, "-1", 1);
+	}
+
+	return ret;
+}
+
+static int _track(int conn)
+{
+	if (conn >= 0 && conn < MAX_TRACKED_FD) {
+		tracked[conn] = 1;
+		__sync_add_and_fetch(&nconns, 1);
+	}
+
+	return conn;
+}
+
+/*
+ * Waits for a connection or for draining to start.  Once it has, hands
+ * out what is still queued on the socket, then closes it and keeps the
+ * accepting thread here for good, since gfserver would retry a failed
+ * accept forever.
+ */
+int __wrap_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	struct pollfd pfd[2];
+	int conn;
+
+	if (fd != listen_fd) {
+		return __real_accept(fd, addr, len);
+	}
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake_fds[0];
+	pfd[1].events = POLLIN;
+	while (!draining) {
+		if (poll(pfd, 2, -1) > 0 && pfd[0].revents) {
+			conn = __real_accept(fd, addr, len);
+			if (conn >= 0 || (errno != EAGAIN && errno != EINTR)) {
+				return _track(conn);
+			}
+		}
+	}
+	if ((conn = __real_accept(fd, addr, len)) >= 0 ||
+	    (errno != EAGAIN && errno != EINTR)) {
+		return _track(conn);
+	}
+	/*
+	 * A connection the kernel queues between that accept and the close
+	 * is reset, unless net.ipv4.tcp_migrate_req hands it to another
+	 * worker.
+	 */
+	pthread_mutex_lock(&drain_mutex);
+	__real_close(fd);
+	listener_closed = 1;
+	pthread_cond_broadcast(&drain_cond);
+	pthread_mutex_unlock(&drain_mutex);
+	while (1) {
+		pause();
+	}
+}
+
+int __wrap_close(int fd)
+{
+	if (fd >= 0 && fd < MAX_TRACKED_FD && tracked[fd]) {
+		tracked[fd] = 0;
+		if (__sync_sub_and_fetch(&nconns, 1) == 0 && draining) {
+			pthread_mutex_lock(&drain_mutex);
+			pthread_cond_broadcast(&drain_cond);
+			pthread_mutex_unlock(&drain_mutex);
+		}
+	}
+
+	return __real_close(fd);
+}
+
+int supervisor_drain(long timeout_ms)
+{
+	struct timespec deadline;
+	int left;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&drain_mutex);
+	draining = 1;
+	if (listen_fd != -1 && write(wake_fds[1], "", 1) == -1) {
+		perror("write");
+	}
+	while (((listen_fd != -1 && !listener_closed) || nconns > 0) &&
+	    pthread_cond_timedwait(&drain_cond, &drain_mutex,
+	    &deadline) != ETIMEDOUT)
+		;
+	left = nconns;
+	pthread_mutex_unlock(&drain_mutex);
+
+	return left;
+}
+
+/* Starts a worker and returns its pid once it listens, or -1. */
+static pid_t _spawn()
+{
+	struct pollfd pfd;
+	char ready[16], c;
+	sigset_t none;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		snprintf(ready, sizeof(ready), "%d", fds[1]);
+		setenv(READY_ENV, ready, 1);
+		/* A supervisor that is killed takes its workers along */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execvp(worker_argv[0], worker_argv);
+		perror("execvp");
+		_exit(127);
+	}
+	close(fds[1]);
+	/* A worker that dies first closes the pipe without writing */
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, READY_TIMEOUT_MS) != 1 || read(fds[0], &c, 1) != 1) {
+		fprintf(stderr, "Worker %d did not start\n", pid);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		pid = -1;
+	}
+	close(fds[0]);
+
+	return pid;
+}
+
+static void _start(struct worker *w)
+{
+	w->pid = _spawn();
+	w->started = time(NULL);
+}
+
+/* Lets a worker drain and waits for it to exit. */
+static void _stop(pid_t pid)
+{
+	if (pid != -1) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/* Restarts the workers that died or never started. */
+static void _reap(struct worker *workers, int n)
+{
+	pid_t pid;
+	int i, status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < n && workers[i].pid != pid; i++)
+			;
+		if (i < n) {
+			fprintf(stderr, "Worker %d exited (status %d)\n", pid,
+			    status);
+			workers[i].pid = -1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (workers[i].pid != -1) {
+			continue;
+		}
+		if (time(NULL) - workers[i].started < RESPAWN_DELAY_S) {
+			sleep(RESPAWN_DELAY_S);
+		}
+		_start(&workers[i]);
+		if (workers[i].pid != -1) {
+			fprintf(stdout, "Worker %d started\n", workers[i].pid);
+			fflush(stdout);
+		}
+	}
+}
+
+/*
+ * Replaces the workers one at a time.  The old one drains only once
+ * the new one listens.
+ */
+static void _restart(struct worker *workers, int n)
+{
+	struct worker w;
+	pid_t old;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		_start(&w);
+		if (w.pid == -1) {
+			fprintf(stderr, "Restart stopped, the other workers "
+			    "keep running\n");
+			return;
+		}
+		old = workers[i].pid;
+		workers[i] = w;
+		_stop(old);
+		fprintf(stdout, "Worker %d replaced by %d\n", old, w.pid);
+		fflush(stdout);
+	}
+}
+
+void supervisor_run(int nprocs, char **argv)
+{
+	struct worker *workers = calloc(nprocs, sizeof(*workers));
+	struct timespec retry = { RESPAWN_DELAY_S, 0 };
+	sigset_t set;
+	int i, signo, missing;
+
+	worker_argv = argv;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; i < nprocs; i++) {
+		_start(&workers[i]);
+	}
+	fprintf(stdout, "Supervising %d workers\n", nprocs);
+	fflush(stdout);
+	while (1) {
+		for (i = 0, missing = 0; i < nprocs; i++) {
+			missing |= workers[i].pid == -1;
+		}
+		/* Workers that could not start are tried again now and then */
+		signo = missing ? sigtimedwait(&set, NULL, &retry) :
+		    sigwaitinfo(&set, NULL);
+		if (signo == SIGHUP) {
+			_restart(workers, nprocs);
+		} else if (signo == SIGINT || signo == SIGTERM) {
+			break;
+		}
+		_reap(workers, nprocs);
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		if (workers[i].pid != -1) {
+			kill(workers[i].pid, SIGTERM);
+		}
+	}
+	for (i = 0; i < nprocs; i++) {
+		if (workers[i].pid != -1) {
+			waitpid(workers[i].pid, NULL, 0);
+		}
+	}
+	fprintf(stdout, "All workers exited\n");
+	exit(0);
+}
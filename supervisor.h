@@ -0,0 +1,36 @@
+#ifndef _SUPERVISOR_H_
+#define _SUPERVISOR_H_
+
+/*
+ * Several webproxy processes serving one port.  The supervisor starts
+ * nprocs copies of the program it was started as, each of which binds
+ * the port with SO_REUSEPORT, so the kernel spreads new connections
+ * over their listening sockets, and registers with simplecached on its
+ * own, so each has a namespace and a segment set of its own.
+ *
+ * The supervisor restarts a worker that dies.  SIGHUP restarts every
+ * worker in turn, from the binary on disk: the replacement is started
+ * first and the old worker is only told to drain once the replacement
+ * listens, so the port never goes unserved.  SIGTERM or SIGINT drains
+ * every worker and then ends the supervisor.
+ *
+ * gfserver binds, listens and accepts by itself, so webproxy is linked
+ * with bind, listen, accept and close wrapped (see the Makefile) and
+ * this module sees the listening socket and every connection on it.
+ */
+
+/* Runs the supervisor over nprocs workers started with argv.  Never returns. */
+void supervisor_run(int nprocs, char **argv);
+
+/* Returns 1 in a worker started by a supervisor. */
+int supervisor_worker();
+
+/*
+ * Stops taking connections and waits until the ones taken so far are
+ * closed, or for timeout_ms.  Connections that reached the listening
+ * socket before it closes are still served.  Returns how many
+ * connections were left open.
+ */
+int supervisor_drain(long timeout_ms);
+
+#endif
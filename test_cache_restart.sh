@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Kills simplecached with SIGKILL in the middle of a gfbench run through
+# webproxy, starts it again and checks that the proxy recovers by
+# itself: the run finishes, the proxy is still up, and every request
+# after the restart is served with the right bytes.  Requests caught by
+# the kill may fail, but only those.
+#
+# usage: sh test_cache_restart.sh [cache options]
+#
+# Run from the source tree after make.  The cache options, e.g. -u 8,
+# go to both instances of simplecached.  Exits 1 on failure.
+
+PORT=${PORT:-18893}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+# SIGTERM, so that both remove their segments and semaphores
+cleanup() {
+	kill $PROXY $CACHE 2>/dev/null
+	wait $PROXY $CACHE 2>/dev/null
+	rm -rf $DIR
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+i=0
+while [ $i -lt 64 ]; do
+	head -c 262144 /dev/urandom > $DIR/$i
+	echo "/restart/$i $DIR/$i" >> $DIR/locals.txt
+	echo "/restart/$i" >> $DIR/workload.txt
+	i=$((i + 1))
+done
+
+./simplecached -c $DIR/locals.txt -t 4 "$@" > $DIR/cached.log 2>&1 &
+CACHE=$!
+./webproxy -p $PORT -t 8 -n 8 -z 65536 -T 1000 > $DIR/proxy.log 2>&1 &
+PROXY=$!
+sleep 1
+
+timeout 60 ./gfbench -p $PORT -t 8 -w $DIR/workload.txt -r 20000 \
+    > $DIR/during.log 2>&1 &
+BENCH=$!
+sleep 1
+kill -9 $CACHE
+wait $CACHE 2>/dev/null
+sleep 0.5
+./simplecached -c $DIR/locals.txt -t 4 "$@" >> $DIR/cached.log 2>&1 &
+CACHE=$!
+
+wait $BENCH
+status=$?
+echo "during the restart:"
+cat $DIR/during.log
+[ $status -ne 124 ] || fail "gfbench hung across the restart"
+grep -q " ok, " $DIR/during.log || fail "gfbench did not finish"
+kill -0 $PROXY 2>/dev/null || fail "webproxy died"
+# At most one request per client thread is in flight at the kill
+errors=$(sed -n 's/.* not found, \([0-9]*\) errors .*/\1/p' $DIR/during.log)
+[ "$errors" -le 8 ] ||
+    fail "$errors requests failed, more than were in flight"
+
+echo "after the restart:"
+./gfbench -p $PORT -t 8 -w $DIR/workload.txt -r 2000 > $DIR/after.log 2>&1
+status=$?
+cat $DIR/after.log
+[ $status -eq 0 ] || fail "requests failed after the restart"
+grep -q " 0 not found, 0 errors " $DIR/after.log ||
+    fail "requests failed after the restart"
+
+mkdir $DIR/dl
+(cd $DIR/dl && timeout 60 "$OLDPWD/gfclient_download" -p $PORT -t 4 -r 64 \
+    -w $DIR/workload.txt > $DIR/download.log 2>&1) ||
+    fail "downloads failed after the restart"
+i=0
+while [ $i -lt 64 ]; do
+	cmp -s $DIR/$i $DIR/dl/restart/$i || fail "/restart/$i came corrupted"
+	i=$((i + 1))
+done
+
+echo "PASS"
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Starts several webproxy instances against one simplecached, runs load
+# through all of them at once and checks that they stay out of each
+# other's way: every proxy got a namespace of its own, its segments all
+# carry it, and every request through every proxy is served with the
+# right bytes.
+#
+# usage: sh test_proxies.sh [nproxies]
+#
+# Run from the source tree after make.  Exits 1 on failure.
+
+NPROXIES=${1:-4}
+PORT=${PORT:-18900}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+PROXIES=
+trap 'kill $PROXIES $CACHE 2>/dev/null; rm -rf $DIR' EXIT
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+i=0
+while [ $i -lt 32 ]; do
+	head -c $((4096 + i * 8192)) /dev/urandom > $DIR/$i
+	echo "/proxies/$i $DIR/$i" >> $DIR/locals.txt
+	echo "/proxies/$i" >> $DIR/workload.txt
+	i=$((i + 1))
+done
+
+./simplecached -c $DIR/locals.txt -t 4 > $DIR/cached.log 2>&1 &
+CACHE=$!
+sleep 0.5
+p=0
+while [ $p -lt $NPROXIES ]; do
+	./webproxy -p $((PORT + p)) -t 4 -n 4 -z 8192 > $DIR/proxy$p.log 2>&1 &
+	PROXIES="$PROXIES $!"
+	p=$((p + 1))
+done
+sleep 1
+
+p=0
+while [ $p -lt $NPROXIES ]; do
+	sed -n 's/^Registered with simplecached as //p' $DIR/proxy$p.log \
+	    >> $DIR/namespaces
+	p=$((p + 1))
+done
+[ $(sort -u $DIR/namespaces | wc -l) -eq $NPROXIES ] ||
+    fail "namespaces collide: $(cat $DIR/namespaces)"
+for ns in $(cat $DIR/namespaces); do
+	[ $(ls /dev/shm | grep -c "^$ns\.m") -ge 4 ] ||
+	    fail "the segments of $ns are missing"
+done
+echo "namespaces:" $(cat $DIR/namespaces)
+
+# Load on every proxy at once, each client checking what it got
+p=0
+BENCHES=
+while [ $p -lt $NPROXIES ]; do
+	./gfbench -p $((PORT + p)) -t 4 -w $DIR/workload.txt -r 2000 \
+	    > $DIR/bench$p.log 2>&1 &
+	BENCHES="$BENCHES $!"
+	mkdir $DIR/dl$p
+	(cd $DIR/dl$p && "$OLDPWD/gfclient_download" -p $((PORT + p)) -t 2 \
+	    -r 32 -w $DIR/workload.txt > $DIR/download$p.log 2>&1) &
+	BENCHES="$BENCHES $!"
+	p=$((p + 1))
+done
+failed=0
+for pid in $BENCHES; do
+	wait $pid || failed=1
+done
+
+p=0
+while [ $p -lt $NPROXIES ]; do
+	echo "proxy $p: $(head -1 $DIR/bench$p.log)"
+	grep -q " 0 not found, 0 errors " $DIR/bench$p.log ||
+	    fail "requests through proxy $p failed"
+	i=0
+	while [ $i -lt 32 ]; do
+		cmp -s $DIR/$i $DIR/dl$p/proxies/$i ||
+		    fail "/proxies/$i came corrupted through proxy $p"
+		i=$((i + 1))
+	done
+	p=$((p + 1))
+done
+[ $failed -eq 0 ] || fail "a client failed"
+
+echo "PASS"
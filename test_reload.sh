@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Changes the cache list of a running simplecached and sends it SIGHUP,
+# then checks that the proxy serves what the new list says: a key that
+# was added (which the old key filter would turn away), the new file of
+# a key whose copy sat in the proxy's L1 cache, and no longer the key
+# that was removed.  A list that cannot be read leaves the cache as it
+# was.
+#
+# usage: sh test_reload.sh [cache options]
+#
+# Run from the source tree after make.  The cache options, e.g. -u 8,
+# go to simplecached.  Exits 1 on failure.
+
+PORT=${PORT:-18895}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+# Not SIGKILL: on SIGTERM both clean up after themselves in /dev/shm
+cleanup() {
+	kill $PROXY $CACHE 2>/dev/null
+	wait $PROXY $CACHE 2>/dev/null
+	rm -rf $DIR
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+# fetch path: downloads path into $DIR/dl
+fetch() {
+	rm -rf $DIR/dl
+	mkdir $DIR/dl
+	echo "$1" > $DIR/fetch.txt
+	(cd $DIR/dl && timeout 20 "$OLDPWD/gfclient_download" -p $PORT -t 1 \
+	    -r 1 -w $DIR/fetch.txt > $DIR/fetch.log 2>&1)
+}
+
+# reload: sends SIGHUP and waits for simplecached to log the outcome
+reload() {
+	before=$(grep -c -e "^Reloaded" -e "^reload of" $DIR/cached.log)
+	kill -HUP $CACHE
+	n=0
+	while [ $(grep -c -e "^Reloaded" -e "^reload of" $DIR/cached.log) \
+	    -eq $before ] && [ $n -lt 50 ]; do
+		sleep 0.1
+		n=$((n + 1))
+	done
+	# The proxy picks the new generation up with its next request
+	sleep 0.2
+}
+
+head -c 8192 /dev/urandom > $DIR/hot.old
+head -c 8192 /dev/urandom > $DIR/hot.new
+head -c 65536 /dev/urandom > $DIR/gone
+head -c 65536 /dev/urandom > $DIR/added
+printf "/reload/hot $DIR/hot.old\n/reload/gone $DIR/gone\n" > $DIR/locals.txt
+
+./simplecached -c $DIR/locals.txt -t 2 "$@" > $DIR/cached.log 2>&1 &
+CACHE=$!
+sleep 0.5
+./webproxy -p $PORT -t 2 -n 2 -z 8192 -c 65536 > $DIR/proxy.log 2>&1 &
+PROXY=$!
+sleep 0.5
+
+fetch /reload/hot
+cmp -s $DIR/hot.old $DIR/dl/reload/hot || fail "/reload/hot not served"
+# From the L1 cache this time
+fetch /reload/hot
+cmp -s $DIR/hot.old $DIR/dl/reload/hot || fail "/reload/hot not served"
+fetch /reload/gone
+cmp -s $DIR/gone $DIR/dl/reload/gone || fail "/reload/gone not served"
+fetch /reload/added
+[ -s $DIR/dl/reload/added ] && fail "/reload/added served before it was added"
+
+printf "/reload/hot $DIR/hot.new\n/reload/added $DIR/added\n" \
+    > $DIR/locals.txt
+reload
+grep -q "^Reloaded 2 keys" $DIR/cached.log || fail "simplecached did not reload"
+fetch /reload/hot
+cmp -s $DIR/hot.new $DIR/dl/reload/hot ||
+    fail "/reload/hot still served from before the reload"
+fetch /reload/added
+cmp -s $DIR/added $DIR/dl/reload/added || fail "/reload/added not served"
+fetch /reload/gone
+[ -s $DIR/dl/reload/gone ] && fail "/reload/gone served after it was removed"
+
+# A list that names a missing file keeps the cache as it was
+printf "/reload/hot $DIR/missing\n" > $DIR/locals.txt
+reload
+grep -q "^reload of" $DIR/cached.log ||
+    fail "simplecached did not report the failed reload"
+fetch /reload/added
+cmp -s $DIR/added $DIR/dl/reload/added ||
+    fail "/reload/added lost to a failed reload"
+kill -0 $CACHE 2>/dev/null || fail "simplecached died"
+
+echo "PASS"
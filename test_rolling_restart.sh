@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Runs gfbench through a webproxy with several worker processes (-P)
+# while the proxy does two rolling restarts (SIGHUP), and fails on any
+# request that does not come back whole.  Then stops the proxy while a
+# hung cache holds a transfer past the drain, and checks
+# that every worker, the replaced ones too, removed all of its segments
+# and semaphores: those the elastic pool (-N) added and the one still
+# checked out as well.
+#
+# usage: sh test_rolling_restart.sh [nprocs]
+#
+# Run from the source tree after make.  Exits 1 on failure.
+
+NPROCS=${1:-3}
+PORT=${PORT:-18894}
+
+cd "$(dirname "$0")" || exit 1
+DIR=$(mktemp -d)
+trap 'kill -9 $CACHE $PROXY $BENCH $STALLED 2>/dev/null; rm -rf $DIR' EXIT
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+i=0
+while [ $i -lt 64 ]; do
+	head -c $((4096 + i * 4096)) /dev/urandom > $DIR/$i
+	echo "/rolling/$i $DIR/$i" >> $DIR/locals.txt
+	echo "/rolling/$i" >> $DIR/workload.txt
+	i=$((i + 1))
+done
+
+./simplecached -c $DIR/locals.txt -t 4 > $DIR/cached.log 2>&1 &
+CACHE=$!
+sleep 0.5
+./webproxy -p $PORT -P $NPROCS -t 4 -n 2 -N 16 -G 1 -I 500 -D 500 -z 16384 \
+    > $DIR/proxy.log 2>&1 &
+PROXY=$!
+sleep 1
+
+timeout 120 ./gfbench -p $PORT -t 8 -w $DIR/workload.txt -r 15000 \
+    > $DIR/bench.log 2>&1 &
+BENCH=$!
+sleep 1
+kill -HUP $PROXY
+sleep 2
+kill -HUP $PROXY
+wait $BENCH
+status=$?
+cat $DIR/bench.log
+[ $status -ne 124 ] || fail "gfbench hung across the restarts"
+grep -q " 0 not found, 0 errors " $DIR/bench.log ||
+    fail "requests failed across the restarts"
+[ $status -eq 0 ] || fail "gfbench failed"
+
+# Long enough for the idle pools to shrink back
+sleep 2
+# A hung cache keeps a transfer, and its segment, past the drain
+kill -STOP $CACHE
+./gfbench -p $PORT -t 1 -w $DIR/workload.txt -r 1 > /dev/null 2>&1 &
+STALLED=$!
+sleep 1
+kill -TERM $PROXY
+wait $PROXY
+kill -CONT $CACHE
+kill $STALLED 2>/dev/null
+grep -q "connections still open after" $DIR/proxy.log ||
+    echo "(no transfer outlived the drain)"
+grep -q "Segment pool grew" $DIR/proxy.log ||
+    echo "(the segment pool never grew, the load was too light)"
+grep -q "Segment pool shrank" $DIR/proxy.log ||
+    echo "(the segment pool never shrank)"
+sed -n 's/^Registered with simplecached as //p' $DIR/proxy.log \
+    > $DIR/namespaces
+[ $(wc -l < $DIR/namespaces) -eq $((3 * NPROCS)) ] ||
+    fail "expected $((3 * NPROCS)) workers, got $(wc -l < $DIR/namespaces)"
+for ns in $(cat $DIR/namespaces); do
+	left=$(ls /dev/shm | grep -c -e "^$ns\." -e "^sem\.$ns\.")
+	[ $left -eq 0 ] || fail "$left objects of $ns left in /dev/shm"
+done
+
+echo "PASS"
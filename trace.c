@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+char *trace_kind_names[TRACE_NKINDS] = {
+	"proxy start", "segment", "queued", "proxy lookup", "proxy chunk",
+	"proxy finish", "cache recv", "cache start", "cache lookup",
+	"cache chunk", "cache finish"
+};
+
+static trace_ring_t *ring;
+static uint32_t next_id;
+static int32_t pid;
+static __thread int32_t tid;
+
+static trace_ring_t *_map(int fd, int prot)
+{
+	void *mem = mmap(NULL, sizeof(trace_ring_t), prot, MAP_SHARED, fd, 0);
+
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return (trace_ring_t *)mem;
+}
+
+/*
+ * Waits for the process that created the ring to size and initialize
+ * it, which only takes a moment.
+ */
+static trace_ring_t *_open_existing(int prot)
+{
+	struct timespec pause = { 0, 1000000 };
+	trace_ring_t *r;
+	struct stat st;
+	int fd, i;
+
+	if ((fd = shm_open(TRACE_NAME, prot & PROT_WRITE ? O_RDWR : O_RDONLY,
+	    0)) == -1) {
+		return NULL;
+	}
+	for (i = 0; i < 1000; i++) {
+		if (fstat(fd, &st) == 0 && st.st_size == sizeof(*r)) {
+			break;
+		}
+		nanosleep(&pause, NULL);
+	}
+	if (st.st_size != sizeof(*r)) {
+		fprintf(stderr, "%s has the wrong size, remove it\n", TRACE_NAME);
+		close(fd);
+		return NULL;
+	}
+	if (!(r = _map(fd, prot))) {
+		return NULL;
+	}
+	for (i = 0; i < 1000 && r->magic != TRACE_MAGIC; i++) {
+		nanosleep(&pause, NULL);
+	}
+	if (r->magic != TRACE_MAGIC) {
+		munmap(r, sizeof(*r));
+		return NULL;
+	}
+
+	return r;
+}
+
+int trace_init()
+{
+	trace_ring_t *r;
+	int fd;
+
+	pid = getpid();
+	fd = shm_open(TRACE_NAME, O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd == -1 && errno == EEXIST) {
+		ring = _open_existing(PROT_READ | PROT_WRITE);
+		return ring ? 0 : -1;
+	}
+	if (fd == -1) {
+		perror("shm_open");
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*r)) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	if (!(r = _map(fd, PROT_READ | PROT_WRITE))) {
+		return -1;
+	}
+	r->nevents = TRACE_EVENTS;
+	__sync_synchronize();
+	r->magic = TRACE_MAGIC;
+	ring = r;
+
+	return 0;
+}
+
+uint64_t trace_id()
+{
+	return (uint64_t)pid << 32 | __sync_add_and_fetch(&next_id, 1);
+}
+
+void trace_event(uint64_t id, trace_kind_t kind, uint32_t arg)
+{
+	struct timespec ts;
+	trace_event_t *e;
+	uint64_t slot;
+
+	if (!ring) {
+		return;
+	}
+	if (!tid) {
+		tid = syscall(SYS_gettid);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	slot = __sync_fetch_and_add(&ring->head, 1);
+	e = &ring->events[slot & (TRACE_EVENTS - 1)];
+	/* Marks the slot as being written until seq is set again below */
+	e->seq = 0;
+	__sync_synchronize();
+	e->ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	e->id = id;
+	e->kind = kind;
+	e->arg = arg;
+	e->pid = pid;
+	e->tid = tid;
+	__sync_synchronize();
+	e->seq = slot + 1;
+}
+
+trace_ring_t *trace_attach()
+{
+	return _open_existing(PROT_READ);
+}
@@ -0,0 +1,72 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Request tracing.  webproxy and simplecached append timestamped events
+ * to a ring in the shared memory object TRACE_NAME, which tracedump
+ * turns into per-request timelines.  Every request gets a trace id in
+ * handle_with_cache that travels to simplecached in request_info, so
+ * the events of both processes line up.  Appending takes no lock: a
+ * writer claims a slot with an atomic increment of head and publishes
+ * it by writing seq last, so the reader can skip slots that are still
+ * being written or that were overwritten while it read them.
+ */
+#define TRACE_NAME    "/simplecache_trace"
+#define TRACE_MAGIC   0x74726331
+/* Number of events the ring holds, a power of two */
+#define TRACE_EVENTS  (1 << 16)
+
+typedef enum {
+	/* webproxy */
+	TRACE_PROXY_START,	/* a gfserver worker took the request */
+	TRACE_SEGMENT,		/* arg segments were acquired */
+	TRACE_QUEUED,		/* the request is on the cache's queue */
+	TRACE_PROXY_LOOKUP,	/* the cache answered, arg is the status */
+	TRACE_PROXY_CHUNK,	/* chunk arg was sent to the client */
+	TRACE_PROXY_FINISH,	/* the segment went back to the pool */
+	/* simplecached */
+	TRACE_CACHE_RECV,	/* received from the queue */
+	TRACE_CACHE_START,	/* a worker took the request */
+	TRACE_CACHE_LOOKUP,	/* lookup done, arg is 1 if found */
+	TRACE_CACHE_CHUNK,	/* chunk arg was handed to the proxy */
+	TRACE_CACHE_FINISH,	/* the worker is done with the request */
+	TRACE_NKINDS
+} trace_kind_t;
+
+typedef struct {
+	volatile uint64_t seq;	/* slot index + 1 once written */
+	uint64_t ts_ns;		/* CLOCK_MONOTONIC */
+	uint64_t id;
+	uint32_t kind;
+	uint32_t arg;
+	int32_t pid;
+	int32_t tid;
+} trace_event_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t nevents;
+	volatile uint64_t head;
+	trace_event_t events[TRACE_EVENTS];
+} trace_ring_t;
+
+extern char *trace_kind_names[TRACE_NKINDS];
+
+/*
+ * Maps the ring, creating it if this is the first process to trace.
+ * Until trace_init succeeds, trace_event does nothing.
+ */
+int trace_init();
+
+/* Returns a new trace id, unique across processes. */
+uint64_t trace_id();
+
+/* Appends an event for request id if tracing is on. */
+void trace_event(uint64_t id, trace_kind_t kind, uint32_t arg);
+
+/* Maps the ring read-only for tracedump.  Returns NULL on error. */
+trace_ring_t *trace_attach();
+
+#endif
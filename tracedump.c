@@ -0,0 +1,168 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  tracedump [options]\n"                                                     \
+"options:\n"                                                                  \
+"  -j                  Print Chrome trace JSON (chrome://tracing, Perfetto)\n" \
+"                      instead of text timelines\n"                           \
+"  -c                  Remove the trace ring after dumping it\n"              \
+"  -h                  Show this help message\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"json",               no_argument,            NULL,           'j'},
+  {"clear",              no_argument,            NULL,           'c'},
+  {"help",               no_argument,            NULL,           'h'},
+  {NULL,                 0,                      NULL,             0}
+};
+
+static int _event_cmp(const void *a, const void *b)
+{
+	const trace_event_t *x = a, *y = b;
+
+	if (x->id != y->id) {
+		return x->id < y->id ? -1 : 1;
+	}
+	if (x->ts_ns != y->ts_ns) {
+		return x->ts_ns < y->ts_ns ? -1 : 1;
+	}
+	return x->kind < y->kind ? -1 : x->kind > y->kind;
+}
+
+/*
+ * Copies the events still in the ring, skipping slots that are being
+ * written or that were overwritten while they were copied.  Returns the
+ * number of events copied into out.
+ */
+static int _snapshot(trace_ring_t *ring, trace_event_t *out)
+{
+	uint64_t head = ring->head, seq;
+	int i, n = 0;
+
+	for (i = 0; i < TRACE_EVENTS; i++) {
+		seq = ring->events[i].seq;
+		if (!seq || seq + TRACE_EVENTS <= head) {
+			continue;
+		}
+		__sync_synchronize();
+		out[n] = ring->events[i];
+		__sync_synchronize();
+		if (ring->events[i].seq == seq && out[n].seq == seq) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static void _print_text(trace_event_t *ev, int n)
+{
+	int i, start, end;
+
+	for (start = 0; start < n; start = end) {
+		for (end = start; end < n && ev[end].id == ev[start].id; end++)
+			;
+		printf("request %u.%u: %.1f us\n", (unsigned)(ev[start].id >> 32),
+		    (unsigned)ev[start].id,
+		    (ev[end - 1].ts_ns - ev[start].ts_ns) / 1e3);
+		for (i = start; i < end; i++) {
+			printf("  +%10.1f us  %-13s %5u  [%d/%d]\n",
+			    (ev[i].ts_ns - ev[start].ts_ns) / 1e3,
+			    trace_kind_names[ev[i].kind], ev[i].arg, ev[i].pid,
+			    ev[i].tid);
+		}
+	}
+}
+
+/*
+ * Every request becomes a row (its trace id) under the proxy process
+ * that issued it, with a span from each event to the next one.
+ */
+static void _print_json(trace_event_t *ev, int n)
+{
+	char *sep = "";
+	int i;
+
+	printf("{\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		if (i == 0 || ev[i - 1].id >> 32 != ev[i].id >> 32) {
+			printf("%s{\"name\":\"process_name\",\"ph\":\"M\","
+			    "\"pid\":%u,\"args\":{\"name\":\"webproxy %u\"}}",
+			    sep, (unsigned)(ev[i].id >> 32),
+			    (unsigned)(ev[i].id >> 32));
+			sep = ",\n";
+		}
+		printf("%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%s\","
+		    "\"ts\":%.3f,", sep, trace_kind_names[ev[i].kind],
+		    i + 1 < n && ev[i + 1].id == ev[i].id ? "X" : "i",
+		    ev[i].ts_ns / 1e3);
+		if (i + 1 < n && ev[i + 1].id == ev[i].id) {
+			printf("\"dur\":%.3f,",
+			    (ev[i + 1].ts_ns - ev[i].ts_ns) / 1e3);
+		} else {
+			printf("\"s\":\"t\",");
+		}
+		printf("\"pid\":%u,\"tid\":%u,\"args\":{\"arg\":%u,"
+		    "\"process\":%d,\"thread\":%d}}",
+		    (unsigned)(ev[i].id >> 32), (unsigned)ev[i].id,
+		    ev[i].arg, ev[i].pid, ev[i].tid);
+	}
+	printf("\n]}\n");
+}
+
+int main(int argc, char **argv)
+{
+	int option_char, json = 0, clear = 0, n;
+	trace_ring_t *ring;
+	trace_event_t *ev;
+
+	while ((option_char = getopt_long(argc, argv, "jch", gLongOptions,
+	    NULL)) != -1) {
+		switch (option_char) {
+			case 'j': // chrome trace
+				json = 1;
+				break;
+			case 'c': // clear
+				clear = 1;
+				break;
+			case 'h': // help
+				fprintf(stdout, "%s", USAGE);
+				exit(0);
+			default:
+				fprintf(stderr, "%s", USAGE);
+				exit(1);
+		}
+	}
+
+	if (!(ring = trace_attach())) {
+		fprintf(stderr, "no trace ring, run with -x first\n");
+		exit(1);
+	}
+	ev = malloc(TRACE_EVENTS * sizeof(*ev));
+	n = _snapshot(ring, ev);
+	qsort(ev, n, sizeof(*ev), _event_cmp);
+	if (json) {
+		_print_json(ev, n);
+	} else {
+		_print_text(ev, n);
+	}
+	if (ring->head > TRACE_EVENTS) {
+		fprintf(stderr, "%llu older events were overwritten\n",
+		    (unsigned long long)(ring->head - TRACE_EVENTS));
+	}
+	munmap(ring, sizeof(*ring));
+	if (clear) {
+		shm_unlink(TRACE_NAME);
+	}
+	free(ev);
+
+	return 0;
+}
@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+#include "uring.h"
+
+/* Newer than the installed headers may be */
+#ifndef IORING_OP_FUTEX_WAIT
+#define IORING_OP_FUTEX_WAIT 51
+#endif
+#ifndef FUTEX2_SIZE_U32
+#define FUTEX2_SIZE_U32      0x02
+#endif
+
+static int _setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, arg, argsz);
+}
+
+static int _register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = _setup(entries, &p);
+	if (ring->fd < 0) {
+		return -1;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			goto fail;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto fail;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+int uring_register_buffers(uring_t *ring, unsigned nbufs)
+{
+	struct io_uring_rsrc_register reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = nbufs;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	return _register(ring->fd, IORING_REGISTER_BUFFERS2, &reg,
+	    sizeof(reg)) < 0 ? -1 : 0;
+}
+
+int uring_register_buffer(uring_t *ring, unsigned index, void *addr,
+    size_t len)
+{
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov;
+
+	iov.iov_base = addr;
+	iov.iov_len = len;
+	memset(&up, 0, sizeof(up));
+	up.offset = index;
+	up.data = (uintptr_t)&iov;
+	up.nr = 1;
+
+	return _register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &up,
+	    sizeof(up)) < 0 ? -1 : 0;
+}
+
+int uring_prep_read(uring_t *ring, int fd, void *buf, size_t len,
+    off_t offset, int buf_index, unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->entries) {
+		return -1;
+	}
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = buf_index < 0 ? IORING_OP_READ : IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	if (buf_index >= 0) {
+		sqe->buf_index = buf_index;
+	}
+	sqe->user_data = user_data;
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] =
+	    ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+	ring->to_submit++;
+
+	return 0;
+}
+
+int uring_prep_futex_wait(uring_t *ring, uint32_t *futex, uint32_t val,
+    unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->entries) {
+		return -1;
+	}
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_FUTEX_WAIT;
+	/* A shared futex, it may live in memory of another process */
+	sqe->fd = FUTEX2_SIZE_U32;
+	sqe->addr = (uintptr_t)futex;
+	sqe->addr2 = val;
+	sqe->addr3 = FUTEX_BITSET_MATCH_ANY;
+	sqe->user_data = user_data;
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] =
+	    ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+	ring->to_submit++;
+
+	return 0;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned min_complete,
+    long long timeout_ns)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	unsigned to_submit;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = ring->to_submit;
+	if (min_complete) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	if (min_complete && timeout_ns > 0) {
+		ts.tv_sec = timeout_ns / 1000000000LL;
+		ts.tv_nsec = timeout_ns % 1000000000LL;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uintptr_t)&ts;
+		ret = _enter(ring->fd, to_submit, min_complete,
+		    flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	} else if (to_submit || min_complete) {
+		ret = _enter(ring->fd, to_submit, min_complete, flags, NULL, 0);
+	} else {
+		return 0;
+	}
+	if (ret < 0 && (errno == ETIME || errno == EINTR)) {
+		/* Nothing was submitted, the queued entries stay queued */
+		ret = 0;
+	}
+	if (ret > 0) {
+		ring->to_submit -= (unsigned)ret < to_submit ? ret : to_submit;
+	}
+
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_destroy(uring_t *ring)
+{
+	if (ring->fd < 0) {
+		return;
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
@@ -0,0 +1,90 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring wrapper built directly on the system calls, so
+ * that simplecached does not need liburing to be installed.
+ */
+typedef struct {
+	int fd;
+	unsigned entries;
+
+	/* Submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;
+	unsigned to_submit;
+
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} uring_t;
+
+/*
+ * Sets up a ring with room for entries submissions.  Returns 0 on
+ * success and -1 (with errno set) if io_uring is not available.
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/*
+ * Creates an empty table of nbufs registered buffers.  Slots are filled
+ * in with uring_register_buffer.  Returns -1 if the kernel does not
+ * support sparse buffer tables.
+ */
+int uring_register_buffers(uring_t *ring, unsigned nbufs);
+
+/* Registers (or replaces) the buffer in slot index. */
+int uring_register_buffer(uring_t *ring, unsigned index, void *addr,
+    size_t len);
+
+/*
+ * Queues a read of len bytes at offset from fd into buf.  If buf_index
+ * is not negative the read uses that registered buffer.  Returns -1
+ * if the submission queue is full.
+ */
+int uring_prep_read(uring_t *ring, int fd, void *buf, size_t len,
+    off_t offset, int buf_index, unsigned long long user_data);
+
+/*
+ * Queues a wait until the shared futex word at futex is woken, which
+ * completes at once (with -EAGAIN) if it no longer holds val.  Kernels
+ * before 6.7 complete it with -EINVAL.  Returns -1 if the submission
+ * queue is full.
+ */
+int uring_prep_futex_wait(uring_t *ring, uint32_t *futex, uint32_t val,
+    unsigned long long user_data);
+
+/*
+ * Submits the queued reads and waits until at least min_complete
+ * completions are available or timeout_ns has passed (0 waits without
+ * a timeout).  Returns the number of submitted entries or -1.
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned min_complete,
+    long long timeout_ns);
+
+/*
+ * Returns the next completion, or NULL if there is none.  The entry
+ * must be released with uring_cqe_seen before peeking again.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+void uring_destroy(uring_t *ring);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <getopt.h>
 #include <signal.h>
@@ -15,18 +16,48 @@
 #include <fcntl.h>
 #include <pthread.h>
 
+#include "affinity.h"
 #include "steque.h"
 #include "gfserver.h"
+#include "keepalive.h"
+#include "keyfilter.h"
+#include "l1cache.h"
+#include "shm_channel.h"
+#include "supervisor.h"
+#include "trace.h"
                                                                 \
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
 "  webproxy [options]\n"                                                     \
 "options:\n"                                                                  \
 "  -n [num_segments]   number of segments to use in communication with cache. (Default: 1)\n" \
+"  -N [max_segments]   Add segments while requests wait for one, up to this many,\n" \
+"                      and retire them when idle (Default: num_segments)\n" \
+"  -G [grow_ms]        Wait that adds a segment (Default: 2)\n"            \
+"  -I [idle_ms]        Cooldown before idle segments are retired (Default: 5000)\n" \
 "  -z [segment_size]   the size (in bytes) of the segments. (Default: 1024) \n"               \
 "  -p [listen_port]    Listen port (Default: 8888)\n"                         \
 "  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1000)\n"      \
 "  -s [server]         The server to connect to (Default: Udacity S3 instance)"\
+"  -a [cpu_list]       Pin worker threads to these CPUs, e.g. 0-3,8 and bind\n" \
+"                      segments to their NUMA nodes (Default: unpinned)\n"  \
+"  -T [timeout_ms]     Fail a request the cache stalls on this long (Default: 5000)\n" \
+"  -x                  Record request events in the trace ring (see tracedump)\n" \
+"  -k [idle_ms]        Keep connections open for more requests until idle this\n" \
+"                      long (Default: 0, one request per connection)\n"      \
+"  -K [max_requests]   Requests served on one kept-alive connection (Default: 100)\n" \
+"  -c [l1_size]        Serve the hottest small objects from up to l1_size\n" \
+"                      bytes inside the proxy (Default: 0, off)\n"          \
+"  -o [max_object]     Largest object kept there (Default: 16384)\n"        \
+"  -Q [quantum]        Fetch files from the cache quantum bytes at a time, taking\n" \
+"                      turns with the other transfers (Default: 0, whole files)\n" \
+"  -R [rate]           Send each response at most rate bytes/s (Default: 0, off)\n" \
+"  -S [stripes]        Move a large file through up to this many free segments\n" \
+"                      at once, each filled by its own cache thread (Default: 1)\n" \
+"  -P [nprocs]         Serve the port from this many worker processes, restarted\n" \
+"                      one at a time on SIGHUP (Default: 0, a single process)\n" \
+"  -D [drain_ms]       On SIGTERM, wait this long for open connections to finish\n" \
+"                      before exiting (Default: 10000)\n" \
 "  -h                  Show this help message\n"                              \
 "special options:\n"                                                          \
 "  -d [drop_factor]    Drop connects if f*t pending requests (Default: 5).\n"
@@ -35,56 +66,74 @@
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
   {"num_segments",  required_argument,      NULL,           'n'},
+  {"max_segments",  required_argument,      NULL,           'N'},
+  {"grow-ms",       required_argument,      NULL,           'G'},
+  {"idle-ms",       required_argument,      NULL,           'I'},
   {"segment_size",  required_argument,      NULL,           'z'},
   {"port",          required_argument,      NULL,           'p'},
   {"thread-count",  required_argument,      NULL,           't'},
   {"server",        required_argument,      NULL,           's'},         
+  {"cpus",          required_argument,      NULL,           'a'},
+  {"timeout",       required_argument,      NULL,           'T'},
+  {"trace",         no_argument,            NULL,           'x'},
+  {"keepalive",     required_argument,      NULL,           'k'},
+  {"max-requests",  required_argument,      NULL,           'K'},
+  {"l1-size",       required_argument,      NULL,           'c'},
+  {"l1-max-object", required_argument,      NULL,           'o'},
+  {"quantum",       required_argument,      NULL,           'Q'},
+  {"rate",          required_argument,      NULL,           'R'},
+  {"stripes",       required_argument,      NULL,           'S'},
+  {"processes",     required_argument,      NULL,           'P'},
+  {"drain-ms",      required_argument,      NULL,           'D'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
 
 extern ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg);
+int handle_with_cache_connect(char *ns, long timeout_ms);
 int handle_with_cache_init(steque_t *segfds_q, unsigned long segment_size,
-    pthread_mutex_t *segfds_q_mutex, pthread_cond_t *segfds_q_cond);
+    pthread_mutex_t *segfds_q_mutex, pthread_cond_t *segfds_q_cond,
+    cpu_set_t *cpus);
+void handle_with_cache_pace(size_t quantum, long rate);
+void handle_with_cache_stripes(int stripes);
+int handle_with_cache_pool(int max_segments, long grow_ms, long idle_ms);
+void handle_with_cache_report(FILE *out);
+void handle_with_cache_cleanup();
 
 static gfserver_t gfs;
 static steque_t segfds_q;
 static pthread_mutex_t segfds_q_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t segfds_q_cond = PTHREAD_COND_INITIALIZER;
+static sigset_t stop_signals;
+static long drain_ms = 10000;
 
 struct shm_info {
   int  memfd;
-  char mem_name[12];
-  char sem1_name[12];
-  char sem2_name[12];
+  char mem_name[MAX_SHM_NAME];
+  char sem1_name[MAX_SHM_NAME];
+  char sem2_name[MAX_SHM_NAME];
+  int  node;
 };
 
-static void _sig_handler(int signo){
-  struct shm_info *shm_blk;
+/*
+ * Waits for SIGINT or SIGTERM, lets the requests in flight finish and
+ * only then removes the segments and exits.
+ */
+static void *_shutdown(void *arg){
+  int signo, left;
 
-  if (signo == SIGINT || signo == SIGTERM){
-    gfserver_stop(&gfs);
-    pthread_mutex_lock(&segfds_q_mutex);
-    while (!steque_isempty(&segfds_q)) {
-        shm_blk = (struct shm_info *)steque_pop(&segfds_q);
-        if (shm_unlink(shm_blk->mem_name) == 0) {
-          fprintf(stdout, "Shared mem %s removed from system.\n",
-            shm_blk->mem_name);
-        }
-        if (sem_unlink(shm_blk->sem1_name) == 0) {
-          fprintf(stdout, "Semaphore %s removed from system.\n",
-            shm_blk->sem1_name);
-        }
-        if (sem_unlink(shm_blk->sem2_name) == 0) {
-          fprintf(stdout, "Semaphore %s removed from system.\n",
-            shm_blk->sem1_name);
-        }
-    }
-    pthread_mutex_unlock(&segfds_q_mutex);
-    pthread_cond_destroy(&segfds_q_cond);
-    pthread_mutex_destroy(&segfds_q_mutex);
-    exit(signo);
+  sigwait(&stop_signals, &signo);
+  keepalive_drain();
+  if ((left = supervisor_drain(drain_ms)) > 0) {
+    fprintf(stderr, "%d connections still open after %ld ms\n", left,
+      drain_ms);
   }
+  handle_with_cache_report(stdout);
+  l1cache_report(stdout);
+  keyfilter_report(stdout);
+  /* Also the segments that grew the pool and those still checked out */
+  handle_with_cache_cleanup();
+  exit(0);
 }
 
 
@@ -97,24 +146,40 @@ int main(int argc, char **argv) {
   unsigned long segment_size = 1024;
   char *server = "s3.amazonaws.com/content.udacity-data.com";
   struct shm_info *shm_blk;
-
-  if (signal(SIGINT, _sig_handler) == SIG_ERR){
-    fprintf(stderr,"Can't catch SIGINT...exiting.\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if (signal(SIGTERM, _sig_handler) == SIG_ERR){
-    fprintf(stderr,"Can't catch SIGTERM...exiting.\n");
-    exit(EXIT_FAILURE);
-  }
+  char ns[MAX_SHM_NAME];
+  cpu_set_t cpus;
+  int ncpus = 0;
+  long timeout_ms = 5000;
+  long idle_ms = 0;
+  int max_requests = 100;
+  size_t l1_size = 0;
+  size_t l1_max_object = 16384;
+  size_t quantum = 0;
+  long rate = 0;
+  int stripes = 1;
+  int max_segments = 0;
+  long grow_ms = 2;
+  long idle_ms_pool = 5000;
+  int nprocs = 0;
+  pthread_t stop_thread;
+  volatile uint64_t *generation;
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "n:z:p:t:s:h", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "n:N:G:I:z:p:t:s:a:T:xk:K:c:o:Q:R:S:P:D:h", gLongOptions,
    NULL)) != -1) {
     switch (option_char) {
       case 'n': // num segments
         nsegments = atoi(optarg);
         break;
+      case 'N': // most segments
+        max_segments = atoi(optarg);
+        break;
+      case 'G': // wait before growing
+        grow_ms = atol(optarg);
+        break;
+      case 'I': // cooldown before shrinking
+        idle_ms_pool = atol(optarg);
+        break;
       case 'z': // size of segments
         segment_size = atol(optarg);
         break;
@@ -127,6 +192,47 @@ int main(int argc, char **argv) {
       case 's': // file-path
         server = optarg;
         break;                                          
+      case 'a': // cpu list
+        if ((ncpus = affinity_parse(optarg, &cpus)) == -1) {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
+      case 'T': // cache timeout
+        timeout_ms = atol(optarg);
+        break;
+      case 'x': // request tracing
+        if (trace_init() != 0) {
+          fprintf(stderr, "tracing disabled\n");
+        }
+        break;
+      case 'k': // keep-alive idle timeout
+        idle_ms = atol(optarg);
+        break;
+      case 'K': // requests per connection
+        max_requests = atoi(optarg);
+        break;
+      case 'c': // L1 cache size
+        l1_size = atol(optarg);
+        break;
+      case 'o': // L1 largest object
+        l1_max_object = atol(optarg);
+        break;
+      case 'Q': // transfer quantum
+        quantum = atol(optarg);
+        break;
+      case 'R': // per-response pacing
+        rate = atol(optarg);
+        break;
+      case 'S': // stripes per transfer
+        stripes = atoi(optarg);
+        break;
+      case 'P': // worker processes
+        nprocs = atoi(optarg);
+        break;
+      case 'D': // drain timeout
+        drain_ms = atol(optarg);
+        break;
       case 'h': // help
         fprintf(stdout, "%s", USAGE);
         exit(0);
@@ -137,6 +243,26 @@ int main(int argc, char **argv) {
     }
   }
   
+  /* Workers run this same program again, and end up below */
+  if (nprocs > 0 && !supervisor_worker()) {
+    supervisor_run(nprocs, argv);
+  }
+
+  /*
+   * Every thread started from here on leaves SIGINT and SIGTERM to
+   * _shutdown, so none is interrupted in the middle of a transfer.
+   */
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  if (pthread_create(&stop_thread, NULL, _shutdown, NULL) != 0) {
+    fprintf(stderr, "Can't catch SIGINT and SIGTERM...exiting.\n");
+    exit(EXIT_FAILURE);
+  }
+  /* A client that goes away mid-transfer ends that transfer, not us */
+  signal(SIGPIPE, SIG_IGN);
+
   /* SHM initialization...*/
 
   /*Initializing server*/
@@ -145,41 +271,67 @@ int main(int argc, char **argv) {
   /*Setting options*/
   gfserver_setopt(&gfs, GFS_PORT, port);
   gfserver_setopt(&gfs, GFS_MAXNPENDING, 10);
-  gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_cache);
+  if (idle_ms > 0) {
+    keepalive_init(handle_with_cache, idle_ms, max_requests);
+    gfserver_setopt(&gfs, GFS_WORKER_FUNC, keepalive_handler);
+  } else {
+    gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_cache);
+  }
+
+  /*
+   * Get a namespace of our own from simplecached, so that other proxies
+   * sharing the cache never touch our segments and semaphores.  From here
+   * on the proxy notices when the cache dies and re-registers by itself.
+   */
+  if (handle_with_cache_connect(ns, timeout_ms) != 0) {
+    exit(1);
+  }
+  fprintf(stdout, "Registered with simplecached as %s\n", ns);
+  fflush(stdout);
+
+  /* The cache has created its generation counter by now */
+  if (l1_size) {
+    if ((generation = shm_channel_generation(0))) {
+      l1cache_init(l1_size, l1_max_object, generation);
+    } else {
+      fprintf(stderr, "L1 cache disabled\n");
+    }
+  }
 
   steque_init(&segfds_q);
   /* Create the segments */
   for (i = 0; i < nsegments; i++) {
     shm_blk = malloc(sizeof(*shm_blk));
-    snprintf(shm_blk->mem_name, sizeof(shm_blk->mem_name), "mem_%d", i);
-    if (shm_unlink(shm_blk->mem_name) == 0) {
-      fprintf(stdout, "Shared mem %s removed from system.\n",
-        shm_blk->mem_name);
+    shm_channel_name(shm_blk->mem_name, ns, "m", i);
+    /*
+     * Spread the segments over the nodes of the worker CPUs the same way
+     * the workers are, so every worker finds segments on its own node.
+     */
+    shm_blk->node = -1;
+    if (ncpus) {
+      shm_blk->node = affinity_node(affinity_cpu(&cpus, i % nworkerthreads));
     }
-    shm_blk->memfd = shm_open(shm_blk->mem_name, O_CREAT | O_RDWR | O_TRUNC,
-        0777);
+    shm_blk->memfd = shm_channel_create(shm_blk->mem_name, segment_size,
+        shm_blk->node);
     if (shm_blk->memfd < 0) {
-      perror("shm_open");
       exit(1);
     }
-    ftruncate(shm_blk->memfd, segment_size);
-    snprintf(shm_blk->sem1_name, sizeof(shm_blk->sem1_name), "sem_%d_1", i);
-    if (sem_unlink(shm_blk->sem1_name) == 0) {
-      fprintf(stdout, "Semaphore %s removed from system.\n",
-        shm_blk->sem1_name);
-    }
-    snprintf(shm_blk->sem2_name, sizeof(shm_blk->sem2_name), "sem_%d_2", i);
-    if (sem_unlink(shm_blk->sem2_name) == 0) {
-      fprintf(stdout, "Semaphore %s removed from system.\n",
-        shm_blk->sem2_name);
-    }
+    shm_channel_name(shm_blk->sem1_name, ns, "s1", i);
+    shm_channel_name(shm_blk->sem2_name, ns, "s2", i);
     steque_push(&segfds_q, shm_blk);
   }
   for(i = 0; i < nworkerthreads; i++)
     gfserver_setopt(&gfs, GFS_WORKER_ARG, i, server);
 
   handle_with_cache_init(&segfds_q, segment_size, &segfds_q_mutex,
-      &segfds_q_cond);
+      &segfds_q_cond, ncpus ? &cpus : NULL);
+  /* Pacing needs quanta to sleep between, about ten a second */
+  if (rate > 0 && !quantum) {
+    quantum = rate / 10 > segment_size ? rate / 10 : segment_size;
+  }
+  handle_with_cache_pace(quantum, rate > 0 ? rate : 0);
+  handle_with_cache_stripes(stripes);
+  handle_with_cache_pool(max_segments, grow_ms, idle_ms_pool);
 
   /*Loops forever*/
   gfserver_serve(&gfs);